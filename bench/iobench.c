@@ -0,0 +1,254 @@
+/* Throughput and latency measurement for the vdfuse benchmarks			*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+/* DESCRIPTION
+ * Runs one I/O pattern against a file for a fixed time and prints the result as a single line JSON
+ * object: operations, bytes, throughput, IOPS and the latency distribution including the tail.
+ * Every thread opens the file itself.  Sequential threads each stream through their own slice of
+ * the file, random threads pick block aligned offsets anywhere in it.  Every operation's latency is
+ * kept, so the percentiles are exact rather than bucketed.
+ *
+ * Usage: iobench [-p read|write|randread|randwrite] [-b block-size] [-t threads] [-s seconds]
+ *                [-l label] file
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+	int id;
+	uint64_t *lat;								// ns per operation
+	size_t count;
+	size_t capacity;
+	uint64_t errors;
+} Worker;
+
+static const char *file;
+static const char *label = "";
+static const char *pattern = "randread";
+static size_t blockSize = 4096;
+static int threads = 1;
+static double seconds = 5;
+static int writing, randomOffsets;
+static uint64_t blocks;
+static uint64_t deadline;
+
+static uint64_t
+now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+run (void *arg)
+{
+	Worker *w = arg;
+	uint64_t first = blocks * w->id / threads;
+	uint64_t slice = blocks * (w->id + 1) / threads - first;
+	uint64_t x = 0x9e3779b97f4a7c15ULL * (w->id + 1), n;
+	unsigned char *buf;
+	int fd;
+
+	if ((fd = open (file, writing ? O_WRONLY : O_RDONLY)) < 0)
+	{
+		w->errors++;
+		return NULL;
+	}
+	if (posix_memalign ((void **) &buf, 4096, blockSize) != 0)
+	{
+		close (fd);
+		w->errors++;
+		return NULL;
+	}
+	memset (buf, 0xa5 ^ w->id, blockSize);
+
+	for (n = 0; now () < deadline; n++)
+	{
+		uint64_t block, start;
+		ssize_t done;
+		if (randomOffsets)
+		{
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			block = x % blocks;
+		}
+		else
+			block = first + n % (slice ? slice : 1);
+
+		start = now ();
+		if (writing)
+			done = pwrite (fd, buf, blockSize, block * blockSize);
+		else
+			done = pread (fd, buf, blockSize, block * blockSize);
+		if (done != (ssize_t) blockSize)
+			w->errors++;
+
+		if (w->count == w->capacity)
+		{
+			size_t capacity = w->capacity ? w->capacity * 2 : 65536;
+			uint64_t *lat = realloc (w->lat, capacity * sizeof (uint64_t));
+			if (!lat)
+				break;
+			w->lat = lat;
+			w->capacity = capacity;
+		}
+		w->lat[w->count++] = now () - start;
+	}
+	if (writing && fsync (fd) < 0)
+		w->errors++;
+	free (buf);
+	close (fd);
+	return NULL;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile (const uint64_t *lat, size_t count, double p)
+{
+	size_t i = (size_t) (p * count);
+	if (count == 0)
+		return 0;
+	return lat[i < count ? i : count - 1] / 1000.0;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [-p read|write|randread|randwrite] [-b block-size] [-t threads] "
+					 "[-s seconds] [-l label] file\n", name);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	Worker *workers;
+	pthread_t *tids;
+	uint64_t *all, sum = 0, errors = 0, start, elapsed;
+	size_t count = 0, k;
+	off_t size;
+	int c, i, fd;
+
+	while ((c = getopt (argc, argv, "p:b:t:s:l:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'p':
+				pattern = optarg;
+				break;
+			case 'b':
+				blockSize = strtoul (optarg, NULL, 0);
+				break;
+			case 't':
+				threads = atoi (optarg);
+				break;
+			case 's':
+				seconds = atof (optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			default:
+				usage (argv[0]);
+		}
+	}
+	if (argc - optind != 1 || blockSize == 0 || threads < 1 || seconds <= 0)
+		usage (argv[0]);
+	file = argv[optind];
+	writing = (strcmp (pattern, "write") == 0 || strcmp (pattern, "randwrite") == 0);
+	randomOffsets = (strncmp (pattern, "rand", 4) == 0);
+	if (!writing && strcmp (pattern, "read") != 0 && strcmp (pattern, "randread") != 0)
+		usage (argv[0]);
+
+	if ((fd = open (file, O_RDONLY)) < 0 || (size = lseek (fd, 0, SEEK_END)) < 0)
+	{
+		fprintf (stderr, "iobench: cannot open %s: %s\n", file, strerror (errno));
+		return 1;
+	}
+	close (fd);
+	if ((blocks = size / blockSize) == 0)
+	{
+		fprintf (stderr, "iobench: %s is smaller than one block\n", file);
+		return 1;
+	}
+
+	workers = calloc (threads, sizeof (Worker));
+	tids = calloc (threads, sizeof (pthread_t));
+	if (!workers || !tids)
+		return 1;
+	start = now ();
+	deadline = start + (uint64_t) (seconds * 1e9);
+	for (i = 0; i < threads; i++)
+	{
+		workers[i].id = i;
+		pthread_create (tids + i, NULL, run, workers + i);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		pthread_join (tids[i], NULL);
+		count += workers[i].count;
+		errors += workers[i].errors;
+	}
+	elapsed = now () - start;
+
+	if ((all = malloc ((count ? count : 1) * sizeof (uint64_t))) == NULL)
+		return 1;
+	count = 0;
+	for (i = 0; i < threads; i++)
+	{
+		memcpy (all + count, workers[i].lat, workers[i].count * sizeof (uint64_t));
+		count += workers[i].count;
+		free (workers[i].lat);
+	}
+	qsort (all, count, sizeof (uint64_t), compare);
+	for (k = 0; k < count; k++)
+		sum += all[k];
+
+	printf ("{\"label\": \"%s\", \"pattern\": \"%s\", \"block_size\": %zu, \"threads\": %d, "
+					"\"seconds\": %.3f, \"ops\": %zu, \"bytes\": %llu, \"errors\": %llu, "
+					"\"mib_per_s\": %.2f, \"iops\": %.1f, \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, "
+					"\"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f}}\n",
+					label, pattern, blockSize, threads, elapsed / 1e9, count,
+					(unsigned long long) count * blockSize, (unsigned long long) errors,
+					count * (double) blockSize / (1024 * 1024) / (elapsed / 1e9), count / (elapsed / 1e9),
+					count ? sum / 1000.0 / count : 0, percentile (all, count, 0.50),
+					percentile (all, count, 0.90), percentile (all, count, 0.99),
+					percentile (all, count, 0.999), count ? all[count - 1] / 1000.0 : 0);
+	free (all);
+	free (workers);
+	free (tids);
+	return errors ? 2 : 0;
+}
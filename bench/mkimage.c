@@ -0,0 +1,519 @@
+/* Synthetic disk image generator for the vdfuse benchmarks				*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+/* DESCRIPTION
+ * Writes a disk image holding an MBR with one primary and one extended partition, the extended one
+ * split into two logical partitions by a chain of EBRs, so every image mounts as EntireDisk plus
+ * Partition1, Partition5 and Partition6.  The image can be
+ *  *  raw:        a sparse file
+ *  *  vdi:        a dynamic VDI with 1 MiB blocks
+ *  *  vhd-fixed:  the raw data followed by a VHD footer
+ *  *  vhd:        a dynamic VHD with 2 MiB blocks
+ *  *  vmdk:       a monolithicSparse VMDK with 64 KiB grains
+ * The data is pseudo random and only depends on the seed, so the same command always writes the
+ * same image.  -a leaves the given percentage of 64 KiB chunks allocated and the rest unallocated
+ * (holes in raw images), to measure how the sparse formats cope with partly filled disks.
+ *
+ * Usage: mkimage [-a percent] [-s seed] format size-MiB output
+ */
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SECTORSIZE 512
+#define CHUNKSIZE (64 * 1024)
+#define CHUNKSECTORS (CHUNKSIZE / SECTORSIZE)
+#define ALIGNSECTORS 2048						// partitions start on 1 MiB boundaries
+
+#define VDI_BLOCKSIZE (1024 * 1024)
+#define VHD_BLOCKSIZE (2 * 1024 * 1024)
+#define VHD_EPOCH 946684800					// 2000-01-01 00:00:00 UTC, the VHD timestamp origin
+#define VMDK_GTES 512
+#define VMDK_DESCSECTORS 20
+
+static uint64_t seed = 1;
+static int allocPercent = 100;
+static uint64_t diskSize;
+
+// Sector offsets of the MBR and the two EBRs, filled in by layoutPartitions
+static uint64_t tableSector[3];
+static unsigned char tableData[3][SECTORSIZE];
+
+static void
+die (const char *format, const char *arg)
+{
+	fprintf (stderr, "mkimage: ");
+	fprintf (stderr, format, arg);
+	fprintf (stderr, "\n");
+	exit (1);
+}
+
+static uint64_t
+mix (uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static void
+putLE (unsigned char *p, uint64_t v, int bytes)
+{
+	int i;
+	for (i = 0; i < bytes; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void
+putBE (unsigned char *p, uint64_t v, int bytes)
+{
+	int i;
+	for (i = 0; i < bytes; i++)
+		p[i] = v >> (8 * (bytes - 1 - i));
+}
+
+static void
+writeAt (int fd, const void *buf, size_t len, uint64_t offset)
+{
+	if (pwrite (fd, buf, len, offset) != (ssize_t) len)
+		die ("write failed: %s", strerror (errno));
+}
+
+static void
+uuid (unsigned char *u, uint64_t salt)
+{
+	putLE (u, mix (seed ^ salt), 8);
+	putLE (u + 8, mix (seed ^ salt ^ 0x5555), 8);
+	u[6] = (u[6] & 0x0f) | 0x40;
+	u[8] = (u[8] & 0x3f) | 0x80;
+}
+
+//====================================================================================================
+//                                   Partition layout and disk contents
+//====================================================================================================
+
+static void
+partitionEntry (unsigned char *sector, int slot, int type, uint64_t start, uint64_t count)
+{
+	unsigned char *e = sector + 446 + 16 * slot;
+	memset (e, 0, 16);
+	e[4] = type;
+	putLE (e + 8, start, 4);
+	putLE (e + 12, count, 4);
+	sector[510] = 0x55;
+	sector[511] = 0xaa;
+}
+
+// Partition1 takes the first 40% of the disk and the extended partition the rest, split evenly
+// between Partition5 and Partition6.  Logical partition starts are relative to their EBR, the link
+// to the next EBR is relative to the start of the extended partition.
+static void
+layoutPartitions (void)
+{
+	uint64_t total = diskSize / SECTORSIZE;
+	uint64_t p1 = (total - ALIGNSECTORS) * 2 / 5 / ALIGNSECTORS * ALIGNSECTORS;
+	uint64_t ext = ALIGNSECTORS + p1;
+	uint64_t l5 = ((total - ext) / 2 - ALIGNSECTORS) / ALIGNSECTORS * ALIGNSECTORS;
+	uint64_t ebr2 = ext + ALIGNSECTORS + l5;
+
+	if (p1 == 0 || l5 == 0 || total - ebr2 <= ALIGNSECTORS)
+		die ("%s is too small for the partition layout", "the disk");
+	memset (tableData, 0, sizeof (tableData));
+	tableSector[0] = 0;
+	partitionEntry (tableData[0], 0, 0x83, ALIGNSECTORS, p1);
+	partitionEntry (tableData[0], 1, 0x05, ext, total - ext);
+	tableSector[1] = ext;
+	partitionEntry (tableData[1], 0, 0x83, ALIGNSECTORS, l5);
+	partitionEntry (tableData[1], 1, 0x05, ebr2 - ext, total - ebr2);
+	tableSector[2] = ebr2;
+	partitionEntry (tableData[2], 0, 0x83, ALIGNSECTORS, total - ebr2 - ALIGNSECTORS);
+}
+
+static int
+chunkAllocated (uint64_t chunk)
+{
+	int i;
+	for (i = 0; i < 3; i++)
+		if (tableSector[i] / CHUNKSECTORS == chunk)
+			return 1;
+	return mix (seed ^ (chunk << 20) ^ 0xa110c) % 100 < (uint64_t) allocPercent;
+}
+
+// Fills buf with CHUNKSIZE bytes of disk contents and returns whether the chunk is allocated
+static int
+chunkData (uint64_t chunk, unsigned char *buf)
+{
+	uint64_t *w = (uint64_t *) buf;
+	uint64_t x = mix (seed ^ chunk);
+	size_t i;
+
+	if (!chunkAllocated (chunk))
+	{
+		memset (buf, 0, CHUNKSIZE);
+		return 0;
+	}
+	for (i = 0; i < CHUNKSIZE / sizeof (uint64_t); i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		w[i] = x;
+	}
+	for (i = 0; i < 3; i++)
+		if (tableSector[i] / CHUNKSECTORS == chunk)
+			memcpy (buf + (tableSector[i] % CHUNKSECTORS) * SECTORSIZE, tableData[i], SECTORSIZE);
+	return 1;
+}
+
+// Whether any chunk of the block of blockSize bytes starting at offset is allocated
+static int
+blockAllocated (uint64_t offset, uint32_t blockSize)
+{
+	uint64_t c;
+	for (c = offset / CHUNKSIZE; c < (offset + blockSize) / CHUNKSIZE && c * CHUNKSIZE < diskSize; c++)
+		if (chunkAllocated (c))
+			return 1;
+	return 0;
+}
+
+// Writes the disk contents from offset for len bytes at file offset at
+static void
+writeData (int fd, uint64_t offset, uint64_t len, uint64_t at, int sparse)
+{
+	unsigned char buf[CHUNKSIZE];
+	uint64_t done;
+
+	for (done = 0; done < len && offset + done < diskSize; done += CHUNKSIZE)
+		if (chunkData ((offset + done) / CHUNKSIZE, buf) || !sparse)
+			writeAt (fd, buf, CHUNKSIZE, at + done);
+}
+
+//====================================================================================================
+//                                             Image writers
+//====================================================================================================
+
+static void
+writeRaw (int fd)
+{
+	if (ftruncate (fd, diskSize) < 0)
+		die ("cannot size the image: %s", strerror (errno));
+	writeData (fd, 0, diskSize, 0, 1);
+}
+
+static void
+writeVDI (int fd)
+{
+	uint32_t nBlocks = (diskSize + VDI_BLOCKSIZE - 1) / VDI_BLOCKSIZE;
+	uint32_t mapSize = (nBlocks * 4 + SECTORSIZE - 1) / SECTORSIZE * SECTORSIZE;
+	uint64_t dataOffset = (SECTORSIZE + mapSize + VDI_BLOCKSIZE - 1) / VDI_BLOCKSIZE * VDI_BLOCKSIZE;
+	unsigned char h[SECTORSIZE];
+	unsigned char *map = malloc (mapSize);
+	uint32_t b, allocated = 0;
+
+	if (!map)
+		die ("%s", "out of memory");
+	memset (map, 0, mapSize);
+	for (b = 0; b < nBlocks; b++)
+	{
+		uint64_t offset = (uint64_t) b * VDI_BLOCKSIZE;
+		if (!blockAllocated (offset, VDI_BLOCKSIZE))
+		{
+			putLE (map + 4 * b, 0xffffffffU, 4);
+			continue;
+		}
+		putLE (map + 4 * b, allocated, 4);
+		writeData (fd, offset, VDI_BLOCKSIZE, dataOffset + (uint64_t) allocated * VDI_BLOCKSIZE, 0);
+		allocated++;
+	}
+
+	memset (h, 0, sizeof (h));
+	strcpy ((char *) h, "<<< Oracle VM VirtualBox Disk Image >>>\n");
+	putLE (h + 64, 0xbeda107fU, 4);				// signature
+	putLE (h + 68, 0x00010001, 4);				// version 1.1
+	putLE (h + 72, 400, 4);								// header size
+	putLE (h + 76, 1, 4);									// normal (dynamic) image
+	putLE (h + 340, SECTORSIZE, 4);				// block map offset
+	putLE (h + 344, dataOffset, 4);
+	putLE (h + 360, SECTORSIZE, 4);				// legacy geometry sector size
+	putLE (h + 368, diskSize, 8);
+	putLE (h + 376, VDI_BLOCKSIZE, 4);
+	putLE (h + 384, nBlocks, 4);
+	putLE (h + 388, allocated, 4);
+	uuid (h + 392, 1);										// creation
+	uuid (h + 408, 2);										// modification
+	putLE (h + 468, SECTORSIZE, 4);				// LCHS geometry sector size
+	writeAt (fd, h, sizeof (h), 0);
+	writeAt (fd, map, mapSize, SECTORSIZE);
+	if (ftruncate (fd, dataOffset + (uint64_t) allocated * VDI_BLOCKSIZE) < 0)
+		die ("cannot size the image: %s", strerror (errno));
+	free (map);
+}
+
+static uint32_t
+vhdChecksum (const unsigned char *p, size_t len)
+{
+	uint32_t sum = 0;
+	size_t i;
+	for (i = 0; i < len; i++)
+		sum += p[i];
+	return ~sum;
+}
+
+// The CHS geometry algorithm from the VHD specification
+static uint32_t
+vhdGeometry (void)
+{
+	uint64_t total = diskSize / SECTORSIZE;
+	uint32_t spt, heads, cth;
+
+	if (total > 65535ULL * 16 * 255)
+		total = 65535ULL * 16 * 255;
+	if (total >= 65535ULL * 16 * 63)
+	{
+		spt = 255;
+		heads = 16;
+		cth = total / spt;
+	}
+	else
+	{
+		spt = 17;
+		cth = total / spt;
+		heads = (cth + 1023) / 1024;
+		if (heads < 4)
+			heads = 4;
+		if (cth >= heads * 1024 || heads > 16)
+		{
+			spt = 31;
+			heads = 16;
+			cth = total / spt;
+		}
+		if (cth >= heads * 1024)
+		{
+			spt = 63;
+			heads = 16;
+			cth = total / spt;
+		}
+	}
+	return ((cth / heads) << 16) | (heads << 8) | spt;
+}
+
+static void
+vhdFooter (unsigned char *f, int dynamic)
+{
+	memset (f, 0, SECTORSIZE);
+	memcpy (f, "conectix", 8);
+	putBE (f + 8, 2, 4);									// features: reserved bit always set
+	putBE (f + 12, 0x00010000, 4);				// format version
+	putBE (f + 16, dynamic ? SECTORSIZE : ~0ULL, 8);	// dynamic header offset
+	putBE (f + 24, 1234567890 - VHD_EPOCH, 4);	// fixed, so images are reproducible
+	memcpy (f + 28, "vdfu", 4);
+	putBE (f + 32, 0x00010000, 4);
+	memcpy (f + 36, "Wi2k", 4);
+	putBE (f + 40, diskSize, 8);					// original size
+	putBE (f + 48, diskSize, 8);					// current size
+	putBE (f + 56, vhdGeometry (), 4);
+	putBE (f + 60, dynamic ? 3 : 2, 4);
+	uuid (f + 68, 3);
+	putBE (f + 64, vhdChecksum (f, SECTORSIZE), 4);
+}
+
+static void
+writeVHDFixed (int fd)
+{
+	unsigned char footer[SECTORSIZE];
+	writeRaw (fd);
+	vhdFooter (footer, 0);
+	writeAt (fd, footer, SECTORSIZE, diskSize);
+}
+
+static void
+writeVHD (int fd)
+{
+	uint32_t nBlocks = (diskSize + VHD_BLOCKSIZE - 1) / VHD_BLOCKSIZE;
+	uint32_t batSize = (nBlocks * 4 + SECTORSIZE - 1) / SECTORSIZE * SECTORSIZE;
+	uint64_t next = 3 * SECTORSIZE + batSize;			// footer copy, dynamic header, BAT
+	unsigned char footer[SECTORSIZE], d[2 * SECTORSIZE], bitmap[SECTORSIZE];
+	unsigned char *bat = malloc (batSize);
+	uint32_t b;
+
+	if (!bat)
+		die ("%s", "out of memory");
+	memset (bat, 0xff, batSize);
+	memset (bitmap, 0xff, sizeof (bitmap));
+	for (b = 0; b < nBlocks; b++)
+	{
+		uint64_t offset = (uint64_t) b * VHD_BLOCKSIZE;
+		if (!blockAllocated (offset, VHD_BLOCKSIZE))
+			continue;
+		putBE (bat + 4 * b, next / SECTORSIZE, 4);
+		writeAt (fd, bitmap, SECTORSIZE, next);
+		writeData (fd, offset, VHD_BLOCKSIZE, next + SECTORSIZE, 0);
+		next += SECTORSIZE + VHD_BLOCKSIZE;
+	}
+
+	memset (d, 0, sizeof (d));
+	memcpy (d, "cxsparse", 8);
+	putBE (d + 8, ~0ULL, 8);
+	putBE (d + 16, 3 * SECTORSIZE, 8);		// BAT offset
+	putBE (d + 24, 0x00010000, 4);
+	putBE (d + 28, nBlocks, 4);
+	putBE (d + 32, VHD_BLOCKSIZE, 4);
+	putBE (d + 36, vhdChecksum (d, sizeof (d)), 4);
+
+	vhdFooter (footer, 1);
+	writeAt (fd, footer, SECTORSIZE, 0);
+	writeAt (fd, d, sizeof (d), SECTORSIZE);
+	writeAt (fd, bat, batSize, 3 * SECTORSIZE);
+	writeAt (fd, footer, SECTORSIZE, next);
+	if (ftruncate (fd, next + SECTORSIZE) < 0)
+		die ("cannot size the image: %s", strerror (errno));
+	free (bat);
+}
+
+// A single file monolithicSparse VMDK: header, embedded descriptor, grain directory and grain
+// tables, then the allocated grains.  There is no redundant grain directory.
+static void
+writeVMDK (int fd, const char *output)
+{
+	uint64_t capacity = diskSize / SECTORSIZE;
+	uint64_t grains = (capacity + CHUNKSECTORS - 1) / CHUNKSECTORS;
+	uint32_t nGTs = (grains + VMDK_GTES - 1) / VMDK_GTES;
+	uint64_t gdOffset = 1 + VMDK_DESCSECTORS;
+	uint64_t gdSectors = (nGTs * 4 + SECTORSIZE - 1) / SECTORSIZE;
+	uint64_t gtOffset = gdOffset + gdSectors;
+	uint64_t overHead = (gtOffset + nGTs * 4 * VMDK_GTES / SECTORSIZE + CHUNKSECTORS - 1)
+		/ CHUNKSECTORS * CHUNKSECTORS;
+	uint64_t next = overHead, g;
+	unsigned char h[SECTORSIZE], buf[CHUNKSIZE];
+	char desc[VMDK_DESCSECTORS * SECTORSIZE];
+	unsigned char *gd = calloc (gdSectors, SECTORSIZE);
+	unsigned char *gt = calloc (nGTs, 4 * VMDK_GTES);
+	const char *name = strrchr (output, '/') ? strrchr (output, '/') + 1 : output;
+	uint32_t i;
+
+	if (!gd || !gt)
+		die ("%s", "out of memory");
+	for (i = 0; i < nGTs; i++)
+		putLE (gd + 4 * i, gtOffset + i * 4 * VMDK_GTES / SECTORSIZE, 4);
+	for (g = 0; g < grains; g++)
+	{
+		if (!chunkData (g, buf))
+			continue;
+		putLE (gt + 4 * g, next, 4);
+		writeAt (fd, buf, CHUNKSIZE, next * SECTORSIZE);
+		next += CHUNKSECTORS;
+	}
+
+	memset (h, 0, sizeof (h));
+	memcpy (h, "KDMV", 4);
+	putLE (h + 4, 1, 4);									// version
+	putLE (h + 8, 1, 4);									// flags: valid new line detection test
+	putLE (h + 12, capacity, 8);
+	putLE (h + 20, CHUNKSECTORS, 8);			// grain size
+	putLE (h + 28, 1, 8);									// descriptor offset
+	putLE (h + 36, VMDK_DESCSECTORS, 8);
+	putLE (h + 44, VMDK_GTES, 4);
+	putLE (h + 56, gdOffset, 8);
+	putLE (h + 64, overHead, 8);
+	memcpy (h + 73, "\n \r\n", 4);
+	memset (desc, 0, sizeof (desc));
+	snprintf (desc, sizeof (desc),
+						"# Disk DescriptorFile\n"
+						"version=1\n"
+						"CID=%08x\n"
+						"parentCID=ffffffff\n"
+						"createType=\"monolithicSparse\"\n"
+						"\n"
+						"# Extent description\n"
+						"RW %llu SPARSE \"%s\"\n"
+						"\n"
+						"# The Disk Data Base\n"
+						"#DDB\n"
+						"ddb.virtualHWVersion = \"4\"\n"
+						"ddb.adapterType = \"ide\"\n"
+						"ddb.geometry.cylinders = \"%llu\"\n"
+						"ddb.geometry.heads = \"16\"\n"
+						"ddb.geometry.sectors = \"63\"\n",
+						(unsigned) mix (seed), (unsigned long long) capacity, name,
+						(unsigned long long) (capacity / (16 * 63) ? capacity / (16 * 63) : 1));
+	writeAt (fd, h, sizeof (h), 0);
+	writeAt (fd, desc, sizeof (desc), SECTORSIZE);
+	writeAt (fd, gd, gdSectors * SECTORSIZE, gdOffset * SECTORSIZE);
+	writeAt (fd, gt, nGTs * 4 * VMDK_GTES, gtOffset * SECTORSIZE);
+	if (ftruncate (fd, next * SECTORSIZE) < 0)
+		die ("cannot size the image: %s", strerror (errno));
+	free (gd);
+	free (gt);
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *format, *output;
+	int c, fd;
+
+	while ((c = getopt (argc, argv, "a:s:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'a':
+				allocPercent = atoi (optarg);
+				break;
+			case 's':
+				seed = strtoull (optarg, NULL, 0);
+				break;
+			default:
+				fprintf (stderr, "Usage: %s [-a percent] [-s seed] raw|vdi|vhd-fixed|vhd|vmdk size-MiB output\n",
+								 argv[0]);
+				return 1;
+		}
+	}
+	if (argc - optind != 3)
+		die ("%s", "expected a format, a size in MiB and an output file (-h for help)");
+	format = argv[optind];
+	diskSize = strtoull (argv[optind + 1], NULL, 0) * 1024 * 1024;
+	output = argv[optind + 2];
+	if (allocPercent < 0 || allocPercent > 100)
+		die ("%s", "-a takes a percentage");
+	layoutPartitions ();
+
+	if ((fd = open (output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		die ("cannot create %s", output);
+	if (strcmp (format, "raw") == 0)
+		writeRaw (fd);
+	else if (strcmp (format, "vdi") == 0)
+		writeVDI (fd);
+	else if (strcmp (format, "vhd-fixed") == 0)
+		writeVHDFixed (fd);
+	else if (strcmp (format, "vhd") == 0)
+		writeVHD (fd);
+	else if (strcmp (format, "vmdk") == 0)
+		writeVMDK (fd, output);
+	else
+		die ("unknown image format %s", format);
+	if (close (fd) < 0)
+		die ("cannot write %s", output);
+	return 0;
+}
@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# Benchmarks vdfuse across image formats, I/O patterns, block sizes and thread counts and
+# writes the results as JSON.  Run through "make bench", or directly once vdfuse, mkimage and
+# iobench are built.
+#
+# Usage: bench/run.sh [results.json]
+#
+# For each format mkimage writes a synthetic image with an MBR and EBR partition layout, which is
+# mounted read-write with direct_io so that the kernel page cache does not hide the cost of going
+# through vdfuse.  iobench then runs every pattern against Partition5, a logical partition, so the
+# EBR chain is exercised too.  Reads run before writes and see the generated data.  The image
+# files themselves still go through the host page cache unless BENCH_OPTIONS has odirect.
+# Formats the backend cannot mount writable (VMDK with --enable-native-backend) are listed under
+# "skipped".
+#
+# Environment:
+#   VDFUSE, MKIMAGE, IOBENCH    the programs to use (default: the ones in the build directory)
+#   BENCH_FORMATS               image formats (default: raw vdi vhd-fixed vhd vmdk)
+#   BENCH_SIZE_MB               virtual disk size (default 256)
+#   BENCH_ALLOC                 percentage of the image that holds data (default 100)
+#   BENCH_PATTERNS              iobench patterns (default: read randread write randwrite)
+#   BENCH_BLOCK_SIZES           block sizes in bytes (default: 4096 65536 1048576)
+#   BENCH_THREADS               thread counts (default: 1 4 16)
+#   BENCH_SECONDS               duration of each run (default 5)
+#   BENCH_OPTIONS               extra -o options for vdfuse, e.g. writeback,threads=16
+#   BENCH_DIR                   where images are written (default: a temporary directory)
+
+BUILD_DIR="$(pwd)"
+VDFUSE="${VDFUSE:-${BUILD_DIR}/vdfuse}"
+MKIMAGE="${MKIMAGE:-${BUILD_DIR}/bench/mkimage}"
+IOBENCH="${IOBENCH:-${BUILD_DIR}/bench/iobench}"
+OUT="${1:-bench-results.json}"
+
+FORMATS="${BENCH_FORMATS:-raw vdi vhd-fixed vhd vmdk}"
+SIZE_MB="${BENCH_SIZE_MB:-256}"
+ALLOC="${BENCH_ALLOC:-100}"
+PATTERNS="${BENCH_PATTERNS:-read randread write randwrite}"
+BLOCK_SIZES="${BENCH_BLOCK_SIZES:-4096 65536 1048576}"
+THREADS="${BENCH_THREADS:-1 4 16}"
+SECONDS_PER_RUN="${BENCH_SECONDS:-5}"
+OPTIONS="direct_io${BENCH_OPTIONS:+,${BENCH_OPTIONS}}"
+
+for prog in "${VDFUSE}" "${MKIMAGE}" "${IOBENCH}"; do
+	if [ ! -x "${prog}" ]; then
+		echo "$0: ${prog} has not been built" >&2
+		exit 255
+	fi
+done
+
+WORK="${BENCH_DIR:-$(mktemp -d /tmp/vdfuse-bench.XXXXXX)}"
+MNT="${WORK}/mnt"
+RESULTS="${WORK}/results"
+mkdir -p "${MNT}"
+: > "${RESULTS}"
+
+cleanup() {
+	fusermount -u "${MNT}" 2>/dev/null
+	rmdir "${MNT}"
+	rm -f "${WORK}"/image.* "${RESULTS}"
+	[ -n "${BENCH_DIR}" ] || rmdir "${WORK}"
+}
+trap cleanup EXIT
+
+skipped=""
+for format in ${FORMATS}; do
+	image="${WORK}/image.${format}"
+	echo "${format}: generating a ${SIZE_MB} MiB image" >&2
+	if ! "${MKIMAGE}" -a "${ALLOC}" "${format}" "${SIZE_MB}" "${image}"; then
+		skipped="${skipped}${skipped:+, }\"${format}\""
+		continue
+	fi
+	if ! "${VDFUSE}" -o "${OPTIONS}" -f "${image}" "${MNT}"; then
+		echo "${format}: vdfuse could not mount the image, skipping" >&2
+		skipped="${skipped}${skipped:+, }\"${format}\""
+		rm -f "${image}"
+		continue
+	fi
+	tries=0
+	while [ ! -e "${MNT}/Partition5" ] && [ ${tries} -lt 50 ]; do
+		sleep 0.1
+		tries=$((tries + 1))
+	done
+
+	for pattern in ${PATTERNS}; do
+		for bs in ${BLOCK_SIZES}; do
+			for t in ${THREADS}; do
+				echo "${format}: ${pattern} bs=${bs} threads=${t}" >&2
+				"${IOBENCH}" -p "${pattern}" -b "${bs}" -t "${t}" -s "${SECONDS_PER_RUN}" \
+					-l "${format}" "${MNT}/Partition5" >> "${RESULTS}"
+			done
+		done
+	done
+
+	fusermount -u "${MNT}"
+	rm -f "${image}"
+done
+
+{
+	printf '{\n  "size_mb": %s,\n  "allocated_percent": %s,\n' "${SIZE_MB}" "${ALLOC}"
+	printf '  "vdfuse_options": "%s",\n  "skipped": [%s],\n  "results": [\n' "${OPTIONS}" "${skipped}"
+	sed -e 's/^/    /' -e '$!s/$/,/' "${RESULTS}"
+	printf '  ]\n}\n'
+} > "${OUT}"
+echo "Results written to ${OUT}" >&2
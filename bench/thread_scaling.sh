@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Measures aggregate read throughput of a read-only vdfuse mount as the number of
+# concurrent readers (and image handles, -o readers=N) goes from 1 to MAX_THREADS.
+#
+# Usage: bench/thread_scaling.sh image-file [max-threads] [MiB-per-thread]
+#
+# Each reader streams its own slice of EntireDisk with dd.  The mount uses direct_io so
+# that the kernel page cache does not hide the cost of going through vdfuse.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 image-file [max-threads] [MiB-per-thread]"
+	exit 255
+fi
+
+SCRIPT_DIR="$( cd "$( dirname "$0" )" && pwd )"
+VDFUSE="${VDFUSE:-${SCRIPT_DIR}/../vdfuse}"
+IMAGE="$1"
+MAX_THREADS="${2:-8}"
+MIB="${3:-64}"
+MNT=$(mktemp -d /tmp/vdfuse-bench.XXXXXX)
+
+cleanup() {
+	fusermount -u "${MNT}" 2>/dev/null
+	rmdir "${MNT}"
+}
+trap cleanup EXIT
+
+printf "%-8s %-12s %-10s\n" threads MiB/s seconds
+t=1
+while [ ${t} -le ${MAX_THREADS} ]; do
+	"${VDFUSE}" -r -o readers=${t},direct_io -f "${IMAGE}" "${MNT}" || exit 1
+	while [ ! -e "${MNT}/EntireDisk" ]; do sleep 0.1; done
+
+	start=$(date +%s.%N)
+	i=0
+	while [ ${i} -lt ${t} ]; do
+		dd if="${MNT}/EntireDisk" of=/dev/null bs=128k count=$((MIB * 8)) \
+			skip=$((i * MIB * 8)) 2>/dev/null &
+		i=$((i + 1))
+	done
+	wait
+	end=$(date +%s.%N)
+
+	fusermount -u "${MNT}"
+	echo "${t} ${start} ${end}" | awk -v mib=${MIB} \
+		'{ s = $3 - $2; printf "%-8d %-12.1f %-10.3f\n", $1, $1 * mib / s, s }'
+	t=$((t * 2))
+done
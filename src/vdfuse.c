@@ -18,10 +18,24 @@
 
 /* DESCRIPTION
  * This code is structured in the following sections:
- *  *  The main(argc, argv) routine including validation of arguments and call to fuse_main
- *  *  MBR and EBR parsing routines
- *  *  The Fuse callback routines for destroy ,flush ,getattr ,open, read, readdir, write
+ *  *  The main(argc, argv) routine including validation of arguments and mounting the image
+ *  *  MBR, EBR and GPT parsing routines
+ *  *  The images served and the pool of VD disk handles that lets reads run in parallel
+ *  *  The persistent cache that keeps image blocks on local disk from one mount to the next
+ *  *  The copy-on-write overlay that keeps writes out of the image
+ *  *  The block cache sitting between the Fuse callbacks and the disk handles
+ *  *  The allocation map that lets reads of unallocated image blocks skip the disk
+ *  *  The optional write-back buffer that coalesces small writes
+ *  *  Zero-copy reads for images that store the disk contiguously
+ *  *  Sequential read detection and the prefetch threads that feed the block cache
+ *  *  Per-operation counters and latency histograms published in /.stats
+ *  *  The asynchronous logger and the optional binary request trace
+ *  *  Exporting or hashing a partition without mounting the image
+ *  *  Serving the image over NBD on a unix socket instead of mounting it
+ *  *  The worker threads that take requests off the fuse channel
+ *  *  The Fuse callback routines for destroy ,flush ,fsync ,getattr ,lookup ,open, read, readdir, write
  *
+ * vdfuse uses the low-level fuse API, so files are identified by inode number rather than by path.
  * For further details on how this all works see http://fuse.sourceforge.net/
  *
  * VirtualBox provided an API to enable you to manipulate VD image files programmatically.
@@ -32,16 +46,27 @@
 #define FUSE_USE_VERSION 26
 #define _FILE_OFFSET_BITS 64
 #include <limits.h>
-#include <fuse.h>
+#include <dirent.h>
+#include <fuse_lowlevel.h>
 #include <errno.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include "config.h"
+#include "vdfuse.h"
+#include "vdimage.h"
 
 #ifdef __GNUC__
 #define UNUSED __attribute__ ((unused))
@@ -52,46 +77,178 @@
 #define IN_RING3
 #define BLOCKSIZE 512
 #define UNALLOCATED -1
-#define GETOPT_ARGS "rgvawt:s:f:dh?"
-#define HOSTPARTITION_MAX 100
+#define GETOPT_ARGS "rgvawt:s:f:m:o:x:H:n:dh?"
+#define EBR_CHAIN_MAX 1024					// guards against a looping chain of EBRs
+#define PARTITION_WINDOW (128 * 1024)	// bytes read at a time while parsing a partition table
 #define DIFFERENCING_MAX 100
+#define MANIFEST_LINE_MAX 4096
+#define DISKHANDLE_MAX 64
+#define DISKHANDLE_DEFAULT_RO 4
+#define CACHE_BLOCKSIZE (64 * 1024)
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_MB 16
+#define CACHE_MAXRUN 16						// most cache blocks fetched by a single DISKread
+#define READAHEAD_MIN (2 * CACHE_BLOCKSIZE)
+#define PERSIST_DEFAULT_MB 4096
+#define READAHEAD_DEFAULT_KB 4096
+#define READAHEAD_TRIGGER 2				// sequential reads seen before prefetching starts
+#define READAHEAD_QUEUE 64
+#define READAHEAD_THREADS_DEFAULT 2
+#define READAHEAD_THREADS_MAX 16
+#define WRITEBACK_DEFAULT_MB 64
+#define WRITEBACK_MAXRUN 16					// most dirty blocks written back by a single DISKwrite
+#define WRITEBACK_INTERVAL 5				// seconds dirty blocks may wait before being written back
+#define STATS_SHARDS 16
+#define STATS_BUCKETS 40						// latency histogram buckets, the last one open ended
+#define STATS_NAME ".stats"
+#define WORKER_THREADS_DEFAULT 8
+#define WORKER_THREADS_MAX 64
+#define ATTR_TIMEOUT_DEFAULT 60.0		// seconds the kernel may cache attributes and lookups
+#define ENTRY_TIMEOUT_DEFAULT 60.0
+#define LOG_LINE_MAX 240
+#define LOG_RING_SLOTS 256					// log lines buffered per thread
+#define TRACE_RING_SLOTS 4096				// trace records buffered per thread
+#define LOG_DRAIN_MS 10							// how often the log thread empties the buffers
 #define PNAMESIZE 15
 #define MBR_START 446
 #define EBR_START 446
 #define PARTTYPE_IS_EXTENDED(x) ((x) == 0x05 || (x) == 0x0f || (x) == 0x85)
+#define PARTTYPE_GPT 0xee						// protective MBR entry covering a GPT disk
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_ENTRIES_MAX 4096
+#define GPT_SECTOR_MAX 4096
+#define PARTITION_PREFIX "Partition"
 #define ENTIRE_DISK_STR "EntireDisk"
 
+typedef enum
+{
+	LOGLEVEL_ERROR,
+	LOGLEVEL_WARN,
+	LOGLEVEL_INFO,
+	LOGLEVEL_DEBUG
+} LogLevel;
+
+// A disabled level costs one comparison; the arguments are not even evaluated
+#define vlog(level, ...) \
+	do { if ((level) <= logLevel) logMessage ((level), __VA_ARGS__); } while (0)
+#define vbprintf(...) vlog (LOGLEVEL_INFO, __VA_ARGS__)
+
 void usageAndExit (char *optFormat, ...);
-void vbprintf (const char *format, ...);
+void logMessage (LogLevel level, const char *format, ...);
+void logOpen (void);
+void logStart (void);
+void logStop (void);
+void logCounters (uint64_t * dropped, uint64_t * limited, uint64_t * traced, uint64_t * traceDropped);
+void traceRecord (int op, int partition, uint64_t offset, uint64_t diskOffset, uint32_t len,
+									uint64_t start, int failed);
+void parseVdfuseOptions (char *optList);
+void readManifest (char *manifest);
 void vdErrorCallback (void *pvUser, int rc, const char *file, unsigned iLine,
 											const char *function, const char *format, va_list va);
-void initialisePartitionTable (void);
-int findPartition (const char *filename);
+struct Disk;
+struct Partition;
+int initialisePartitionTable (struct Disk *d);
+static struct PartitionTable *partitionsCurrent (struct Disk *d);
+int partitionsUpdate (struct Disk *d);
+static void partitionRetire (struct PartitionTable *old);
+static void invalidatePartitions (struct Disk *d, const struct PartitionTable *old);
+void partitionPin (int worker);
+void partitionUnpin (int worker);
+int findPartition (const struct PartitionTable *t, const char *name);
+static struct Disk *inodeImage (fuse_ino_t ino, int *n);
+static int inodePartition (fuse_ino_t ino, struct Disk **dp, struct Partition *part);
+static int inodeStat (fuse_ino_t ino, struct stat *stbuf);
 int detectDiskType (char **disktype, char *filename);
-static int VD_open (const char *c, struct fuse_file_info *i);
-static int VD_release (const char *name, struct fuse_file_info *fi);
-static int VD_read (const char *c, char *out, size_t len, off_t offset,
-										struct fuse_file_info *i UNUSED);
-static int VD_write (const char *c, const char *in, size_t len, off_t offset,
-										 struct fuse_file_info *i UNUSED);
-static int VD_flush (const char *p, struct fuse_file_info *i UNUSED);
-static int VD_readdir (const char *p, void *buf, fuse_fill_dir_t filler,
-											 off_t offset UNUSED, struct fuse_file_info *i UNUSED);
-static int VD_getattr (const char *p, struct stat *stbuf);
+struct Disk *diskAdd (char *name, char *file);
+void diskAddLayer (struct Disk *d, char *file);
+void diskResolveChain (struct Disk *d);
+int diskOpen (struct Disk *d);
+static int diskAccess (struct Disk *d);
+static int diskPartitions (struct Disk *d);
+int openDiskHandles (struct Disk *d);
+void cacheInit (void);
+int cacheRead (struct Disk *d, uint64_t offset, char *buf, size_t len);
+void cacheInvalidate (struct Disk *d, uint64_t offset, size_t len);
+void cacheReport (void);
+void cachePrefetch (struct Disk *d, uint64_t offset, uint64_t len);
+void sparseInit (struct Disk *d);
+int sparseRead (struct Disk *d, uint64_t offset, char *buf, size_t len);
+void sparsePrefetch (struct Disk *d, uint64_t offset, uint64_t len);
+void sparseMarkData (struct Disk *d, uint64_t offset, size_t len);
+uint64_t sparseDataBytes (struct Disk *d, uint64_t offset, uint64_t len);
+void writebackInit (void);
+void writebackOpen (struct Disk *d);
+int writebackFlush (struct Disk *d);
+int writebackFlushAll (void);
+int writebackSync (struct Disk *d);
+int writebackWrite (struct Disk *d, uint64_t offset, const char *buf, size_t len);
+int writebackRead (struct Disk *d, uint64_t offset, char *buf, size_t len);
+int writebackContains (struct Disk *d, uint64_t offset, size_t len);
+void writebackStart (void);
+void writebackStop (void);
+void zeroCopyInit (struct Disk *d);
+void readaheadStart (void);
+void readaheadStop (void);
+int exportFile (struct Disk *d, const char *name, const char *output, const char *hash);
+int nbdServe (struct Disk *d, const char *path);
+int sessionLoop (struct fuse_session *se, int threads);
+static void VD_lookup (fuse_req_t req, fuse_ino_t parent, const char *name);
+static void VD_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i);
+static void VD_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void VD_read (fuse_req_t req, fuse_ino_t ino, size_t len, off_t offset,
+										 struct fuse_file_info *i);
+static void VD_write (fuse_req_t req, fuse_ino_t ino, const char *in, size_t len,
+											off_t offset, struct fuse_file_info *i);
+static void VD_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i);
+static void VD_fsync (fuse_req_t req, fuse_ino_t ino, int datasync,
+											struct fuse_file_info *i);
+static void VD_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+												struct fuse_file_info *i UNUSED);
+static void VD_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i UNUSED);
+#if FUSE_VERSION >= 28
+static void VD_ioctl (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg UNUSED,
+											struct fuse_file_info *i, unsigned flags, const void *in_buf,
+											size_t in_bufsz, size_t out_bufsz);
+#endif
+void VD_init (void *u, struct fuse_conn_info *conn);
 void VD_destroy (void *u);
 
+// The disk is accessed through one of two backends chosen by ./configure: VirtualBox's VBoxDDU
+// library, or with --enable-native-backend the built-in raw/VDI/VHD reader in vdnative.c.  The
+// CONTAINER macros wrap a single opened image chain and the DISK macros the pool of them below.
+
+#ifdef USE_NATIVE_BACKEND
+#include "vdnative.h"
+
+#define RT_SUCCESS(rc) ((rc) >= 0)
+#define RT_FAILURE(rc) ((rc) < 0)
+#define VERR_NO_MEMORY (-ENOMEM)
+#define VERR_GENERAL_FAILURE (-EIO)
+#define DISK_THREADSAFE 1				// a single VDNative serves any number of threads
+
+typedef VDNative *DiskContainer;
+#define CONTAINERcreate(pd) vdNativeCreate (pd)
+#define CONTAINERopen(d,t,i) vdNativeOpen (d, i, imageReadonly)
+#define CONTAINERread(d,o,b,s) vdNativeRead (d,o,b,s)
+#define CONTAINERwrite(d,o,b,s) vdNativeWrite (d,o,b,s)
+#define CONTAINERflush(d) vdNativeFlush (d)
+#define CONTAINERsize(d) vdNativeSize (d)
+#define CONTAINERclose(d) vdNativeClose (d)
+#else
 #include <VBox/vd.h>
 
-#define DISKread(o,b,s) VDRead (hdDisk,o,b,s);
-#define DISKwrite(o,b,s) VDWrite (hdDisk,o,b,s);
-#define DISKclose VDCloseAll(hdDisk)
-#define DISKsize VDGetSize(hdDisk, 0)
-#define DISKflush VDFlush(hdDisk)
-#define DISKopen(t,i) \
-   if (RT_FAILURE(VDOpen(hdDisk,t , i, readonly ? VD_OPEN_FLAGS_READONLY : VD_OPEN_FLAGS_NORMAL, NULL))) \
-      usageAndExit("opening vbox image failed");
+#define DISK_THREADSAFE 0
+
+typedef PVBOXHDD DiskContainer;
+#define CONTAINERcreate(pd) VDCreate (&vdError, VDTYPE_HDD, pd)
+#define CONTAINERopen(d,t,i) \
+   VDOpen (d, t, i, imageReadonly ? VD_OPEN_FLAGS_READONLY : VD_OPEN_FLAGS_NORMAL, NULL)
+#define CONTAINERread(d,o,b,s) VDRead (d,o,b,s)
+#define CONTAINERwrite(d,o,b,s) VDWrite (d,o,b,s)
+#define CONTAINERflush(d) VDFlush (d)
+#define CONTAINERsize(d) VDGetSize (d, 0)
+#define CONTAINERclose(d) VDCloseAll (d)
 
-PVBOXHDD hdDisk;
 PVDINTERFACE pVDifs = NULL;
 VDINTERFACE vdError;
 VDINTERFACEERROR vdErrorCallbacks = {
@@ -99,6 +256,55 @@ VDINTERFACEERROR vdErrorCallbacks = {
 	//.enmInterface = VDINTERFACETYPE_ERROR,
 	.pfnError = vdErrorCallback
 };
+#endif
+
+#define DISKread(d,o,b,s) diskRead (d,o,b,s)
+#define DISKwrite(d,o,b,s) diskWrite (d,o,b,s)
+#define DISKclose(d) diskCloseAll (d)
+#define DISKsize(d) CONTAINERsize ((d)->handles[0].hdd)
+#define DISKflush(d) diskFlush (d)
+#define DISKopen(h,t,i) CONTAINERopen (h, t, i)
+
+// A VBOXHDD container is not safe for concurrent use, so each one is guarded by its own lock.
+// Read-only mounts open the image chain several times over so that FUSE worker threads can
+// read in parallel; writable mounts keep a single container so that every reader sees the
+// block allocations made by writes.  The native backend does its own locking and needs just one.
+
+typedef struct
+{
+	DiskContainer hdd;						// container with the whole image chain opened
+	pthread_mutex_t lock;					// serialises VD calls against this container
+} DiskHandle;
+
+typedef enum
+{
+	STAT_READ,
+	STAT_WRITE,
+	STAT_FLUSH,
+	STAT_FSYNC,
+	STAT_BACKEND_READ,
+	STAT_BACKEND_WRITE,
+	STAT_LOCK_WAIT,
+	STAT_COUNT
+} StatOp;
+
+uint64_t clockNs (void);
+uint64_t statNow (void);
+void statRecordNs (StatOp op, uint64_t ns, uint64_t bytes, int failed);
+void statRecord (StatOp op, uint64_t start, uint64_t bytes, int failed);
+char *statsReport (size_t *len);
+void cacheCounters (uint64_t * hits, uint64_t * misses);
+
+int diskReadImage (struct Disk *d, uint64_t offset, void *buf, size_t len);
+int diskWriteImage (struct Disk *d, uint64_t offset, const void *buf, size_t len);
+void persistOpen (struct Disk *d);
+void persistClose (struct Disk *d);
+int diskRead (struct Disk *d, uint64_t offset, void *buf, size_t len);
+int diskWrite (struct Disk *d, uint64_t offset, const void *buf, size_t len);
+int overlayOpen (struct Disk *d);
+void overlayClose (struct Disk *d);
+int diskFlush (struct Disk *d);
+void diskCloseAll (struct Disk *d);
 
 // Partition table information
 
@@ -118,7 +324,7 @@ typedef struct
 	uint32_t size;								// number of blocks in partition, in little-endian format
 } MBRentry;
 
-typedef struct
+typedef struct Partition
 {
 	char name[PNAMESIZE + 1];			// name of partition
 	off_t offset;									// offset into disk in bytes
@@ -127,6 +333,25 @@ typedef struct
 	MBRentry descriptor;					// copy of MBR / EBR descriptor that defines the partion
 } Partition;
 
+typedef struct
+{
+	uint64_t offset;
+	uint64_t len;
+} DiskRange;
+
+// One version of an image's partition table.  It is published whole and never changed afterwards;
+// a re-read that finds different partitions publishes a new version, see initialisePartitionTable.
+typedef struct PartitionTable
+{
+	uint64_t version;							// 1 for the table first read
+	int last;											// highest PartitionN, p[0] is EntireDisk
+	int nSources;
+	DiskRange *sources;						// the bytes of the image the table was parsed from
+	uint64_t retiredEpoch;				// see partitionRetire
+	struct PartitionTable *nextRetired;
+	Partition p[];
+} PartitionTable;
+
 #pragma pack( push )
 #pragma pack( 1 )
 
@@ -147,12 +372,112 @@ typedef struct
 	uint16_t signature;
 } EBRentry;
 
+typedef struct
+{																// See the UEFI specification, "GUID Partition Table (GPT) Disk Layout"
+	char signature[8];						// "EFI PART"
+	uint32_t revision;
+	uint32_t headerSize;					// bytes covered by headerCRC
+	uint32_t headerCRC;						// CRC-32 of the header with this field zeroed
+	uint32_t reserved;
+	uint64_t myLBA;								// where this copy of the header lives
+	uint64_t alternateLBA;				// where the other copy lives
+	uint64_t firstUsableLBA;
+	uint64_t lastUsableLBA;
+	uint8_t diskGUID[16];
+	uint64_t entriesLBA;					// start of the partition entry array
+	uint32_t nEntries;
+	uint32_t entrySize;
+	uint32_t entriesCRC;					// CRC-32 of the nEntries * entrySize entry array
+} GPTheader;
+
+typedef struct
+{
+	uint8_t typeGUID[16];					// all zeros for an unused entry
+	uint8_t uniqueGUID[16];
+	uint64_t firstLBA;
+	uint64_t lastLBA;							// inclusive
+	uint64_t attributes;
+	uint16_t name[36];						// UTF-16LE
+} GPTentry;
+
 #pragma pack( pop )
 
-Partition partitionTable[HOSTPARTITION_MAX + 1];	// Note the partitionTable[0] is reserved for the EntireDisk descriptor
-static int lastPartition = 0;
+// Everything vdfuse knows about one image chain.  A mount serves a single image from its root
+// directory, or with several -f options or a manifest (-m) one subdirectory per image.  The images
+// then share the block cache, the write-back limit and the threads, and each is only opened when
+// its directory is first looked into, so a mount of a long manifest starts straight away.
+
+typedef enum
+{
+	DISK_CLOSED,
+	DISK_OPEN,
+	DISK_FAILED										// the open failed and is not retried
+} DiskState;
+
+typedef enum
+{
+	PARTITIONS_UNREAD,						// nothing has looked into the image's directory yet
+	PARTITIONS_READ,
+	PARTITIONS_FAILED							// the table is invalid, the read is not retried
+} PartitionState;
+
+typedef struct Disk
+{
+	char *name;										// directory name when several images are served
+	int index;										// position in disks, part of the block cache key
+	fuse_ino_t inode;							// its directory: FUSE_ROOT_ID or IMAGE_INODE (index)
+	fuse_ino_t firstInode;				// inode of EntireDisk, see PARTITION_INODE
+	char *layerType[DIFFERENCING_MAX + 1];	// image chain, base image first
+	char *layerFile[DIFFERENCING_MAX + 1];
+	int layerCount;
+	struct stat fileStat;					// the base image's stat, basis of every file's attributes
+	pthread_mutex_t openLock;			// serialises the open on first access
+	DiskState state;
+	DiskHandle *handles;
+	int handleCount;
+	uint64_t size;
+	PartitionState partitionState;	// the table is read on the first lookup or readdir
+	PartitionTable *partitions;		// the current version, see partitionsCurrent
+	volatile int partitionsStale;	// a write reached the bytes the table was read from
+	pthread_mutex_t partLock;			// guards openFiles, opened and the reads of the partition table
+	struct OpenFile *openFiles;		// see open files
+	int opened;										// how many opened instances are there
+	volatile uint64_t cacheGeneration;	// see the block cache
+	uint64_t *sparseBits;					// see the sparse image map
+	unsigned sparseShift;
+	struct WriteBlock **writebackBuckets;	// see the write-back buffer
+	int writebackNBuckets;
+	volatile size_t writebackCount;
+	uint64_t writebackRetired;
+	int writebackError;
+	pthread_mutex_t writebackLock;
+	pthread_mutex_t writebackFlushLock;
+	VDImage zeroCopyImage;				// see zero-copy reads
+	int zeroCopyEnabled;
+	uint64_t **overlayLeaves;			// see the copy-on-write overlay, NULL without one
+	uint64_t overlayNLeaves;
+	int overlayFd;
+	volatile uint64_t overlayBlocks;
+	pthread_mutex_t overlayLock;
+	struct PersistCache *persist;	// see the persistent cache, NULL without one
+} Disk;
+
+static Disk **disks = NULL;			// in command line or manifest order
+static int diskCount = 0;
+static int multiImage = 0;			// serve each image from its own subdirectory
+
+// Inode numbers index the partition table directly: PartitionN is inode n + 3, after
+// FUSE_ROOT_ID for the directory and STATS_INODE for /.stats, so requests never have to look their
+// partition up by name.  With several images, image i has the IMAGE_INODES numbers from
+// IMAGE_INODE (i) on, its directory followed by its partitions; that is room for every partition
+// a GPT or an EBR chain can define.
+#define STATS_INODE (FUSE_ROOT_ID + 1)
+#define IMAGE_INODES (GPT_ENTRIES_MAX + 2)
+#define IMAGE_INODE(i) ((fuse_ino_t) (i) * IMAGE_INODES + STATS_INODE + 1)
+#define PARTITION_INODE(d,n) ((d)->firstInode + (fuse_ino_t) (n))
 
-static struct fuse_operations fuseOperations = {
+static struct fuse_lowlevel_ops fuseOperations = {
+	.lookup = VD_lookup,
 	.readdir = VD_readdir,
 	.getattr = VD_getattr,
 	.open = VD_open,
@@ -160,23 +485,49 @@ static struct fuse_operations fuseOperations = {
 	.read = VD_read,
 	.write = VD_write,
 	.flush = VD_flush,
+	.fsync = VD_fsync,
+	.init = VD_init,
+#if FUSE_VERSION >= 28
+	.ioctl = VD_ioctl,
+#endif
 	.destroy = VD_destroy
 };
 
 static struct fuse_args fuseArgs = FUSE_ARGS_INIT (0, NULL);
+static struct fuse_chan *fuseChannel = NULL;
 
-static struct stat VDfile_stat;
-
-static int verbose = 0;
+static LogLevel logLevel = LOGLEVEL_WARN;	// -v logs everything, or -o log_level=NAME
+static char *logFileName = NULL;	// -o log_file=PATH, otherwise stdout and stderr
+static int logRate = 0;					// most lines a thread may log per second (-o log_rate=N), 0 = no limit
+static char *traceFileName = NULL;	// binary request trace (-o trace=PATH)
 static int readonly = 0;
+static int imageReadonly = 0;		// the images are not written: -r, or an overlay takes the writes
 static int allowall = 0;				// allow all users to read from disk
 static int allowallw = 0;				// allow all users to write to disk
 static uid_t myuid = 0;
 static gid_t mygid = 0;
 static char *processName;
-static int entireDiskOpened = 0;
-static int partitionOpened = 0;
-static int opened = 0;					// how many opened instances are there
+static int readers = 0;					// number of read-only disk handles (-o readers=N)
+static int cacheMB = CACHE_DEFAULT_MB;	// size of the block cache (-o cache_mb=N), 0 disables it
+static int readaheadKB = READAHEAD_DEFAULT_KB;	// largest prefetch window (-o readahead_kb=N), 0 disables
+static int readaheadThreads = READAHEAD_THREADS_DEFAULT;
+static int zeroCopy = 1;				// serve reads from the image file by reference (-o zerocopy=0|1)
+static int imageIO = 0;					// built-in backend: VDNativeIO for image file access (-o io=MODE)
+static int imageDirect = 0;				// built-in backend: open the images with O_DIRECT (-o odirect)
+static int writeback = 0;				// buffer and coalesce writes (-o writeback)
+static int writebackMB = WRITEBACK_DEFAULT_MB;	// dirty memory limit (-o writeback_mb=N)
+static char *overlayDir = NULL;	// writes go to an overlay file in this directory (-o overlay=DIR)
+static int overlayCommit = 0;		// write the overlay into the image at unmount (-o overlay_commit)
+static char *persistDir = NULL;	// image blocks are kept on local disk in this directory (-o cache_dir=DIR)
+static int persistMB = PERSIST_DEFAULT_MB;	// most local disk used per image (-o cache_dir_mb=N)
+static char *fuseOpts = NULL;		// -o options not recognised by vdfuse are passed to fuse
+static int statsEnabled = 1;		// count operations and publish them in /.stats (-o stats=0|1)
+static int workerThreads = WORKER_THREADS_DEFAULT;	// threads serving fuse requests (-o threads=N)
+static double attrTimeout = ATTR_TIMEOUT_DEFAULT;	// -o attr_timeout=S
+static double entryTimeout = ENTRY_TIMEOUT_DEFAULT;	// -o entry_timeout=S
+static int bigWrites = 1;				// accept writes larger than a page (-o big_writes=0|1)
+static int splice = 0;					// move request data through pipes (-o splice=0|1)
+static unsigned maxWrite = 0;		// largest write request, 0 leaves fuse's default (-o max_write=N)
 
 //
 //====================================================================================================
@@ -187,14 +538,21 @@ int
 main (int argc, char **argv)
 {
 	char *diskType = "auto";
-	char *imagefilename = NULL;
+	char *manifest = NULL;
 	char *mountpoint = NULL;
+	char *exportName = NULL;
+	char *exportOutput = NULL;
+	char *hashName = NULL;
+	char *nbdSocket = NULL;
 	int debug = 0;
 	int foreground = 0;
+	struct fuse_session *se;
+	int ret;
 	char c;
-	int i;
+	int i, l;
 	char *differencing[DIFFERENCING_MAX];
 	int differencingLen = 0;
+	uint64_t started = clockNs ();
 
 	extern char *optarg;
 	extern int optind, optopt;
@@ -215,7 +573,7 @@ main (int argc, char **argv)
 				foreground = 1;
 				break;
 			case 'v':
-				verbose = 1;
+				logLevel = LOGLEVEL_DEBUG;
 				break;
 			case 'a':
 				allowall = 1;
@@ -228,12 +586,34 @@ main (int argc, char **argv)
 				diskType = (char *) optarg;
 				break;									// ignored if OLDAPI
 			case 's':
-				if (differencingLen == DIFFERENCING_MAX)
+// A differencing disk belongs to the image given before it, or to the first one if none was yet
+				if (diskCount > 0)
+					diskAddLayer (disks[diskCount - 1], (char *) optarg);
+				else if (differencingLen == DIFFERENCING_MAX)
 					usageAndExit ("Too many differencing disks");
-				differencing[differencingLen++] = (char *) optarg;
+				else
+					differencing[differencingLen++] = (char *) optarg;
 				break;
 			case 'f':
-				imagefilename = (char *) optarg;
+				diskAdd (NULL, (char *) optarg);
+				for (i = 0; i < differencingLen; i++)
+					diskAddLayer (disks[0], differencing[i]);
+				differencingLen = 0;
+				break;
+			case 'm':
+				manifest = (char *) optarg;
+				break;
+			case 'o':
+				parseVdfuseOptions ((char *) optarg);
+				break;
+			case 'x':
+				exportName = (char *) optarg;
+				break;
+			case 'H':
+				hashName = (char *) optarg;
+				break;
+			case 'n':
+				nbdSocket = (char *) optarg;
 				break;
 			case 'd':
 				foreground = 1;
@@ -248,50 +628,131 @@ main (int argc, char **argv)
 //
 // *** Validate the command line ***
 //
-	if (argc != optind + 1)
+	if (exportName && nbdSocket)
+		usageAndExit ("-x and -n cannot be combined");
+	if (exportName)
+	{
+// Exporting takes the output file where the mountpoint would be, and never writes the image
+		if (argc > optind + 1 || (argc == optind && !hashName))
+			usageAndExit ("-x needs an output file, or -H to only hash");
+		exportOutput = argv[optind];
+		readonly = 1;
+		overlayDir = NULL;
+		if (manifest || diskCount > 1)
+			usageAndExit ("-x exports from a single image");
+	}
+	else if (hashName)
+		usageAndExit ("-H needs -x to choose what to hash");
+	else if (nbdSocket)
+	{
+// Serving NBD takes the socket instead of a mountpoint
+		if (argc != optind)
+			usageAndExit ("-n serves the image on a socket, it takes no mountpoint");
+		if (manifest || diskCount > 1)
+			usageAndExit ("-n serves a single image");
+	}
+	else if (argc != optind + 1)
 		usageAndExit ("a single mountpoint must be specified");
-	mountpoint = argv[optind];
-	if (!mountpoint)
-		usageAndExit ("no mountpoint specified");
-	if (!imagefilename)
+	else
+		mountpoint = argv[optind];
+	if (hashName && strcmp (hashName, "sha256") != 0)
+		usageAndExit ("unknown hash %s, only sha256 is supported", hashName);
+	if (overlayDir && readonly)
+		usageAndExit ("an overlay takes the writes of a writable mount, it cannot be used with -r");
+	if (overlayDir)
+	{
+// fuse changes to / when it daemonises, and the overlay files are only created after that
+		char *dir = realpath (overlayDir, NULL);
+		if (!dir || access (dir, W_OK | X_OK) < 0)
+			usageAndExit ("cannot create overlay files in %s", overlayDir);
+		overlayDir = dir;
+	}
+	imageReadonly = readonly || (overlayDir && !overlayCommit);
+	if (persistDir && !imageReadonly)
+		usageAndExit ("cache_dir needs images that are not written: use -r, or an overlay without overlay_commit");
+	if (persistDir)
+	{
+		char *dir = realpath (persistDir, NULL);
+		if (!dir || access (dir, W_OK | X_OK) < 0)
+			usageAndExit ("cannot create cache files in %s", persistDir);
+		persistDir = dir;
+	}
+	if (manifest)
+		readManifest (manifest);
+	if (diskCount == 0)
 		usageAndExit ("no image chosen");
-	if (stat (imagefilename, &VDfile_stat) < 0)
-		usageAndExit ("cannot access imagefile");
-	if (access (imagefilename, F_OK | R_OK | ((!readonly) ? W_OK : 0)) < 0)
-		usageAndExit ("cannot access imagefile");
-	for (i = 0; i < differencingLen; i++)
-		if (access (differencing[i], F_OK | R_OK | ((readonly) ? 0 : W_OK)) < 0)
-			usageAndExit ("cannot access differencing imagefile %s",
-										differencing[i]);
+	if (differencingLen > 0)
+		usageAndExit ("differencing disks must follow the -f image they belong to");
 
 #define IS_TYPE(s) (strcmp (s, diskType) == 0)
 	if (!
 			(IS_TYPE ("auto") || IS_TYPE ("VDI") || IS_TYPE ("VMDK")
-			 || IS_TYPE ("VHD") || IS_TYPE ("auto")))
+			 || IS_TYPE ("VHD") || IS_TYPE ("raw")))
 		usageAndExit ("invalid disk type specified");
-	if (strcmp ("auto", diskType) == 0
-			&& detectDiskType (&diskType, imagefilename) < 0)
-		return 1;
+	if (IS_TYPE ("raw"))
+		diskType = "RAW";						// the VD backend name
+
+// Several images are served from one directory each, named after the image file unless the
+// manifest names them.  They are only opened once fuse has daemonised and changed to /, so their
+// paths are made absolute here.
+	multiImage = (diskCount > 1 || manifest != NULL);
+	if (multiImage && traceFileName)
+		usageAndExit ("trace records do not say which image they are for, so trace needs a single image");
+	for (i = 0; i < diskCount; i++)
+	{
+		Disk *d = disks[i];
+		if (!d->layerType[0])
+			d->layerType[0] = diskType;
+		diskResolveChain (d);
+		if (stat (d->layerFile[0], &d->fileStat) < 0)
+			usageAndExit ("cannot access imagefile %s", d->layerFile[0]);
+		for (l = 0; l < d->layerCount; l++)
+		{
+			char *path;
+			if (access (d->layerFile[l], F_OK | R_OK | ((!imageReadonly) ? W_OK : 0)) < 0)
+				usageAndExit ((l == 0) ? "cannot access imagefile %s"
+											: "cannot access differencing imagefile %s", d->layerFile[l]);
+			if (multiImage && (path = realpath (d->layerFile[l], NULL)) == NULL)
+				usageAndExit ("cannot resolve the path of %s", d->layerFile[l]);
+			else if (multiImage)
+				d->layerFile[l] = path;
+		}
+		if (!multiImage)
+		{
+			d->inode = FUSE_ROOT_ID;
+			d->firstInode = STATS_INODE + 1;
+			continue;
+		}
+		d->inode = IMAGE_INODE (i);
+		d->firstInode = d->inode + 1;
+		if (!*d->name || strchr (d->name, '/') || strcmp (d->name, ".") == 0
+				|| strcmp (d->name, "..") == 0 || strcmp (d->name, STATS_NAME) == 0)
+			usageAndExit ("invalid image name \"%s\"", d->name);
+		for (l = 0; l < i; l++)
+			if (strcmp (disks[l]->name, d->name) == 0)
+				usageAndExit ("two images are called %s, use a manifest to name them apart", d->name);
+	}
+	logOpen ();
 
 //
-// *** Open the VDI, parse the MBR + EBRs and connect to the fuse service ***
+// *** Open the VDI and connect to the fuse service, the MBR + EBRs are parsed on first access ***
 //
 
+#ifndef USE_NATIVE_BACKEND
 	if (RT_FAILURE (VDInterfaceAdd (&vdError, "VD Error", VDINTERFACETYPE_ERROR, &vdErrorCallbacks, 0, &pVDifs)))
 		usageAndExit ("invalid initialisation of VD interface");
-	if (RT_FAILURE (VDCreate (&vdError, VDTYPE_HDD, &hdDisk)))
-		usageAndExit ("invalid initialisation of VD interface");
-	DISKopen (diskType, imagefilename);
-
-	for (i = 0; i < differencingLen; i++)
-	{
-		char *diffType;
-		char *diffFilename = differencing[i];
-		detectDiskType (&diffType, diffFilename);
-		DISKopen (diffType, diffFilename);
-	}
+#endif
 
-	initialisePartitionTable ();
+	cacheInit ();
+	writebackInit ();
+	if (exportName)
+		return exportFile (disks[0], exportName, exportOutput, hashName);
+	if (nbdSocket)
+		return nbdServe (disks[0], nbdSocket);
+	if (multiImage)
+		vbprintf ("serving %d images, each opened on first access", diskCount);
+	else if (diskAccess (disks[0]) < 0)
+		usageAndExit ("cannot open image %s", disks[0]->layerFile[0]);
 
 	myuid = geteuid ();
 	mygid = getegid ();
@@ -299,26 +760,48 @@ main (int argc, char **argv)
 	fuse_opt_add_arg (&fuseArgs, "vdfuse");
 
 	{
-		char fsname[strlen (imagefilename) + 12];
+		char *source = (manifest) ? manifest : (multiImage) ? "vdfuse" : disks[0]->layerFile[0];
+		char fsname[strlen (source) + 12];
 		strcpy (fsname, "-ofsname=\0");
-		strcat (fsname, imagefilename);
+		strcat (fsname, source);
 		fuse_opt_add_arg (&fuseArgs, fsname);
 	}
 
 	fuse_opt_add_arg (&fuseArgs, "-osubtype=vdfuse");
 	fuse_opt_add_arg (&fuseArgs, "-o");
 	fuse_opt_add_arg (&fuseArgs, (allowall) ? "allow_other" : "allow_root");
-	if (foreground)
-		fuse_opt_add_arg (&fuseArgs, "-f");
 	if (debug)
-		fuse_opt_add_arg (&fuseArgs, "-d");
-	fuse_opt_add_arg (&fuseArgs, mountpoint);
+		fuse_opt_add_arg (&fuseArgs, "-odebug");
+	if (fuseOpts)
+	{
+		fuse_opt_add_arg (&fuseArgs, "-o");
+		fuse_opt_add_arg (&fuseArgs, fuseOpts);
+	}
 
-	return fuse_main (fuseArgs.argc, fuseArgs.argv, &fuseOperations
-#if FUSE_USE_VERSION >= 26
-										, NULL
-#endif
-		);
+// This is fuse_main taken apart: fuse_mount takes the mount options out of fuseArgs and
+// fuse_lowlevel_new the rest, after which our own worker threads serve the channel.
+	if ((fuseChannel = fuse_mount (mountpoint, &fuseArgs)) == NULL)
+		usageAndExit ("cannot mount %s", mountpoint);
+	se = fuse_lowlevel_new (&fuseArgs, &fuseOperations, sizeof (fuseOperations), NULL);
+	if (!se)
+	{
+		fuse_unmount (mountpoint, fuseChannel);
+		usageAndExit ("invalid fuse options");
+	}
+	fuse_session_add_chan (se, fuseChannel);
+	if (fuse_daemonize (foreground) < 0 || fuse_set_signal_handlers (se) < 0)
+		ret = -1;
+	else
+	{
+		vbprintf ("mounted %s in %.1f ms", mountpoint, (clockNs () - started) / 1e6);
+		ret = sessionLoop (se, workerThreads);
+		fuse_remove_signal_handlers (se);
+	}
+	fuse_session_remove_chan (fuseChannel);
+	fuse_session_destroy (se);
+	fuse_unmount (mountpoint, fuseChannel);
+	fuse_opt_free_args (&fuseArgs);
+	return (ret < 0) ? 1 : 0;
 }
 
 //====================================================================================================
@@ -343,36 +826,260 @@ usageAndExit (char *optFormat, ...)
      "VirtualBox supported VD image file and mount it as a Fuse file system.  The\n"
      "mount point contains a flat directory containing the files EntireDisk,\n"
      "Partition1 .. PartitionN.  These can then be loop mounted to access the\n"
-     "underlying file systems\n\n"
-     "USAGE: %s [options] -f image-file mountpoint\n"
+     "underlying file systems.  Given several images, the mount point holds one\n"
+     "such directory per image instead.\n\n"
+     "USAGE: %s [options] -f image-file [-f image-file ...] mountpoint\n"
+     "       %s [options] -m manifest mountpoint\n"
+     "       %s [options] -f image-file -x file [-H sha256] [output-file]\n"
+     "       %s [options] -f image-file -n socket\n"
      "\t-h\thelp\n" "\t-r\treadonly\n"
 #ifndef OLDAPI
      "\t-t\tspecify type (VDI, VMDK, VHD, or raw; default: auto)\n"
 #endif
-     "\t-f\tVDimage file\n"
-     "\t-s\tdifferencing disk files\n"    // prevent misuse
+     "\t-f\tVDimage file, repeat to serve several images\n"
+     "\t-s\tdifferencing disk files of the preceding -f image, found from it if left out\n"    // prevent misuse
+     "\t-m\tmanifest of images, one \"[name=]image [differencing ...]\" per line\n"
+     "\t-x\tcopy EntireDisk or a PartitionN to output-file instead of mounting\n"
+     "\t-H\twith -x, print the sha256 hash of the file\n"
+     "\t-n\tserve EntireDisk and the partitions over NBD on a unix socket instead of mounting\n"
      "\t-a\tallow all users to read disk\n"
      "\t-w\tallow all users to read and write to disk\n"
      "\t-g\trun in foreground\n"
-     "\t-v\tverbose\n"
-     "\t-d\tdebug\n\n"
+     "\t-v\tverbose, log every request\n"
+     "\t-d\tdebug\n"
+     "\t-o\tcomma separated options; any not listed below are passed to fuse\n"
+     "\t\treaders=N\tnumber of parallel image handles for -r mounts (default %d)\n"
+     "\t\tcache_mb=N\tsize of the in-memory block cache (default %d, 0 = off)\n"
+     "\t\tcache_dir=DIR\tkeep the blocks read in a cache file in DIR for later mounts\n"
+     "\t\tcache_dir_mb=N\tmost disk the cache file of an image may use (default %d)\n"
+     "\t\treadahead_kb=N\tlargest sequential prefetch window (default %d, 0 = off)\n"
+     "\t\treadahead_threads=N\tnumber of prefetch threads (default %d)\n"
+     "\t\tzerocopy=0|1\tpass raw and fixed image data to the kernel by reference (default 1)\n"
+     "\t\tio=MODE\tbuilt-in backend: image file I/O by auto, uring, threads or sync (default auto)\n"
+     "\t\todirect\tbuilt-in backend: access the image files with O_DIRECT, past the page cache\n"
+     "\t\twriteback\tbuffer writes and write them back in the background\n"
+     "\t\twriteback_mb=N\tmost dirty data held by writeback (default %d)\n"
+     "\t\toverlay=DIR\tkeep writes in an overlay file in DIR, the images stay untouched\n"
+     "\t\toverlay_commit\twrite the overlay into the image at unmount instead of discarding it\n"
+     "\t\tthreads=N\tnumber of threads serving fuse requests (default %d)\n"
+     "\t\tattr_timeout=S\tseconds the kernel may cache file attributes (default %g)\n"
+     "\t\tentry_timeout=S\tseconds the kernel may cache name lookups (default %g)\n"
+     "\t\tbig_writes=0|1\taccept writes larger than a page (default 1)\n"
+     "\t\tmax_write=N\tlargest write request in bytes (default: fuse's)\n"
+     "\t\tsplice=0|1\tmove request data through pipes instead of copying (default 0)\n"
+     "\t\tmax_read=N\tlargest read request in bytes, handled by fuse\n"
+     "\t\tstats=0|1\tcount operations and publish them in /.stats (default 1)\n"
+     "\t\tlog_level=L\terror, warn, info or debug (default warn, -v: debug)\n"
+     "\t\tlog_file=PATH\tlog to PATH instead of stdout and stderr\n"
+     "\t\tlog_rate=N\tmost lines a thread logs per second (default 0, no limit)\n"
+     "\t\ttrace=PATH\trecord every request in a binary trace for vdreplay\n\n"
      "NOTE: \n"
      "Linux: you must add the line \"user_allow_other\" (without quotes) to /etc/fuse.confand set proper permissions on /etc/fuse.conf\n"
-     "OSX: run with sudo for this to work.\n", processName);
+     "OSX: run with sudo for this to work.\n", processName, processName, processName, processName,
+		 DISKHANDLE_DEFAULT_RO,
+		 CACHE_DEFAULT_MB, PERSIST_DEFAULT_MB, READAHEAD_DEFAULT_KB, READAHEAD_THREADS_DEFAULT,
+		 WRITEBACK_DEFAULT_MB, WORKER_THREADS_DEFAULT, ATTR_TIMEOUT_DEFAULT, ENTRY_TIMEOUT_DEFAULT);
     exit (1);
 }
 
+// Parses the -o option list.  Options vdfuse does not know about are collected in fuseOpts
+// and handed on to fuse, so that e.g. "-o direct_io,readers=8" works as expected.
+
 void
-vbprintf (const char *format, ...)
+parseVdfuseOptions (char *optList)
 {
-	va_list ap;
-	if (!verbose)
-		return;
-	va_start (ap, format);
-	vprintf (format, ap);
-	va_end (ap);
-	fputs ("\n", stdout);
-	fflush (stdout);
+	char *opt;
+	while ((opt = strsep (&optList, ",")) != NULL)
+	{
+		char *value = strchr (opt, '=');
+		if (*opt == '\0')
+			continue;
+		if (value)
+			*value++ = '\0';
+
+		if (strcmp (opt, "readers") == 0)
+		{
+			if (!value || (readers = atoi (value)) < 1 || readers > DISKHANDLE_MAX)
+				usageAndExit ("readers must be between 1 and %d", DISKHANDLE_MAX);
+		}
+		else if (strcmp (opt, "readahead_kb") == 0)
+		{
+			if (!value || (readaheadKB = atoi (value)) < 0)
+				usageAndExit ("readahead_kb must be a size in KiB, or 0 to disable read-ahead");
+		}
+		else if (strcmp (opt, "readahead_threads") == 0)
+		{
+			if (!value || (readaheadThreads = atoi (value)) < 1
+					|| readaheadThreads > READAHEAD_THREADS_MAX)
+				usageAndExit ("readahead_threads must be between 1 and %d", READAHEAD_THREADS_MAX);
+		}
+		else if (strcmp (opt, "zerocopy") == 0)
+			zeroCopy = value ? atoi (value) : 1;
+		else if (strcmp (opt, "io") == 0)
+		{
+			static const char *modes[] = { "auto", "uring", "threads", "sync" };
+			for (imageIO = 3; imageIO >= 0; imageIO--)
+				if (value && strcmp (value, modes[imageIO]) == 0)
+					break;
+			if (imageIO < 0)
+				usageAndExit ("io must be auto, uring, threads or sync");
+#ifndef USE_NATIVE_BACKEND
+			usageAndExit ("io needs the built-in backend (./configure --enable-native-backend)");
+#endif
+		}
+		else if (strcmp (opt, "odirect") == 0)
+		{
+			imageDirect = value ? atoi (value) : 1;
+#ifndef USE_NATIVE_BACKEND
+			if (imageDirect)
+				usageAndExit ("odirect needs the built-in backend (./configure --enable-native-backend)");
+#endif
+		}
+		else if (strcmp (opt, "writeback") == 0)
+			writeback = value ? atoi (value) : 1;
+		else if (strcmp (opt, "writeback_mb") == 0)
+		{
+			if (!value || (writebackMB = atoi (value)) < 1)
+				usageAndExit ("writeback_mb must be a size in MiB");
+		}
+		else if (strcmp (opt, "overlay") == 0)
+		{
+			if (!value || !*value)
+				usageAndExit ("overlay needs the directory to keep the overlay files in");
+			overlayDir = value;
+		}
+		else if (strcmp (opt, "overlay_commit") == 0)
+			overlayCommit = value ? atoi (value) : 1;
+		else if (strcmp (opt, "threads") == 0)
+		{
+			if (!value || (workerThreads = atoi (value)) < 1 || workerThreads > WORKER_THREADS_MAX)
+				usageAndExit ("threads must be between 1 and %d", WORKER_THREADS_MAX);
+		}
+		else if (strcmp (opt, "attr_timeout") == 0)
+		{
+			if (!value || (attrTimeout = atof (value)) < 0)
+				usageAndExit ("attr_timeout must be a number of seconds");
+		}
+		else if (strcmp (opt, "entry_timeout") == 0)
+		{
+			if (!value || (entryTimeout = atof (value)) < 0)
+				usageAndExit ("entry_timeout must be a number of seconds");
+		}
+		else if (strcmp (opt, "big_writes") == 0)
+			bigWrites = value ? atoi (value) : 1;
+		else if (strcmp (opt, "splice") == 0)
+			splice = value ? atoi (value) : 1;
+		else if (strcmp (opt, "stats") == 0)
+			statsEnabled = value ? atoi (value) : 1;
+		else if (strcmp (opt, "log_level") == 0)
+		{
+			static const char *levels[] = { "error", "warn", "info", "debug" };
+			int l;
+			for (l = LOGLEVEL_DEBUG; l >= 0; l--)
+				if (value && strcmp (value, levels[l]) == 0)
+					break;
+			if (l < 0)
+				usageAndExit ("log_level must be error, warn, info or debug");
+			logLevel = l;
+		}
+		else if (strcmp (opt, "log_file") == 0)
+		{
+			if (!value || !*value)
+				usageAndExit ("log_file needs a file name");
+			logFileName = value;
+		}
+		else if (strcmp (opt, "log_rate") == 0)
+		{
+			if (!value || (logRate = atoi (value)) < 0)
+				usageAndExit ("log_rate must be a number of lines per second");
+		}
+		else if (strcmp (opt, "trace") == 0)
+		{
+			if (!value || !*value)
+				usageAndExit ("trace needs a file name");
+			traceFileName = value;
+		}
+		else if (strcmp (opt, "max_write") == 0)
+		{
+			if (!value || atoi (value) < 4096)
+				usageAndExit ("max_write must be at least 4096 bytes");
+			maxWrite = atoi (value);
+		}
+		else if (strcmp (opt, "cache_mb") == 0)
+		{
+			if (!value || (cacheMB = atoi (value)) < 0)
+				usageAndExit ("cache_mb must be a size in MiB, or 0 to disable the cache");
+		}
+		else if (strcmp (opt, "cache_dir") == 0)
+		{
+			if (!value || !*value)
+				usageAndExit ("cache_dir needs the directory to keep the cache files in");
+			persistDir = value;
+		}
+		else if (strcmp (opt, "cache_dir_mb") == 0)
+		{
+			if (!value || (persistMB = atoi (value)) < 1)
+				usageAndExit ("cache_dir_mb must be a size in MiB");
+		}
+		else
+		{
+			if (value)
+				value[-1] = '=';
+			if (fuse_opt_add_opt (&fuseOpts, opt) < 0)
+				usageAndExit ("out of memory");
+		}
+	}
+}
+
+// Reads the images to serve from a manifest, one per line as "[name=]image [differencing ...]".
+// Blank lines and lines starting with # are skipped, and relative paths are taken to be relative
+// to the manifest.
+
+void
+readManifest (char *manifest)
+{
+	FILE *f = fopen (manifest, "r");
+	char line[MANIFEST_LINE_MAX];
+	char *slash = strrchr (manifest, '/');
+	int dirLen = (slash) ? slash - manifest + 1 : 0;
+	int lineNo = 0;
+
+	if (!f)
+		usageAndExit ("cannot open manifest %s", manifest);
+	while (fgets (line, sizeof (line), f))
+	{
+		char *rest = line, *word;
+		Disk *d = NULL;
+
+		lineNo++;
+		if (!strchr (line, '\n') && !feof (f))
+			usageAndExit ("%s:%d: line too long", manifest, lineNo);
+		while ((word = strsep (&rest, " \t\r\n")) != NULL)
+		{
+			char *name = NULL, *path, *eq;
+			if (*word == '\0')
+				continue;
+			if (!d && *word == '#')
+				break;
+			if (!d && (eq = strchr (word, '=')) != NULL)
+			{
+				*eq = '\0';
+				name = word;
+				word = eq + 1;
+				if (*word == '\0')
+					usageAndExit ("%s:%d: no image given for %s", manifest, lineNo, name);
+			}
+			if ((path = malloc (dirLen + strlen (word) + 1)) == NULL
+					|| (name && (name = strdup (name)) == NULL))
+				usageAndExit ("out of memory");
+			sprintf (path, "%.*s%s", (*word == '/') ? 0 : dirLen, manifest, word);
+			if (!d)
+				d = diskAdd (name, path);
+			else
+				diskAddLayer (d, path);
+		}
+	}
+	fclose (f);
 }
 
 void
@@ -388,207 +1095,853 @@ vdErrorCallback (void *pvUser UNUSED, int rc, const char *file,
 
 
 //====================================================================================================
-//                                        MBR + EBR parsing routine
+//                                  Asynchronous logging and request tracing
 //====================================================================================================
 //
-// This code is algorithmically based on partRead in VBoxInternalManage.cpp plus the Wikipedia articles
-// on MBR and EBR. As in partRead, a statically allocated partition list is used same  to keep things
-// simple (but up to a max 100 partitions :lol:).  Note than unlike partRead, this doesn't resort the
-// partitions.
+// Logging must not slow down or serialise the threads serving requests, even with -v logging every
+// one of them.  Each thread formats its lines into its own ring buffer, which only it writes and
+// only the log thread empties, so neither side takes a lock.  Every LOG_DRAIN_MS the log thread
+// collects the lines from all buffers, sorts them by time and writes them out with a timestamp,
+// the thread number and the level.  A full buffer drops lines rather than waiting, and -o log_rate
+// caps the lines per thread per second; both are counted and show in /.stats.
 //
-//int VDRead(PVBOXHDD pDisk, uint64_t uOffset, void *pvBuf, size_t cbRead, int ii );
+// The log thread only runs between VD_init and VD_destroy, and only if info lines or a trace were
+// asked for.  Otherwise, and before fuse has daemonised, lines are written straight away.
+//
+// -o trace=FILE records every read, write, flush and fsync as a fixed size struct vdfuse_trace (see
+// vdfuse.h), buffered in the same way and appended to FILE by the log thread.
 
-void
-initialisePartitionTable (void)
+typedef struct
 {
-//uint16_t MBRsignature;
-	int entendedFlag = UNALLOCATED;
-	int i;
-	MBRblock mbrb;
+	uint64_t time;								// CLOCK_REALTIME ns
+	unsigned thread;
+	LogLevel level;
+	char text[LOG_LINE_MAX];
+} LogLine;
 
-	memset (partitionTable, 0, sizeof (partitionTable));
-	for (i = 0; i <= (signed) (sizeof (partitionTable) / sizeof (Partition)); i++) {
-	    partitionTable[i].no = UNALLOCATED;
-    }
+typedef struct LogBuffer
+{
+	struct LogBuffer *next;
+	unsigned thread;
+	int unused;										// its thread has exited and another may take it
+	unsigned head;								// advanced by the owning thread
+	unsigned tail;								// advanced by the log thread
+	unsigned traceHead;
+	unsigned traceTail;
+	uint64_t dropped;
+	uint64_t limited;
+	uint64_t traceDropped;
+	time_t rateSecond;
+	int rateCount;
+	struct vdfuse_trace *trace;		// TRACE_RING_SLOTS records, if tracing
+	LogLine lines[LOG_RING_SLOTS];
+} LogBuffer;
 
-	partitionTable[0].no = 0;
-	partitionTable[0].offset = 0;
-	partitionTable[0].size = DISKsize;
-	strcpy (partitionTable[0].name, ENTIRE_DISK_STR);
-//
-// Check that this is unformated or a DOS partitioned disk.  Sorry but other formats not supported.
-//
-	DISKread (0, &mbrb, sizeof (mbrb));
-	if (mbrb.signature == 0x0000)
-		return;											// an unformated disk is allowed but only EntireDisk is defined
-	if (mbrb.signature != 0xaa55)
-		usageAndExit ("Invalid MBR found on image with signature 0x%04hX",
-									mbrb.signature);
+static const char *logLevelNames[] = { "ERROR", "WARN", "INFO", "DEBUG" };
 
-//
-// Process the four physical partition entires in the MBR
-//
-	for (i = 1; i <= 4; i++)
+// Buffers are added on a thread's first message and never freed.  When a thread exits, such as an
+// NBD connection's reader, its buffer is handed on to the next thread that logs, which carries on
+// after the lines still waiting in it.  Only buffers at most half full are handed on, so the new
+// thread has room, and the list only grows as far as threads log at the same time.
+static LogBuffer *logBuffers = NULL;
+static __thread LogBuffer *logBuffer = NULL;
+static pthread_key_t logKey;
+static pthread_once_t logKeyOnce = PTHREAD_ONCE_INIT;
+static unsigned logThreadCount = 0;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;	// serialises direct output
+static pthread_t logThread;
+static int logRunning = 0;
+static FILE *logFile = NULL;
+static FILE *traceFile = NULL;
+static uint64_t traceStart;
+static uint64_t traceWritten = 0;
+
+static void
+logBufferRelease (void *arg)
+{
+	LogBuffer *b = arg;
+	__atomic_store_n (&b->unused, 1, __ATOMIC_RELEASE);
+}
+
+static void
+logKeyCreate (void)
+{
+	pthread_key_create (&logKey, logBufferRelease);
+}
+
+static LogBuffer *
+logBufferGet (void)
+{
+	LogBuffer *b = logBuffer;
+	if (b)
+		return b;
+	for (b = __atomic_load_n (&logBuffers, __ATOMIC_ACQUIRE); b; b = b->next)
+		if (__atomic_load_n (&b->unused, __ATOMIC_ACQUIRE)
+				&& b->head - __atomic_load_n (&b->tail, __ATOMIC_ACQUIRE) <= LOG_RING_SLOTS / 2
+				&& b->traceHead - __atomic_load_n (&b->traceTail, __ATOMIC_ACQUIRE) <= TRACE_RING_SLOTS / 2
+				&& __sync_bool_compare_and_swap (&b->unused, 1, 0))
+			break;
+	if (b)
 	{
-		Partition *p = partitionTable + i;
-//    MBRentry  *m = &(p->descriptor);
-	//DISKread (MBR_START + (i-1) * sizeof(MBRentry), &(p->descriptor), sizeof(MBRentry));
-		memcpy (&(p->descriptor), &mbrb.descriptor[i - 1], sizeof (MBRentry));
-		if ((p->descriptor).type == 0)
-			continue;
-		if (PARTTYPE_IS_EXTENDED ((p->descriptor).type))
-		{
-			if (entendedFlag != UNALLOCATED)
-				usageAndExit ("More than one extended partition in MBR");
-			entendedFlag = i;
-		}
-		else
-		{
-			lastPartition = i;
-			p->no = i;
-			p->offset = (off_t) ((p->descriptor).offset) * BLOCKSIZE;
-			p->size = (off_t) ((p->descriptor).size) * BLOCKSIZE;
-		}
+		b->rateSecond = 0;
+		b->rateCount = 0;
 	}
-//
-// Now chain down any EBRs to process the logical partition entries
-//
-	if (entendedFlag != UNALLOCATED)
+	else
 	{
-		EBRentry ebr;
-		off_t uStart =
-			(off_t) ((partitionTable[entendedFlag].descriptor).offset) * BLOCKSIZE;
-		off_t uOffset = 0;
-
-		if (!uStart)
-			usageAndExit ("Inconsistency for logical partition start. Aborting\n");
+		if ((b = calloc (1, sizeof (LogBuffer))) == NULL)
+			return NULL;
+		do
+			b->next = logBuffers;
+		while (!__sync_bool_compare_and_swap (&logBuffers, b->next, b));
+	}
+	b->thread = __sync_add_and_fetch (&logThreadCount, 1);
+	if (traceFile && !b->trace)
+		__atomic_store_n (&b->trace, malloc (TRACE_RING_SLOTS * sizeof (struct vdfuse_trace)),
+											__ATOMIC_RELEASE);
+	pthread_once (&logKeyOnce, logKeyCreate);
+	pthread_setspecific (logKey, b);
+	logBuffer = b;
+	return b;
+}
 
-		for (i = 5; i <= HOSTPARTITION_MAX; i++)
-		{
-			lastPartition++;
-			Partition *p = partitionTable + i;
+static void
+logOutput (const LogLine * l)
+{
+	FILE *out = logFile ? logFile : (l->level <= LOGLEVEL_WARN) ? stderr : stdout;
+	time_t seconds = l->time / 1000000000;
+	char stamp[32];
+	struct tm tm;
 
-			DISKread (uStart + uOffset + EBR_START, &ebr, sizeof (ebr));
+	localtime_r (&seconds, &tm);
+	strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf (out, "%s.%06u [%u] %s %s\n", stamp, (unsigned) (l->time % 1000000000 / 1000),
+					 l->thread, logLevelNames[l->level], l->text);
+}
 
-			if (ebr.signature != 0xaa55)
-				usageAndExit ("Invalid EBR signature found on image");
-			if ((ebr.descriptor).type == 0)
-				usageAndExit ("Logical partition with type 0 encountered");
-			if (!((ebr.descriptor).offset))
-				usageAndExit
-					("Logical partition invalid partition start offset encountered");
+static void
+logFlush (void)
+{
+	fflush (logFile ? logFile : stdout);
+	if (!logFile)
+		fflush (stderr);
+}
 
-			p->descriptor = ebr.descriptor;
-			p->no = i;
-			lastPartition = i;
-			p->offset =
-				uStart + uOffset + (off_t) ((ebr.descriptor).offset) * BLOCKSIZE;
-			p->size = (off_t) ((ebr.descriptor).size) * BLOCKSIZE;
+// Use the vlog and vbprintf macros rather than calling this, so disabled levels cost nothing
+void
+logMessage (LogLevel level, const char *format, ...)
+{
+	LogBuffer *b = logBufferGet ();
+	LogLine direct, *l = &direct;
+	struct timespec ts;
+	unsigned head = 0;
+	va_list ap;
 
-			if (ebr.chain.type == 0)
-				break;
-			if (!PARTTYPE_IS_EXTENDED (ebr.chain.type))
-				usageAndExit ("Logical partition chain broken");
-			uOffset = (ebr.chain).offset;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	if (b && logRate)
+	{
+		if (ts.tv_sec != b->rateSecond)
+		{
+			b->rateSecond = ts.tv_sec;
+			b->rateCount = 0;
+		}
+		if (++b->rateCount > logRate)
+		{
+			__atomic_fetch_add (&b->limited, 1, __ATOMIC_RELAXED);
+			return;
 		}
 	}
-//
-// Now print out the partition table
-//
-	vbprintf ("Partition       Size           Offset\n"
-						"=========       ====           ======\n");
-	for (i = 1; i <= lastPartition; i++)
+	if (b && __atomic_load_n (&logRunning, __ATOMIC_ACQUIRE))
 	{
-		Partition *p = partitionTable + i;
-		if (p->no != UNALLOCATED)
+		head = b->head;
+		if (head - __atomic_load_n (&b->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
 		{
-			sprintf (p->name, "Partition%d", i);
-			vbprintf ("%-14s  %-13lld  %-13lld", p->name, p->offset, p->size);
+			__atomic_fetch_add (&b->dropped, 1, __ATOMIC_RELAXED);
+			return;
 		}
+		l = &b->lines[head % LOG_RING_SLOTS];
+	}
+
+	l->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	l->thread = b ? b->thread : 0;
+	l->level = level;
+	va_start (ap, format);
+	vsnprintf (l->text, LOG_LINE_MAX, format, ap);
+	va_end (ap);
+
+	if (l != &direct)
+		__atomic_store_n (&b->head, head + 1, __ATOMIC_RELEASE);
+	else
+	{
+		pthread_mutex_lock (&logLock);
+		logOutput (l);
+		logFlush ();
+		pthread_mutex_unlock (&logLock);
 	}
-	vbprintf ("\n");
 }
 
-int
-findPartition (const char *filename)
+// Records a request that started at statNow () time start
+void
+traceRecord (int op, int partition, uint64_t offset, uint64_t diskOffset, uint32_t len,
+						 uint64_t start, int failed)
 {
-// Use a dumb serial search since there are typically less than 3 entries
-	int i;
-	register Partition *p = partitionTable;
-	for (i = 0; i <= lastPartition; i++, p++)
+	LogBuffer *b;
+	struct vdfuse_trace *t;
+	uint64_t latency;
+	unsigned head;
+
+	if (!traceFile || partition < 0 || !__atomic_load_n (&logRunning, __ATOMIC_ACQUIRE)
+			|| (b = logBufferGet ()) == NULL || !b->trace)
+		return;
+	head = b->traceHead;
+	if (head - __atomic_load_n (&b->traceTail, __ATOMIC_ACQUIRE) == TRACE_RING_SLOTS)
 	{
-		if (p->no != UNALLOCATED && strcmp (filename + 1, p->name) == 0)
-			return i;
+		__atomic_fetch_add (&b->traceDropped, 1, __ATOMIC_RELAXED);
+		return;
 	}
-	return -1;
+	latency = statNow () - start;
+	t = &b->trace[head % TRACE_RING_SLOTS];
+	t->time = start - traceStart;
+	t->offset = offset;
+	t->diskOffset = diskOffset;
+	t->length = len;
+	t->latency = (latency > UINT32_MAX) ? UINT32_MAX : latency;
+	t->partition = partition;
+	t->op = op;
+	t->error = failed ? 1 : 0;
+	t->thread = b->thread;
+	__atomic_store_n (&b->traceHead, head + 1, __ATOMIC_RELEASE);
 }
 
-// detects type of virtual image
-int
-detectDiskType (char **disktype, char *filename)
+static int
+logCompare (const void *a, const void *b)
 {
-	char buf[8];
-	int fd = open (filename, O_RDONLY);
-	read (fd, buf, sizeof (buf));
+	uint64_t x = ((const LogLine *) a)->time, y = ((const LogLine *) b)->time;
+	return (x > y) - (x < y);
+}
 
-	if (strncmp (buf, "conectix", 8) == 0)
-		*disktype = "VHD";
-	else if (strncmp (buf, "VMDK", 4) == 0)
-		*disktype = "VMDK";
-	else if (strncmp (buf, "KDMV", 4) == 0)
-		*disktype = "VMDK";
-	else if (strncmp (buf, "<<<", 3) == 0)
-		*disktype = "VDI";
-	else
-		usageAndExit ("cannot autodetect disk type of %s", filename);
+// Empties every thread's buffers; only called by the log thread, or once it has stopped
+static void
+logDrain (void)
+{
+	static LogLine *batch = NULL;
+	static size_t batchSize = 0;
+	size_t n = 0, i;
+	LogBuffer *b;
 
-	vbprintf ("disktype is %s", *disktype);
-	close (fd);
-	return 0;
-}
+	for (b = __atomic_load_n (&logBuffers, __ATOMIC_ACQUIRE); b; b = b->next)
+	{
+		unsigned head = __atomic_load_n (&b->head, __ATOMIC_ACQUIRE), tail = b->tail;
+		if (n + (head - tail) > batchSize)
+		{
+			size_t size = batchSize ? batchSize * 2 : 4 * LOG_RING_SLOTS;
+			LogLine *grown;
+			while (size < n + (head - tail))
+				size *= 2;
+			if ((grown = realloc (batch, size * sizeof (LogLine))) != NULL)
+			{
+				batch = grown;
+				batchSize = size;
+			}
+		}
+		for (; tail != head && n < batchSize; tail++)
+			batch[n++] = b->lines[tail % LOG_RING_SLOTS];
+		__atomic_store_n (&b->tail, tail, __ATOMIC_RELEASE);
 
-//====================================================================================================
-//                                         Fuse Callback Routines
-//====================================================================================================
-//
-// in alphetic order to help find them: destroy ,flush ,getattr ,open, read, readdir, write
+		if (__atomic_load_n (&b->trace, __ATOMIC_ACQUIRE))
+		{
+			head = __atomic_load_n (&b->traceHead, __ATOMIC_ACQUIRE);
+			for (tail = b->traceTail; tail != head; tail++)
+				fwrite (&b->trace[tail % TRACE_RING_SLOTS], sizeof (struct vdfuse_trace), 1, traceFile);
+			__atomic_fetch_add (&traceWritten, head - b->traceTail, __ATOMIC_RELAXED);
+			__atomic_store_n (&b->traceTail, head, __ATOMIC_RELEASE);
+		}
+	}
 
-pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t part_mutex = PTHREAD_MUTEX_INITIALIZER;
+	if (n == 0)
+		return;
+	qsort (batch, n, sizeof (LogLine), logCompare);
+	pthread_mutex_lock (&logLock);
+	for (i = 0; i < n; i++)
+		logOutput (batch + i);
+	logFlush ();
+	pthread_mutex_unlock (&logLock);
+}
 
-void
-VD_destroy (void *u UNUSED)
+static void *
+logThreadMain (void *arg UNUSED)
 {
-// called when the fuse filesystem is umounted
-	vbprintf ("destroy");
-	DISKclose;
+	struct timespec pause = { 0, LOG_DRAIN_MS * 1000000 };
+	while (__atomic_load_n (&logRunning, __ATOMIC_ACQUIRE))
+	{
+		logDrain ();
+		nanosleep (&pause, NULL);
+	}
+	return NULL;
 }
 
-int
-VD_flush (const char *p, struct fuse_file_info *i UNUSED)
+// Opens the log and trace files, before fuse daemonises and changes directory
+void
+logOpen (void)
 {
-	vbprintf ("flush: %s", p);
-	DISKflush;
-	return 0;
-}
+	struct vdfuse_trace_header h;
 
+	if (logFileName && (logFile = fopen (logFileName, "a")) == NULL)
+		usageAndExit ("cannot open log file %s", logFileName);
+	if (!traceFileName)
+		return;
+	if ((traceFile = fopen (traceFileName, "w")) == NULL)
+		usageAndExit ("cannot create trace file %s", traceFileName);
+	memcpy (h.magic, VDFUSE_TRACE_MAGIC, sizeof (h.magic));
+	h.version = VDFUSE_TRACE_VERSION;
+	h.recordSize = sizeof (struct vdfuse_trace);
+	if (fwrite (&h, sizeof (h), 1, traceFile) != 1)
+		usageAndExit ("cannot write trace file %s", traceFileName);
+}
+
+void
+logStart (void)
+{
+	if (logLevel < LOGLEVEL_INFO && !traceFile)
+		return;
+	traceStart = statNow ();
+	__atomic_store_n (&logRunning, 1, __ATOMIC_RELEASE);
+	if (pthread_create (&logThread, NULL, logThreadMain, NULL) != 0)
+		__atomic_store_n (&logRunning, 0, __ATOMIC_RELEASE);
+}
+
+// Writes out whatever is still buffered and goes back to direct output
+void
+logStop (void)
+{
+	uint64_t dropped, limited, traced, traceDropped;
+
+	if (__atomic_load_n (&logRunning, __ATOMIC_ACQUIRE))
+	{
+		__atomic_store_n (&logRunning, 0, __ATOMIC_RELEASE);
+		pthread_join (logThread, NULL);
+		logDrain ();
+	}
+	logCounters (&dropped, &limited, &traced, &traceDropped);
+	if (dropped || limited || traceDropped)
+		vlog (LOGLEVEL_WARN, "%llu log lines dropped, %llu rate limited, %llu trace records dropped",
+					(unsigned long long) dropped, (unsigned long long) limited,
+					(unsigned long long) traceDropped);
+	if (traceFile)
+	{
+		vbprintf ("%llu requests traced to %s", (unsigned long long) traced, traceFileName);
+		if (fclose (traceFile) != 0)
+			vlog (LOGLEVEL_ERROR, "could not write trace file %s", traceFileName);
+		traceFile = NULL;
+	}
+}
+
+void
+logCounters (uint64_t * dropped, uint64_t * limited, uint64_t * traced, uint64_t * traceDropped)
+{
+	LogBuffer *b;
+	*dropped = *limited = *traceDropped = 0;
+	*traced = __atomic_load_n (&traceWritten, __ATOMIC_RELAXED);
+	for (b = __atomic_load_n (&logBuffers, __ATOMIC_ACQUIRE); b; b = b->next)
+	{
+		*dropped += __atomic_load_n (&b->dropped, __ATOMIC_RELAXED);
+		*limited += __atomic_load_n (&b->limited, __ATOMIC_RELAXED);
+		*traceDropped += __atomic_load_n (&b->traceDropped, __ATOMIC_RELAXED);
+	}
+}
+
+
+//====================================================================================================
+//                                     MBR, EBR + GPT parsing routines
+//====================================================================================================
+//
+// This code is algorithmically based on partRead in VBoxInternalManage.cpp plus the Wikipedia articles
+// on MBR and EBR.  Note than unlike partRead, this doesn't resort the partitions.  The table grows as
+// needed and p[n] always holds PartitionN, so a name maps straight to its entry.
+//
+// A protective MBR (type 0xEE) hands over to the GPT, read from LBA 1 for 512 or 4096 byte sectors
+// with its header and entry array CRC checked.  If the primary copy is damaged the backup at the end
+// of the disk is used, and if neither is valid the MBR view is shown instead.  GPT entry i becomes
+// Partition(i+1), so numbers match those of other GPT tools even when entries are unused.
+//
+// The table is only read when the image's directory is first looked into, not at mount time.  All
+// reads go through partitionRead, which fetches PARTITION_WINDOW bytes at a time through the
+// write-back buffer and the block cache: the MBR comes in together with the GPT header and entries
+// behind it, a window near the end of the disk holds the backup GPT and its entries, and EBRs that
+// lie close together cost one read between them.
+//
+// Requests read the current PartitionTable without taking a lock.  The table remembers which bytes
+// of the image it was parsed from, and only a write to those marks it stale; it is then re-read when
+// the image's last file is closed, or on VDFUSE_IOC_REREAD.  A re-read that finds other partitions
+// publishes a new version with a single pointer store, so a request sees either the old table or
+// the new one in full.  The old version is freed once every request that might still be using it
+// has finished, see partitionRetire.
+//
+//int VDRead(PVBOXHDD pDisk, uint64_t uOffset, void *pvBuf, size_t cbRead, int ii );
+
+typedef struct
+{
+	Disk *disk;
+	Partition *p;
+	int capacity;
+	int last;
+	char *window;									// the image bytes last read by partitionRead
+	uint64_t windowStart;
+	size_t windowLen;
+	int reads;										// reads of the image it took
+	DiskRange *sources;						// the bytes looked at, see PartitionTable
+	int nSources;
+	int sourceCapacity;
+} PartitionList;
+
+// Remembers that the table depends on len bytes at offset
+static void
+partitionSource (PartitionList * l, uint64_t offset, size_t len)
+{
+	DiskRange *r = (l->nSources) ? l->sources + l->nSources - 1 : NULL;
+
+	if (r && offset <= r->offset + r->len && offset + len >= r->offset)
+	{
+		uint64_t end = (offset + len > r->offset + r->len) ? offset + len : r->offset + r->len;
+		r->offset = (offset < r->offset) ? offset : r->offset;
+		r->len = end - r->offset;
+		return;
+	}
+	if (l->nSources == l->sourceCapacity)
+	{
+		int cap = (l->sourceCapacity) ? l->sourceCapacity * 2 : 8;
+		DiskRange *t = realloc (l->sources, cap * sizeof (DiskRange));
+		if (!t)
+			usageAndExit ("out of memory reading the partition table");
+		l->sources = t;
+		l->sourceCapacity = cap;
+	}
+	l->sources[l->nSources].offset = offset;
+	l->sources[l->nSources++].len = len;
+}
+
+// Copies len bytes at offset out of the window, reading a new window if they are not in it.
+// Returns 0 or a VBox status code.
+static int
+partitionRead (PartitionList * l, uint64_t offset, void *buf, size_t len)
+{
+	Disk *d = l->disk;
+	int ret;
+
+	if (offset > d->size || len > d->size - offset)
+		return VERR_GENERAL_FAILURE;
+	partitionSource (l, offset, len);
+	if (l->window && offset >= l->windowStart && offset + len <= l->windowStart + l->windowLen)
+	{
+		memcpy (buf, l->window + (offset - l->windowStart), len);
+		return 0;
+	}
+	l->reads++;
+	if (len > PARTITION_WINDOW || (!l->window && !(l->window = malloc (PARTITION_WINDOW))))
+		return writebackRead (d, offset, buf, len);
+
+// The window starts at offset unless that would run it past the end of the disk
+	l->windowLen = (d->size < PARTITION_WINDOW) ? d->size : PARTITION_WINDOW;
+	l->windowStart = (offset + l->windowLen > d->size) ? d->size - l->windowLen : offset;
+	if (RT_FAILURE (ret = writebackRead (d, l->windowStart, l->window, l->windowLen)))
+	{
+		l->windowLen = 0;
+		return ret;
+	}
+	memcpy (buf, l->window + (offset - l->windowStart), len);
+	return 0;
+}
+
+// Returns the slot for partition n of a table being built, growing the table as needed
+static Partition *
+partitionSlot (PartitionList * l, int n)
+{
+	if (n >= l->capacity)
+	{
+		int i, cap = (l->capacity) ? l->capacity : 8;
+		while (cap <= n)
+			cap *= 2;
+		Partition *t = realloc (l->p, cap * sizeof (Partition));
+		if (!t)
+			usageAndExit ("out of memory reading the partition table");
+		memset (t + l->capacity, 0, (cap - l->capacity) * sizeof (Partition));
+		for (i = l->capacity; i < cap; i++)
+			t[i].no = UNALLOCATED;
+		l->p = t;
+		l->capacity = cap;
+	}
+	return l->p + n;
+}
+
+static Partition *
+partitionAdd (PartitionList * l, int n, off_t offset, uint64_t size)
+{
+	Partition *p = partitionSlot (l, n);
+	p->no = n;
+	p->offset = offset;
+	p->size = size;
+	if (n > l->last)
+		l->last = n;
+	return p;
+}
+
+// Returns -1 if the MBR or an EBR is inconsistent
+static int
+mbrRead (PartitionList * l, MBRblock * mbrb)
+{
+	Disk *d = l->disk;
+	int entendedFlag = UNALLOCATED;
+	MBRentry extended;
+	int i;
+//
+// Process the four physical partition entires in the MBR
+//
+	for (i = 1; i <= 4; i++)
+	{
+		MBRentry *m = &mbrb->descriptor[i - 1];
+		if (m->type == 0)
+			continue;
+		if (PARTTYPE_IS_EXTENDED (m->type))
+		{
+			if (entendedFlag != UNALLOCATED)
+			{
+				vlog (LOGLEVEL_ERROR, "%s: More than one extended partition in MBR", d->name);
+				return -1;
+			}
+			entendedFlag = i;
+			extended = *m;
+		}
+		else
+			partitionAdd (l, i, (off_t) m->offset * BLOCKSIZE,
+										(off_t) m->size * BLOCKSIZE)->descriptor = *m;
+	}
+//
+// Now chain down any EBRs to process the logical partition entries.  Each EBR describes its
+// logical partition relative to itself and links to the next EBR relative to the extended partition.
+//
+	if (entendedFlag != UNALLOCATED)
+	{
+		EBRentry ebr;
+		off_t uStart = (off_t) extended.offset * BLOCKSIZE;
+		off_t uOffset = 0;
+		const char *error = NULL;
+
+		if (!uStart)
+			error = "Inconsistency for logical partition start";
+
+		for (i = 5; i < 5 + EBR_CHAIN_MAX && !error; i++)
+		{
+			if (RT_FAILURE (partitionRead (l, uStart + uOffset, &ebr, sizeof (ebr))))
+				error = "Cannot read an EBR of the image";
+			else if (ebr.signature != 0xaa55)
+				error = "Invalid EBR signature found on image";
+			else if ((ebr.descriptor).type == 0)
+				error = "Logical partition with type 0 encountered";
+			else if (!((ebr.descriptor).offset))
+				error = "Logical partition invalid partition start offset encountered";
+			if (error)
+				break;
+
+			partitionAdd (l, i, uStart + uOffset + (off_t) ((ebr.descriptor).offset) * BLOCKSIZE,
+										(off_t) ((ebr.descriptor).size) * BLOCKSIZE)->descriptor = ebr.descriptor;
+
+			if (ebr.chain.type == 0)
+				break;
+			if (!PARTTYPE_IS_EXTENDED (ebr.chain.type))
+				error = "Logical partition chain broken";
+			uOffset = (off_t) (ebr.chain).offset * BLOCKSIZE;
+		}
+		if (error)
+		{
+			vlog (LOGLEVEL_ERROR, "%s: %s", d->name, error);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// The CRC-32 used by GPT (and zlib), reflected polynomial 0xEDB88320
+static uint32_t
+gptCRC32 (const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *b = buf;
+	uint32_t crc = 0xffffffff;
+	size_t i;
+
+	if (!table[1])
+		for (i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			int k;
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ b[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+// Reads and checks the GPT header at lba and its entry array, which the caller frees
+static char *
+gptLoad (PartitionList * l, uint64_t lba, uint32_t sectorSize, GPTheader * h)
+{
+	Disk *d = l->disk;
+	char sector[GPT_SECTOR_MAX];
+	uint32_t crc;
+	char *entries;
+	size_t len;
+
+	if (lba == 0 || lba >= d->size / sectorSize
+			|| RT_FAILURE (partitionRead (l, lba * sectorSize, sector, sectorSize)))
+		return NULL;
+	memcpy (h, sector, sizeof (GPTheader));
+	if (memcmp (h->signature, GPT_SIGNATURE, 8) != 0 || h->headerSize < sizeof (GPTheader)
+			|| h->headerSize > sectorSize || h->myLBA != lba)
+		return NULL;
+	crc = h->headerCRC;
+	memset (sector + offsetof (GPTheader, headerCRC), 0, sizeof (uint32_t));
+	if (gptCRC32 (sector, h->headerSize) != crc)
+		return NULL;
+
+	if (h->nEntries == 0 || h->nEntries > GPT_ENTRIES_MAX || h->entrySize < sizeof (GPTentry)
+			|| h->entrySize % 8 != 0)
+		return NULL;
+	len = (size_t) h->nEntries * h->entrySize;
+	if (h->entriesLBA >= d->size / sectorSize || h->entriesLBA * sectorSize + len > d->size
+			|| !(entries = malloc (len)))
+		return NULL;
+	if (RT_FAILURE (partitionRead (l, h->entriesLBA * sectorSize, entries, len))
+			|| gptCRC32 (entries, len) != h->entriesCRC)
+	{
+		free (entries);
+		return NULL;
+	}
+	return entries;
+}
+
+// Adds the GPT partitions for the given sector size, returns -1 if there is no valid GPT
+static int
+gptRead (PartitionList * l, uint32_t sectorSize)
+{
+	Disk *d = l->disk;
+	GPTheader h;
+	char *entries = gptLoad (l, 1, sectorSize, &h);
+	uint32_t i;
+
+	if (!entries)
+	{
+		uint64_t backup = d->size / sectorSize - 1;
+		GPTheader primary;
+		char sector[GPT_SECTOR_MAX];
+// Trust the primary header's pointer to the backup if the header itself is intact
+		if (RT_SUCCESS (partitionRead (l, sectorSize, sector, sectorSize)))
+		{
+			memcpy (&primary, sector, sizeof (GPTheader));
+			if (memcmp (primary.signature, GPT_SIGNATURE, 8) == 0 && primary.alternateLBA > 1
+					&& primary.alternateLBA < d->size / sectorSize)
+				backup = primary.alternateLBA;
+		}
+		if (!(entries = gptLoad (l, backup, sectorSize, &h)))
+			return -1;
+		vlog (LOGLEVEL_WARN, "%s: primary GPT is damaged, using the backup at LBA %llu", d->name,
+					(unsigned long long) backup);
+	}
+
+	for (i = 0; i < h.nEntries; i++)
+	{
+		GPTentry *e = (GPTentry *) (entries + (size_t) i * h.entrySize);
+		static const uint8_t unused[16];
+		if (memcmp (e->typeGUID, unused, 16) == 0 || e->lastLBA < e->firstLBA
+				|| e->lastLBA >= d->size / sectorSize)
+			continue;
+		partitionAdd (l, i + 1, (off_t) e->firstLBA * sectorSize,
+									(e->lastLBA - e->firstLBA + 1) * sectorSize);
+	}
+	free (entries);
+	vbprintf ("GPT with %u entries and %u byte sectors", h.nEntries, sectorSize);
+	return 0;
+}
+
+// Reads the image's partition table, returns -1 and keeps the current one if it is invalid
+int
+initialisePartitionTable (Disk * d)
+{
+	PartitionList l = { d, NULL, 0, 0, NULL, 0, 0, 0, NULL, 0, 0 };
+	PartitionTable *old = d->partitions, *t;
+	uint64_t start = clockNs ();
+	MBRblock mbrb;
+	int i, gpt = 0, invalid = 0;
+
+	partitionAdd (&l, 0, 0, d->size);
+	strcpy (l.p[0].name, ENTIRE_DISK_STR);
+//
+// Check that this is unformated, a DOS partitioned or a GPT disk.  Sorry but other formats not supported.
+//
+	if (RT_FAILURE (partitionRead (&l, 0, &mbrb, sizeof (mbrb))))
+	{
+		vlog (LOGLEVEL_ERROR, "%s: Cannot read the MBR of the image", d->name);
+		invalid = 1;
+	}
+	else if (mbrb.signature == 0x0000)
+		;														// an unformated disk is allowed but only EntireDisk is defined
+	else if (mbrb.signature != 0xaa55)
+	{
+		vlog (LOGLEVEL_ERROR, "%s: Invalid MBR found on image with signature 0x%04hX", d->name,
+					mbrb.signature);
+		invalid = 1;
+	}
+	else
+	{
+		for (i = 0; i < 4; i++)
+			if (mbrb.descriptor[i].type == PARTTYPE_GPT)
+				gpt = 1;
+		if (gpt && gptRead (&l, BLOCKSIZE) < 0 && gptRead (&l, 4096) < 0)
+		{
+			vlog (LOGLEVEL_WARN, "%s: no valid GPT found, showing the protective MBR instead", d->name);
+			gpt = 0;
+		}
+		if (!gpt && mbrRead (&l, &mbrb) < 0)
+			invalid = 1;
+	}
+	free (l.window);
+	if (invalid)
+	{
+		free (l.p);
+		free (l.sources);
+		return -1;
+	}
+//
+// Now print out the partition table
+//
+	if (multiImage)
+		vbprintf ("partitions of %s", d->name);
+	vbprintf ("Partition       Size           Offset");
+	vbprintf ("=========       ====           ======");
+	for (i = 1; i <= l.last; i++)
+	{
+		Partition *p = l.p + i;
+		if (p->no != UNALLOCATED)
+		{
+			sprintf (p->name, PARTITION_PREFIX "%d", i);
+			vbprintf ("%-14s  %-13lld  %-13lld", p->name, p->offset, p->size);
+		}
+	}
+	vbprintf ("read in %.1f ms with %d read(s) of the image", (clockNs () - start) / 1e6, l.reads);
+
+// A re-read that finds the same partitions from the same bytes keeps the current version
+	if (old && l.last == old->last && l.nSources == old->nSources
+			&& memcmp (l.p, old->p, (l.last + 1) * sizeof (Partition)) == 0
+			&& memcmp (l.sources, old->sources, l.nSources * sizeof (DiskRange)) == 0)
+	{
+		free (l.p);
+		free (l.sources);
+		return 0;
+	}
+	if (!(t = malloc (sizeof (PartitionTable) + (l.last + 1) * sizeof (Partition))))
+		usageAndExit ("out of memory reading the partition table");
+	t->version = (old) ? old->version + 1 : 1;
+	t->last = l.last;
+	t->nSources = l.nSources;
+	t->sources = l.sources;
+	t->retiredEpoch = 0;
+	t->nextRetired = NULL;
+	memcpy (t->p, l.p, (l.last + 1) * sizeof (Partition));
+	free (l.p);
+	if (old)
+		vbprintf ("%s: partition table is now version %llu", d->name, (unsigned long long) t->version);
+	__atomic_store_n (&d->partitions, t, __ATOMIC_SEQ_CST);
+	if (old)
+		partitionRetire (old);
+	return 0;
+}
+
+int
+findPartition (const PartitionTable * t, const char *name)
+{
+// Names are EntireDisk or PartitionN with N the index into p, so nothing is searched
+	const char *digits = name + strlen (PARTITION_PREFIX);
+	char *end;
+	long n;
+
+	if (strcmp (name, ENTIRE_DISK_STR) == 0)
+		return 0;
+	if (strncmp (name, PARTITION_PREFIX, strlen (PARTITION_PREFIX)) != 0
+			|| !isdigit ((unsigned char) *digits) || *digits == '0')
+		return -1;
+	n = strtol (digits, &end, 10);
+	if (*end != '\0' || n > t->last || t->p[n].no == UNALLOCATED)
+		return -1;
+	return n;
+}
+
+// Returns the image an inode number belongs to, with in *n the partition table index it refers to
+// or -1 for the image's own directory.  NULL for the root, /.stats and unused numbers.
+static Disk *
+inodeImage (fuse_ino_t ino, int *n)
+{
+	fuse_ino_t k;
+
+	if (ino < IMAGE_INODE (0))
+		return NULL;
+	k = ino - IMAGE_INODE (0);
+	if (!multiImage)
+	{
+		*n = (k < IMAGE_INODES) ? (int) k : -1;
+		return (k < IMAGE_INODES) ? disks[0] : NULL;
+	}
+	if (k / IMAGE_INODES >= (fuse_ino_t) diskCount)
+		return NULL;
+	*n = (int) (k % IMAGE_INODES) - 1;
+	return disks[k / IMAGE_INODES];
+}
+
+// Returns the partition table index an inode number refers to and its image in *dp, or -1.  If
+// part is not NULL the partition is copied to it, so the request sees one version throughout.
+static int
+inodePartition (fuse_ino_t ino, Disk ** dp, Partition * part)
+{
+	PartitionTable *t;
+	int n;
+	Disk *d = inodeImage (ino, &n);
+
+	if (!d || n < 0 || __atomic_load_n (&d->partitionState, __ATOMIC_ACQUIRE) != PARTITIONS_READ)
+		return -1;
+	t = partitionsCurrent (d);
+	if (n > t->last || t->p[n].no == UNALLOCATED)
+		return -1;
+	if (part)
+		*part = t->p[n];
+	*dp = d;
+	return n;
+}
+
+// Fills in the attributes of a directory or of a partition file
 static int
-VD_getattr (const char *p, struct stat *stbuf)
+inodeStat (fuse_ino_t ino, struct stat *stbuf)
 {
-	vbprintf ("getattr: %s", p);
-	int isFileRoot = (strcmp ("/", p) == 0);
-	int n = findPartition (p);
+	int isFileRoot = (ino == FUSE_ROOT_ID);
+	int isStats = (ino == STATS_INODE && statsEnabled);
+	Disk *d = disks[0];
+	Partition part;
+	int n = -1, isDir = isFileRoot;
 
-	if (!isFileRoot && n == -1)
-		return -ENOENT;
+	if (!isFileRoot && !isStats && (n = inodePartition (ino, &d, &part)) == -1)
+	{
+// An image's directory is there whether or not the image has been opened yet
+		if (!multiImage || (d = inodeImage (ino, &n)) == NULL || n != -1)
+			return -1;
+		isDir = 1;
+	}
 
 // Use the container file's stat return as the basis. However since partitions cannot
 // be created by creating files, there is no write access to the directory.  I also
 // treat group access the same as other.
 
-	memcpy (stbuf, &VDfile_stat, sizeof (struct stat));
+	memcpy (stbuf, &d->fileStat, sizeof (struct stat));
+	stbuf->st_ino = ino;
 
-	if (isFileRoot)
+	if (isDir)
 	{
 		stbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP;
 		if (allowall)
@@ -596,6 +1949,15 @@ VD_getattr (const char *p, struct stat *stbuf)
 		stbuf->st_size = 0;
 		stbuf->st_blocks = 2;
 	}
+	else if (isStats)
+	{
+// The size is unknown until the file is opened, which fuse copes with as it is opened direct_io
+		stbuf->st_mode = S_IFREG | S_IRUSR;
+		if (allowall)
+			stbuf->st_mode |= S_IRGRP | S_IROTH;
+		stbuf->st_size = 0;
+		stbuf->st_blocks = 0;
+	}
 	else
 	{
 		stbuf->st_mode = S_IFREG | S_IRUSR | S_IWUSR;
@@ -603,8 +1965,8 @@ VD_getattr (const char *p, struct stat *stbuf)
 			stbuf->st_mode |= S_IRGRP | S_IROTH;
 		if (allowallw)
 			stbuf->st_mode |= S_IWGRP | S_IWOTH;
-		stbuf->st_size = partitionTable[n].size;
-		stbuf->st_blocks = (stbuf->st_size + BLOCKSIZE - 1) / BLOCKSIZE;
+		stbuf->st_size = part.size;
+		stbuf->st_blocks = (sparseDataBytes (d, part.offset, part.size) + BLOCKSIZE - 1) / BLOCKSIZE;
 	}
 	if (readonly)
 	{
@@ -612,115 +1974,4411 @@ VD_getattr (const char *p, struct stat *stbuf)
 	}
 
 	stbuf->st_nlink = 1;
-
 	return 0;
 }
 
-static int
-VD_open (const char *cName, struct fuse_file_info *i)
+// The kernel caches attributes, names and pages for attr_timeout / entry_timeout seconds, so when
+// the partition table is re-read it has to be told about partitions that moved, resized or vanished.
+static void
+invalidatePartitions (Disk * d, const PartitionTable * old)
 {
-	vbprintf ("open: %s, %lld, 0X%08lX ", cName, i->fh, i->flags);
-	int n = findPartition (cName);
-	if ((n == -1) || (entireDiskOpened && n > 0) || (partitionOpened && n == 0))
-		return -ENOENT;
-	if (readonly && ((i->flags & (O_WRONLY | O_RDWR)) != 0))
-		return -EROFS;
+#if FUSE_VERSION >= 28
+	const PartitionTable *t = partitionsCurrent (d);
+	int n, last;
 
-	if (n == 0)
-		entireDiskOpened = 1;
-	else
-		partitionOpened = 1;
-
-	pthread_mutex_lock (&part_mutex);
-	opened++;
-	pthread_mutex_unlock (&part_mutex);
-
-	return 0;
+	if (!fuseChannel || old == t)
+		return;											// not mounted, or unchanged
+	last = (old->last > t->last) ? old->last : t->last;
+	for (n = 1; n <= last; n++)
+	{
+		Partition none = {.no = UNALLOCATED };
+		const Partition *p = (n <= t->last) ? t->p + n : &none;
+		const Partition *o = (n <= old->last) ? old->p + n : &none;
+		if (o->no == p->no && o->offset == p->offset && o->size == p->size)
+			continue;
+		if (o->no != UNALLOCATED)
+		{
+			fuse_lowlevel_notify_inval_inode (fuseChannel, PARTITION_INODE (d, n), 0, 0);
+			fuse_lowlevel_notify_inval_entry (fuseChannel, d->inode, o->name, strlen (o->name));
+		}
+		else
+			fuse_lowlevel_notify_inval_entry (fuseChannel, d->inode, p->name, strlen (p->name));
+	}
+#endif
 }
 
-static int
-VD_release (const char *name, struct fuse_file_info *fi)
+// detects type of virtual image, returns -1 if it is not one vdfuse knows
+int
+detectDiskType (char **disktype, char *filename)
 {
-	(void) fi;
-	vbprintf ("release: %s", name);
+	char buf[8] = { 0 };
+	int fd = open (filename, O_RDONLY);
+	read (fd, buf, sizeof (buf));
 
-	pthread_mutex_lock (&part_mutex);
-	opened--;
-	if (opened == 0)
+	if (strncmp (buf, "conectix", 8) == 0)
+		*disktype = "VHD";
+	else if (strncmp (buf, "VMDK", 4) == 0)
+		*disktype = "VMDK";
+	else if (strncmp (buf, "KDMV", 4) == 0)
+		*disktype = "VMDK";
+	else if (strncmp (buf, "<<<", 3) == 0)
+		*disktype = "VDI";
+	else if (lseek (fd, -512, SEEK_END) >= 0 && read (fd, buf, sizeof (buf)) == sizeof (buf)
+					 && strncmp (buf, "conectix", 8) == 0)
+		*disktype = "VHD";						// fixed VHDs only have the footer at the end
+	else
 	{
-		initialisePartitionTable ();
-		entireDiskOpened = 0;
-		partitionOpened = 0;
+		vlog (LOGLEVEL_ERROR, "cannot autodetect disk type of %s", filename);
+		close (fd);
+		return -1;
 	}
-	pthread_mutex_unlock (&part_mutex);
 
+	vbprintf ("disktype is %s", *disktype);
+	close (fd);
 	return 0;
 }
 
+//====================================================================================================
+//                                      Differencing chains
+//====================================================================================================
+//
+// A VDI or VHD differencing image records the uuid of its parent, and a VHD also where the parent
+// was when the child was made.  When -f names a differencing image and no -s follows it, the chain
+// is walked from there down to the base image: the recorded path is tried first, absolute or next
+// to the child, then the same file name next to the child, and last every .vdi and .vhd file next
+// to the child and in the directory above it (VirtualBox keeps snapshots in a subdirectory of the
+// base image) for the one carrying the parent's uuid.  A chain given with -s is checked the same
+// way, layer by layer.  Only the image headers are read here; the block maps are loaded when the
+// image is opened.
+
 static int
-VD_read (const char *c, char *out, size_t len, off_t offset,
-				 struct fuse_file_info *i UNUSED)
+sameUuid (const VDImage * img, const unsigned char *uuid)
 {
-	vbprintf ("read: %s, offset=%lld, length=%d", c, offset, len);
-	int n = findPartition (c);
-	if (n < 0)
-		return -ENOENT;
-	if ((n == 0) ? partitionOpened : entireDiskOpened)
-		return -EIO;
+	return memcmp (img->uuid, uuid, sizeof (img->uuid)) == 0;
+}
 
-	Partition *p = &(partitionTable[n]);
-//   if (offset >= p->size) return 0;
-//   if (offset + len> p->size) len = p->size - offset;
-	if ((uint64_t) offset >= p->size)
+// Probes file as the parent of child, filling img and returning 0 if it is
+static int
+probeParent (const VDImage * child, const char *file, VDImage * img)
+{
+	if (vdImageProbe (img, file) < 0)
+		return -1;
+	if (sameUuid (img, child->parentUuid))
 		return 0;
-	if ((uint64_t) (offset + len) > p->size)
-		len = p->size - offset;
-
-	pthread_mutex_lock (&disk_mutex);
-	int ret = DISKread (offset + p->offset, out, len);
-	pthread_mutex_unlock (&disk_mutex);
-
-	return RT_SUCCESS (ret) ? (signed) len : -EIO;
+	vdImageClose (img);
+	return -1;
 }
 
+// Looks for a parent image among the .vdi and .vhd files in dir
 static int
-VD_readdir (const char *p, void *buf, fuse_fill_dir_t filler,
-						off_t offset UNUSED, struct fuse_file_info *i UNUSED)
+scanForParent (const VDImage * child, const char *dir, char *parent, VDImage * img)
 {
-	int n;
-	vbprintf ("readdir");
-	if (strcmp ("/", p) != 0)
-		return -ENOENT;
-	filler (buf, ".", NULL, 0);
-	filler (buf, "..", NULL, 0);
-	for (n = 0; n <= lastPartition; n++)
-	{
-		Partition *p = partitionTable + n;
-		if (p->no != UNALLOCATED)
-			filler (buf, p->name, NULL, 0);
+	DIR *dp = opendir (dir);
+	struct dirent *e;
+	int found = -1;
+
+	if (!dp)
+		return -1;
+	while (found < 0 && (e = readdir (dp)) != NULL)
+	{
+		size_t len = strlen (e->d_name);
+		if (len < 4 || (strcasecmp (e->d_name + len - 4, ".vdi") != 0
+										&& strcasecmp (e->d_name + len - 4, ".vhd") != 0))
+			continue;
+		if (snprintf (parent, PATH_MAX, "%s/%s", dir, e->d_name) < PATH_MAX)
+			found = probeParent (child, parent, img);
 	}
-	return 0;
+	closedir (dp);
+	return found;
 }
 
+// Finds the parent of the differencing image file, whose header is in child.  On success its path
+// is left in parent (PATH_MAX long) and its header in img.
 static int
-VD_write (const char *c, const char *in, size_t len, off_t offset,
-					struct fuse_file_info *i UNUSED)
+findParent (const char *file, const VDImage * child, char *parent, VDImage * img)
 {
-	vbprintf ("write: %s, offset=%lld, length=%d", c, offset, len);
-	int n = findPartition (c);
-	if (n < 0)
-		return -ENOENT;
-	if ((n == 0) ? partitionOpened : entireDiskOpened)
-		return -EIO;
-	Partition *p = &(partitionTable[n]);
-	if ((uint64_t) offset >= p->size)
+	char dir[PATH_MAX];
+	char *slash;
+
+	snprintf (dir, sizeof (dir), "%s", file);
+	if ((slash = strrchr (dir, '/')) != NULL)
+		*slash = 0;
+	else
+		strcpy (dir, ".");
+
+	if (child->parentPath)
+	{
+		const char *base = strrchr (child->parentPath, '/');
+		if (child->parentPath[0] == '/' && probeParent (child, child->parentPath, img) == 0)
+			return snprintf (parent, PATH_MAX, "%s", child->parentPath) < PATH_MAX ? 0 : -1;
+		if (child->parentPath[0] != '/'
+				&& snprintf (parent, PATH_MAX, "%s/%s", dir, child->parentPath) < PATH_MAX
+				&& probeParent (child, parent, img) == 0)
+			return 0;
+		if (snprintf (parent, PATH_MAX, "%s/%s", dir, base ? base + 1 : child->parentPath) < PATH_MAX
+				&& probeParent (child, parent, img) == 0)
+			return 0;
+	}
+	if (scanForParent (child, dir, parent, img) == 0)
 		return 0;
-	if ((uint64_t) (offset + len) > p->size)
-		len = p->size - offset;
+	strncat (dir, "/..", sizeof (dir) - strlen (dir) - 1);
+	return scanForParent (child, dir, parent, img);
+}
 
-	pthread_mutex_lock (&disk_mutex);
-	int ret = DISKwrite (offset + p->offset, in, len);
-	pthread_mutex_unlock (&disk_mutex);
+// Fills in the chain of a differencing image given on its own, or checks one given with -s
+void
+diskResolveChain (Disk * d)
+{
+	VDImage img[DIFFERENCING_MAX + 1];
+	char *files[DIFFERENCING_MAX + 1];
+	char parent[PATH_MAX];
+	int n, l, k;
+
+	if (d->layerCount > 1)
+	{
+		for (l = 0; l < d->layerCount; l++)
+			if (vdImageProbe (&img[l], d->layerFile[l]) < 0
+					|| img[l].kind == VDIMAGE_RAW || img[l].kind == VDIMAGE_VMDK)
+				img[l].kind = VDIMAGE_UNKNOWN;	// no uuid to check, left to the backend
+		for (l = 1; l < d->layerCount; l++)
+			if (img[l].kind != VDIMAGE_UNKNOWN && img[l - 1].kind != VDIMAGE_UNKNOWN
+					&& vdImageHasParent (&img[l]) && !sameUuid (&img[l - 1], img[l].parentUuid))
+				usageAndExit ("%s is not the parent of %s", d->layerFile[l - 1], d->layerFile[l]);
+		for (l = 0; l < d->layerCount; l++)
+			vdImageClose (&img[l]);
+		return;
+	}
 
-	return RT_SUCCESS (ret) ? (signed) len : -EIO;
+	if (vdImageProbe (&img[0], d->layerFile[0]) < 0)
+		return;
+	files[0] = d->layerFile[0];
+	for (n = 1; vdImageHasParent (&img[n - 1]); n++)
+	{
+		if (n == DIFFERENCING_MAX + 1)
+			usageAndExit ("%s has more than %d differencing images", d->layerFile[0], DIFFERENCING_MAX);
+		if (findParent (files[n - 1], &img[n - 1], parent, &img[n]) < 0)
+			usageAndExit ("cannot find the parent image of %s", files[n - 1]);
+		for (k = 0; k < n; k++)
+			if (sameUuid (&img[k], img[n].uuid))
+				usageAndExit ("the differencing images of %s form a loop", d->layerFile[0]);
+		if ((files[n] = realpath (parent, NULL)) == NULL)
+			usageAndExit ("cannot resolve the path of %s", parent);
+	}
+
+// files runs from the image given down to the base, the layers from the base up
+	if (n > 1)
+	{
+		vbprintf ("%s is a differencing image over %d image(s)", d->layerFile[0], n - 1);
+		d->layerType[n - 1] = d->layerType[0];
+		for (l = 0; l < n; l++)
+		{
+			d->layerFile[l] = files[n - 1 - l];
+			if (l < n - 1)
+				d->layerType[l] = "auto";
+			vbprintf ("layer %d: %s (%s)", l, d->layerFile[l], vdImageKindName (img[n - 1 - l].kind));
+		}
+		d->layerCount = n;
+	}
+	for (l = 0; l < n; l++)
+		vdImageClose (&img[l]);
+}
+
+//====================================================================================================
+//                                      Partition table versions
+//====================================================================================================
+//
+// A replaced table may still be in use by requests that loaded it just before, so it is retired
+// rather than freed.  This is epoch based reclamation over the fuse worker threads: each worker
+// records the epoch it started its current request in (partitionPin) and clears it when done.
+// Retiring a table moves to a new epoch, and the table is freed once no worker is still in an
+// earlier one; until then it waits on retiredTables and a later retirement frees it.  The NBD
+// workers pin the same way, and the NBD connection readers take turns at one more slot.
+
+#define PIN_SLOTS (WORKER_THREADS_MAX + 1)
+#define PIN_SLOT_NBD_READERS WORKER_THREADS_MAX
+
+static volatile uint64_t partitionEpoch = 1;
+static volatile uint64_t workerEpoch[PIN_SLOTS];	// 0 while the worker is idle
+static PartitionTable *retiredTables = NULL;
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+
+static PartitionTable *
+partitionsCurrent (Disk * d)
+{
+	return __atomic_load_n (&d->partitions, __ATOMIC_SEQ_CST);
+}
+
+void
+partitionPin (int worker)
+{
+	__atomic_store_n (&workerEpoch[worker], __atomic_load_n (&partitionEpoch, __ATOMIC_SEQ_CST),
+										__ATOMIC_SEQ_CST);
+}
+
+void
+partitionUnpin (int worker)
+{
+	__atomic_store_n (&workerEpoch[worker], 0, __ATOMIC_RELEASE);
+}
+
+// Frees the retired tables that no running request can still see
+static void
+partitionRetire (PartitionTable * old)
+{
+	PartitionTable **r, *t;
+	uint64_t oldest = UINT64_MAX;
+	int w;
+
+	pthread_mutex_lock (&retireLock);
+	old->retiredEpoch = __atomic_add_fetch (&partitionEpoch, 1, __ATOMIC_SEQ_CST);
+	old->nextRetired = retiredTables;
+	retiredTables = old;
+	for (w = 0; w < PIN_SLOTS; w++)
+	{
+		uint64_t e = __atomic_load_n (&workerEpoch[w], __ATOMIC_SEQ_CST);
+		if (e && e < oldest)
+			oldest = e;
+	}
+	for (r = &retiredTables; (t = *r) != NULL;)
+	{
+		if (t->retiredEpoch > oldest)
+		{
+			r = &t->nextRetired;
+			continue;
+		}
+		*r = t->nextRetired;
+		free (t->sources);
+		free (t);
+	}
+	pthread_mutex_unlock (&retireLock);
+}
+
+// Returns whether a write of len bytes at offset of the image reaches bytes the table was read from
+static int
+partitionsWritten (const PartitionTable * t, uint64_t offset, size_t len)
+{
+	int i;
+
+	for (i = 0; i < t->nSources; i++)
+		if (offset < t->sources[i].offset + t->sources[i].len && offset + len > t->sources[i].offset)
+			return 1;
+	return 0;
+}
+
+// Re-reads a stale partition table and tells the kernel what changed.  Called with partLock held.
+// Returns -1 and keeps the current table if the new one is invalid.
+int
+partitionsUpdate (Disk * d)
+{
+// The caller is pinned (a worker serving a request, or an NBD thread closing its export), so old
+// stays valid after initialisePartitionTable retires it
+	PartitionTable *old = partitionsCurrent (d);
+	int ret;
+
+	__atomic_store_n (&d->partitionsStale, 0, __ATOMIC_SEQ_CST);
+	if ((ret = initialisePartitionTable (d)) == 0)
+		invalidatePartitions (d, old);
+	return ret;
+}
+
+//====================================================================================================
+//                                            Disk handle pool
+//====================================================================================================
+//
+// Every VD call goes through one of the image's handles.  A read picks the handle this thread used
+// last time (handed out round-robin on first use) and falls back to any idle handle before it
+// blocks, so with N handles up to N reads are in flight in VDRead at once.  Writes and flushes only
+// ever happen on writable mounts, which have exactly one handle.
+
+// Adds an image to serve, named after its file unless name is given
+Disk *
+diskAdd (char *name, char *file)
+{
+	Disk **grown = realloc (disks, (diskCount + 1) * sizeof (Disk *));
+	Disk *d = calloc (1, sizeof (Disk));
+
+	if (!grown || !d)
+		usageAndExit ("out of memory");
+	disks = grown;
+	d->name = (name) ? name : (strrchr (file, '/')) ? strrchr (file, '/') + 1 : file;
+	d->index = diskCount;
+	d->layerFile[0] = file;
+	d->layerCount = 1;
+	d->state = DISK_CLOSED;
+	pthread_mutex_init (&d->openLock, NULL);
+	pthread_mutex_init (&d->partLock, NULL);
+	pthread_mutex_init (&d->writebackLock, NULL);
+	pthread_mutex_init (&d->writebackFlushLock, NULL);
+	disks[diskCount++] = d;
+	return d;
+}
+
+void
+diskAddLayer (Disk * d, char *file)
+{
+	if (d->layerCount == DIFFERENCING_MAX + 1)
+		usageAndExit ("Too many differencing disks");
+	d->layerType[d->layerCount] = "auto";
+	d->layerFile[d->layerCount++] = file;
+}
+
+// Opens the image chain, returns -1 if that failed.  The partition table is left to diskPartitions.
+int
+diskOpen (Disk * d)
+{
+	int l;
+
+	for (l = 0; l < d->layerCount; l++)
+		if (strcmp (d->layerType[l], "auto") == 0
+				&& detectDiskType (&d->layerType[l], d->layerFile[l]) < 0)
+			return -1;
+	if (openDiskHandles (d) < 0)
+		return -1;
+	d->size = DISKsize (d);
+	if (overlayOpen (d) < 0)
+	{
+		DISKclose (d);
+		return -1;
+	}
+	persistOpen (d);
+	writebackOpen (d);
+	sparseInit (d);
+	zeroCopyInit (d);
+	return 0;
+}
+
+// Opens an image the first time it is needed, returns 0 once it is open.  An image that fails to
+// open is not tried again.
+static int
+diskAccess (Disk * d)
+{
+	if (__atomic_load_n (&d->state, __ATOMIC_ACQUIRE) == DISK_CLOSED)
+	{
+		pthread_mutex_lock (&d->openLock);
+		if (d->state == DISK_CLOSED)
+		{
+			uint64_t start = clockNs ();
+			int ret = diskOpen (d);
+			if (ret < 0)
+				vlog (LOGLEVEL_ERROR, "cannot open image %s", d->name);
+			else
+				vbprintf ("opened image %s in %.1f ms", d->name, (clockNs () - start) / 1e6);
+			__atomic_store_n (&d->state, (ret < 0) ? DISK_FAILED : DISK_OPEN, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock (&d->openLock);
+	}
+	return (__atomic_load_n (&d->state, __ATOMIC_ACQUIRE) == DISK_OPEN) ? 0 : -1;
+}
+
+// Reads an image's partition table the first time its directory is looked into, opening the image
+// first if need be, so that mounting never waits for it.  Returns 0 once the table is there.
+static int
+diskPartitions (Disk * d)
+{
+	if (diskAccess (d) < 0)
+		return -1;
+	if (__atomic_load_n (&d->partitionState, __ATOMIC_ACQUIRE) == PARTITIONS_UNREAD)
+	{
+		pthread_mutex_lock (&d->partLock);
+		if (d->partitionState == PARTITIONS_UNREAD)
+			__atomic_store_n (&d->partitionState, (initialisePartitionTable (d) < 0)
+												? PARTITIONS_FAILED : PARTITIONS_READ, __ATOMIC_RELEASE);
+		pthread_mutex_unlock (&d->partLock);
+	}
+	return (__atomic_load_n (&d->partitionState, __ATOMIC_ACQUIRE) == PARTITIONS_READ) ? 0 : -1;
+}
+
+// Opens every layer of the image chain in one container, timing each.  The native backend loads
+// the block maps of the layers in parallel and stacks them in order afterwards; the VD library
+// needs each layer's parent in place, so there they are opened one after the other.
+static int
+openLayers (DiskHandle * dh, Disk * d, uint64_t * layerNs)
+{
+#ifdef USE_NATIVE_BACKEND
+	int ret = vdNativeSetIO (dh->hdd, imageIO);
+
+	vdNativeSetDirect (dh->hdd, imageDirect);
+	if (ret < 0)
+		vlog (LOGLEVEL_ERROR, "io_uring is not available for %s: %s", d->name, strerror (-ret));
+	else if ((ret = vdNativeOpenLayers (dh->hdd, (const char *const *) d->layerFile, d->layerCount,
+																			imageReadonly, layerNs)) < 0)
+		vlog (LOGLEVEL_ERROR, "opening the images of %s failed: %s", d->name, strerror (-ret));
+	else
+	{
+		vbprintf ("image files of %s are read and written with %s%s", d->name,
+							vdNativeIOName (dh->hdd), imageDirect ? ", O_DIRECT" : "");
+		if (imageDirect && vdNativeDirectLayers (dh->hdd) < d->layerCount)
+			vlog (LOGLEVEL_WARN, "%d of the %d images of %s do not allow O_DIRECT and use the page cache",
+						d->layerCount - vdNativeDirectLayers (dh->hdd), d->layerCount, d->name);
+	}
+	return ret;
+#else
+	int l;
+
+	for (l = 0; l < d->layerCount; l++)
+	{
+		uint64_t start = clockNs ();
+		if (RT_FAILURE (DISKopen (dh->hdd, d->layerType[l], d->layerFile[l])))
+		{
+			vlog (LOGLEVEL_ERROR, "opening image %s failed", d->layerFile[l]);
+			return -1;
+		}
+		layerNs[l] = clockNs () - start;
+	}
+	return 0;
+#endif
+}
+
+typedef struct
+{
+	Disk *disk;
+	DiskHandle *handle;
+	uint64_t layerNs[DIFFERENCING_MAX + 1];
+	int threaded;
+	int ret;
+} HandleOpening;
+
+static void *
+openDiskHandle (void *arg)
+{
+	HandleOpening *o = arg;
+	o->ret = openLayers (o->handle, o->disk, o->layerNs);
+	return NULL;
+}
+
+// Opens the readers handles.  Each handle is a container of its own, so with the VD library they
+// are opened in parallel, a thread each.
+int
+openDiskHandles (Disk * d)
+{
+	HandleOpening *opening;
+	pthread_t *threads;
+	int h, l, ret = 0;
+
+	if (readers == 0)
+		readers = (imageReadonly && !DISK_THREADSAFE) ? DISKHANDLE_DEFAULT_RO : 1;
+	if (DISK_THREADSAFE && readers > 1)
+	{
+		vbprintf ("readers=%d ignored since one native disk handle serves all readers", readers);
+		readers = 1;
+	}
+	if (!imageReadonly && readers > 1)
+	{
+		vbprintf ("readers=%d ignored since the image is opened for writing", readers);
+		readers = 1;
+	}
+
+	d->handles = calloc (readers, sizeof (DiskHandle));
+	opening = calloc (readers, sizeof (HandleOpening));
+	threads = calloc (readers, sizeof (pthread_t));
+	if (!d->handles || !opening || !threads)
+		ret = -1;
+	for (d->handleCount = 0, h = 0; ret == 0 && h < readers; h++)
+	{
+		DiskHandle *dh = d->handles + h;
+		if (RT_FAILURE (CONTAINERcreate (&dh->hdd)))
+		{
+			vlog (LOGLEVEL_ERROR, "invalid initialisation of VD interface");
+			ret = -1;
+			break;
+		}
+		pthread_mutex_init (&dh->lock, NULL);
+		d->handleCount++;
+		opening[h].disk = d;
+		opening[h].handle = dh;
+	}
+
+// A handle whose thread cannot be started is opened here instead
+	for (h = 0; ret == 0 && h < d->handleCount; h++)
+		if (d->handleCount > 1 && pthread_create (&threads[h], NULL, openDiskHandle, &opening[h]) == 0)
+			opening[h].threaded = 1;
+		else
+			openDiskHandle (&opening[h]);
+	for (h = 0; ret == 0 && h < d->handleCount; h++)
+		if (opening[h].threaded)
+			pthread_join (threads[h], NULL);
+	for (h = 0; ret == 0 && h < d->handleCount; h++)
+		ret = opening[h].ret;
+
+	if (ret == 0)
+	{
+		for (l = 0; l < d->layerCount; l++)
+			vbprintf ("layer %d %s opened in %.1f ms", l, d->layerFile[l], opening[0].layerNs[l] / 1e6);
+		vbprintf ("opened %d disk handle(s) over %d image(s)", d->handleCount, d->layerCount);
+	}
+	else if (d->handles)
+	{
+		DISKclose (d);
+		free (d->handles);
+		d->handles = NULL;
+		d->handleCount = 0;
+	}
+	free (opening);
+	free (threads);
+	return ret < 0 ? -1 : 0;
+}
+
+#if !DISK_THREADSAFE
+static DiskHandle *
+acquireDiskHandle (Disk * d)
+{
+	static int nextHandle = 0;
+	static __thread int preferred = -1;
+	int h;
+
+// Every image has the same number of handles, so a thread prefers the same one on all of them
+	if (preferred < 0)
+		preferred = __sync_fetch_and_add (&nextHandle, 1) % d->handleCount;
+	if (pthread_mutex_trylock (&d->handles[preferred].lock) == 0)
+	{
+		statRecordNs (STAT_LOCK_WAIT, 0, 0, 0);
+		return d->handles + preferred;
+	}
+	for (h = (preferred + 1) % d->handleCount; h != preferred; h = (h + 1) % d->handleCount)
+	{
+		if (pthread_mutex_trylock (&d->handles[h].lock) == 0)
+		{
+			preferred = h;
+			statRecordNs (STAT_LOCK_WAIT, 0, 0, 0);
+			return d->handles + h;
+		}
+	}
+	uint64_t start = statNow ();
+	pthread_mutex_lock (&d->handles[preferred].lock);
+	statRecord (STAT_LOCK_WAIT, start, 0, 0);
+	return d->handles + preferred;
+}
+#endif
+
+static int
+diskReadHandle (Disk * d, uint64_t offset, void *buf, size_t len)
+{
+	uint64_t start;
+	int ret;
+#if DISK_THREADSAFE
+	start = statNow ();
+	ret = CONTAINERread (d->handles[0].hdd, offset, buf, len);
+#else
+	DiskHandle *dh = acquireDiskHandle (d);
+	start = statNow ();
+	ret = CONTAINERread (dh->hdd, offset, buf, len);
+	pthread_mutex_unlock (&dh->lock);
+#endif
+	statRecord (STAT_BACKEND_READ, start, len, RT_FAILURE (ret));
+	return ret;
+}
+
+int
+diskWriteImage (Disk * d, uint64_t offset, const void *buf, size_t len)
+{
+	uint64_t start = statNow ();
+	int ret;
+#if DISK_THREADSAFE
+	ret = CONTAINERwrite (d->handles[0].hdd, offset, buf, len);
+#else
+	pthread_mutex_lock (&d->handles[0].lock);
+	statRecord (STAT_LOCK_WAIT, start, 0, 0);
+	start = statNow ();
+	ret = CONTAINERwrite (d->handles[0].hdd, offset, buf, len);
+	pthread_mutex_unlock (&d->handles[0].lock);
+#endif
+	statRecord (STAT_BACKEND_WRITE, start, len, RT_FAILURE (ret));
+	return ret;
+}
+
+int
+diskFlush (Disk * d)
+{
+	pthread_mutex_lock (&d->handles[0].lock);
+	int ret = CONTAINERflush (d->handles[0].hdd);
+	pthread_mutex_unlock (&d->handles[0].lock);
+	return ret;
+}
+
+void
+diskCloseAll (Disk * d)
+{
+	int h;
+	for (h = 0; h < d->handleCount; h++)
+	{
+		pthread_mutex_lock (&d->handles[h].lock);
+		CONTAINERclose (d->handles[h].hdd);
+		pthread_mutex_unlock (&d->handles[h].lock);
+	}
+}
+
+//====================================================================================================
+//                                          Persistent cache
+//====================================================================================================
+//
+// With -o cache_dir=DIR the blocks read from an image are also kept in a cache file in DIR, so a
+// later mount of the same image, by this or another process, reads them from local disk instead of
+// from slow shared storage.  The file is named after the paths of the image chain.  Its header
+// records the block size, the disk size, the number of slots and a hash of every layer's path,
+// size, modification time and uuid; an image that changed in any of these starts an empty cache.
+// After the header comes the index, one entry per slot holding the disk block in it plus one (0
+// for an empty slot), and after that the slots themselves, PERSIST_BLOCK each, which are only
+// written as blocks are read so the file stays sparse.
+//
+// The cache sits under the overlay, right above the disk handles, and only serves images that are
+// never written.  It holds at most -o cache_dir_mb of blocks and evicts with CLOCK, like the block
+// cache.  Entries are not made durable one by one: the header is marked unclean for as long as the
+// cache is open and only marked clean again after a final fdatasync at unmount, so a cache left
+// behind by a crash, or whose image changed while it was mounted, is started afresh.  A process
+// holds an exclusive flock on the file; another process mounting the same image reads without it.
+//
+// A slot being filled is skipped by lookups, and the data of a hit is read outside the lock and
+// only used if the slot's generation shows it was not given to another block meanwhile.
+
+#define PERSIST_BLOCK CACHE_BLOCKSIZE
+#define PERSIST_MAXRUN CACHE_MAXRUN
+#define PERSIST_HEADER 4096
+#define PERSIST_MAGIC "VDFUSEPC"
+#define PERSIST_VERSION 1
+#define PERSIST_EMPTY UINT64_MAX
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t clean;								// the index matches the slots, see above
+	uint64_t blockSize;
+	uint64_t diskSize;
+	uint64_t nSlots;
+	uint64_t identity[2];					// hashes of the layers' paths, sizes, times and uuids
+} PersistHeader;
+
+typedef struct
+{
+	uint64_t block;								// disk block held, or PERSIST_EMPTY
+	uint32_t generation;					// bumped whenever the slot is given to another block
+	char referenced;							// CLOCK reference bit
+	char filling;									// the data is being written, lookups miss the slot
+	int next;											// next slot in the same hash bucket, or -1
+} PersistSlot;
+
+typedef struct PersistCache
+{
+	int fd;
+	char *path;
+	PersistHeader header;
+	uint64_t dataOffset;					// file offset of slot 0
+	PersistSlot *slots;
+	int *buckets;									// head slot of each hash chain, or -1
+	int nSlots;
+	int hand;											// CLOCK hand
+	int failed;										// a write failed, the cache is bypassed and left unclean
+	uint64_t hits;								// blocks
+	uint64_t misses;
+	pthread_mutex_t lock;
+} PersistCache;
+
+static uint64_t
+fnv1a (uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+	return h;
+}
+
+// Hashes what makes up the image chain: into *name its paths, into identity also each layer's
+// size, modification time and uuid
+static void
+persistIdentity (Disk * d, uint64_t * name, uint64_t identity[2])
+{
+	int l;
+
+	*name = 0xcbf29ce484222325ULL;
+	identity[0] = 0xcbf29ce484222325ULL;
+	identity[1] = 0x84222325cbf29ce4ULL;
+	for (l = 0; l < d->layerCount; l++)
+	{
+		char *path = realpath (d->layerFile[l], NULL);
+		const char *p = path ? path : d->layerFile[l];
+		struct stat st;
+		VDImage img;
+		uint64_t fields[3] = { 0, 0, 0 };
+		int i;
+
+		if (stat (p, &st) == 0)
+		{
+			fields[0] = st.st_size;
+			fields[1] = st.st_mtim.tv_sec;
+			fields[2] = st.st_mtim.tv_nsec;
+		}
+		memset (img.uuid, 0, sizeof (img.uuid));
+		if (vdImageProbe (&img, p) == 0)
+			vdImageClose (&img);
+		*name = fnv1a (*name, p, strlen (p) + 1);
+		for (i = 0; i < 2; i++)
+		{
+			identity[i] = fnv1a (identity[i], p, strlen (p) + 1);
+			identity[i] = fnv1a (identity[i], fields, sizeof (fields));
+			identity[i] = fnv1a (identity[i], img.uuid, sizeof (img.uuid));
+		}
+		free (path);
+	}
+}
+
+static inline int *
+persistBucket (PersistCache * p, uint64_t block)
+{
+	return p->buckets + (block * 2654435761ULL) % p->nSlots;
+}
+
+// Must be called with the cache locked
+static PersistSlot *
+persistFind (PersistCache * p, uint64_t block)
+{
+	int i;
+	for (i = *persistBucket (p, block); i >= 0; i = p->slots[i].next)
+		if (p->slots[i].block == block)
+			return p->slots + i;
+	return NULL;
+}
+
+// Must be called with the cache locked
+static void
+persistLink (PersistCache * p, PersistSlot * slot, uint64_t block)
+{
+	slot->block = block;
+	slot->next = *persistBucket (p, block);
+	*persistBucket (p, block) = slot - p->slots;
+}
+
+// Must be called with the cache locked
+static void
+persistUnlink (PersistCache * p, PersistSlot * slot)
+{
+	int *link = persistBucket (p, slot->block);
+	int i = slot - p->slots;
+	while (*link != i)
+		link = &p->slots[*link].next;
+	*link = slot->next;
+	slot->next = -1;
+	slot->block = PERSIST_EMPTY;
+}
+
+static int
+persistWriteHeader (PersistCache * p)
+{
+	PersistHeader h = p->header;
+	return (pwrite (p->fd, &h, sizeof (h), 0) == sizeof (h) && fdatasync (p->fd) == 0) ? 0 : -1;
+}
+
+// Loads the index if the file holds a clean cache of this image chain, returns the blocks it holds
+static uint64_t
+persistLoad (PersistCache * p)
+{
+	PersistHeader old;
+	uint64_t *index, loaded = 0;
+	size_t indexLen = (size_t) p->nSlots * sizeof (uint64_t);
+	int i;
+
+	if (pread (p->fd, &old, sizeof (old), 0) != sizeof (old) || !old.clean
+			|| memcmp (old.magic, p->header.magic, sizeof (old.magic)) != 0
+			|| old.version != p->header.version || old.blockSize != p->header.blockSize
+			|| old.diskSize != p->header.diskSize || old.nSlots != p->header.nSlots
+			|| memcmp (old.identity, p->header.identity, sizeof (old.identity)) != 0)
+		return 0;
+	if ((index = malloc (indexLen)) == NULL || pread (p->fd, index, indexLen, PERSIST_HEADER) != (ssize_t) indexLen)
+	{
+		free (index);
+		return 0;
+	}
+	for (i = 0; i < p->nSlots; i++)
+		if (index[i] > 0 && index[i] <= (p->header.diskSize + PERSIST_BLOCK - 1) / PERSIST_BLOCK
+				&& !persistFind (p, index[i] - 1))
+		{
+			persistLink (p, p->slots + i, index[i] - 1);
+			loaded++;
+		}
+	free (index);
+	return loaded;
+}
+
+void
+persistOpen (Disk * d)
+{
+	PersistCache *p;
+	uint64_t name, warm, blocks = (d->size + PERSIST_BLOCK - 1) / PERSIST_BLOCK;
+	uint64_t nSlots = ((uint64_t) persistMB << 20) / PERSIST_BLOCK;
+	int i;
+
+	if (!persistDir || blocks == 0)
+		return;
+	if (nSlots > blocks)
+		nSlots = blocks;
+	if (nSlots > INT_MAX)
+		nSlots = INT_MAX;
+	if ((p = calloc (1, sizeof (PersistCache))) == NULL
+			|| (p->path = malloc (strlen (persistDir) + 32)) == NULL
+			|| (p->slots = malloc (nSlots * sizeof (PersistSlot))) == NULL
+			|| (p->buckets = malloc (nSlots * sizeof (int))) == NULL)
+	{
+		vlog (LOGLEVEL_WARN, "no memory for the persistent cache of %s", d->name);
+		if (p)
+		{
+			free (p->path);
+			free (p->slots);
+		}
+		free (p);
+		return;
+	}
+	p->nSlots = nSlots;
+	for (i = 0; i < p->nSlots; i++)
+	{
+		p->slots[i].block = PERSIST_EMPTY;
+		p->slots[i].generation = 0;
+		p->slots[i].referenced = 0;
+		p->slots[i].filling = 0;
+		p->slots[i].next = -1;
+		p->buckets[i] = -1;
+	}
+	memcpy (p->header.magic, PERSIST_MAGIC, sizeof (p->header.magic));
+	p->header.version = PERSIST_VERSION;
+	p->header.blockSize = PERSIST_BLOCK;
+	p->header.diskSize = d->size;
+	p->header.nSlots = nSlots;
+	persistIdentity (d, &name, p->header.identity);
+	p->dataOffset = PERSIST_HEADER + (nSlots * sizeof (uint64_t) + 4095) / 4096 * 4096;
+	sprintf (p->path, "%s/vdfuse-%016llx.cache", persistDir, (unsigned long long) name);
+
+	if ((p->fd = open (p->path, O_RDWR | O_CREAT, 0600)) < 0)
+		vlog (LOGLEVEL_WARN, "cannot open the cache file %s: %s", p->path, strerror (errno));
+	else if (flock (p->fd, LOCK_EX | LOCK_NB) < 0)
+		vlog (LOGLEVEL_WARN, "the cache file %s is in use, %s is read without it", p->path, d->name);
+	else
+	{
+		if ((warm = persistLoad (p)) == 0 && ftruncate (p->fd, 0) < 0)
+			p->failed = 1;
+// Unclean until unmount, see above
+		p->header.clean = 0;
+		if (!p->failed && persistWriteHeader (p) == 0)
+		{
+			pthread_mutex_init (&p->lock, NULL);
+			d->persist = p;
+			vbprintf ("persistent cache %s of %s: %llu of %d blocks of %d KiB cached", p->path, d->name,
+								(unsigned long long) warm, p->nSlots, PERSIST_BLOCK / 1024);
+			return;
+		}
+		vlog (LOGLEVEL_WARN, "cannot write the cache file %s: %s", p->path, strerror (errno));
+	}
+	if (p->fd >= 0)
+		close (p->fd);
+	free (p->path);
+	free (p->slots);
+	free (p->buckets);
+	free (p);
+}
+
+// Copies bytes [from, from + n) of the block into dst if the cache has it
+static int
+persistLookup (PersistCache * p, uint64_t block, char *dst, size_t from, size_t n)
+{
+	PersistSlot *slot;
+	uint32_t generation;
+	int hit = 0;
+
+	pthread_mutex_lock (&p->lock);
+	if ((slot = persistFind (p, block)) != NULL && !slot->filling && !p->failed)
+	{
+		slot->referenced = 1;
+		generation = slot->generation;
+		pthread_mutex_unlock (&p->lock);
+		hit = (pread (p->fd, dst, n, p->dataOffset + (uint64_t) (slot - p->slots) * PERSIST_BLOCK + from)
+					 == (ssize_t) n);
+		pthread_mutex_lock (&p->lock);
+		hit = hit && slot->generation == generation;
+	}
+	if (hit)
+		p->hits++;
+	else
+		p->misses++;
+	pthread_mutex_unlock (&p->lock);
+	return hit;
+}
+
+static int
+persistHas (PersistCache * p, uint64_t block)
+{
+	PersistSlot *slot;
+	int has;
+
+	pthread_mutex_lock (&p->lock);
+	has = (slot = persistFind (p, block)) != NULL && !slot->filling;
+	pthread_mutex_unlock (&p->lock);
+	return has;
+}
+
+static void
+persistStore (PersistCache * p, uint64_t block, const char *src, uint32_t len)
+{
+	PersistSlot *slot = NULL;
+	uint64_t entry = block + 1;
+	int tries, i;
+
+	pthread_mutex_lock (&p->lock);
+	if (p->failed || persistFind (p, block))
+	{
+		pthread_mutex_unlock (&p->lock);
+		return;
+	}
+	for (tries = 0; tries < 2 * p->nSlots; tries++)
+	{
+		PersistSlot *s = p->slots + p->hand;
+		p->hand = (p->hand + 1) % p->nSlots;
+		if (s->filling)
+			continue;
+		if (s->block == PERSIST_EMPTY || !s->referenced)
+		{
+			slot = s;
+			break;
+		}
+		s->referenced = 0;
+	}
+	if (!slot)
+	{
+		pthread_mutex_unlock (&p->lock);
+		return;											// every slot is being filled
+	}
+	if (slot->block != PERSIST_EMPTY)
+		persistUnlink (p, slot);
+	persistLink (p, slot, block);
+	slot->generation++;
+	slot->referenced = 0;
+	slot->filling = 1;
+	i = slot - p->slots;
+	pthread_mutex_unlock (&p->lock);
+
+	int ok = (pwrite (p->fd, src, len, p->dataOffset + (uint64_t) i * PERSIST_BLOCK) == (ssize_t) len
+						&& pwrite (p->fd, &entry, sizeof (entry), PERSIST_HEADER + (uint64_t) i * sizeof (entry))
+						== sizeof (entry));
+
+	pthread_mutex_lock (&p->lock);
+	slot->filling = 0;
+	if (!ok && !p->failed)
+	{
+		p->failed = 1;
+		vlog (LOGLEVEL_WARN, "cannot write the cache file %s, it is no longer used: %s", p->path,
+					strerror (errno));
+	}
+	pthread_mutex_unlock (&p->lock);
+}
+
+static inline uint32_t
+persistBlockLength (Disk * d, uint64_t block)
+{
+	uint64_t start = block * PERSIST_BLOCK;
+	return (d->size - start < PERSIST_BLOCK) ? d->size - start : PERSIST_BLOCK;
+}
+
+// Reads through the cache, fetching runs of missing blocks from the image with a single read each
+static int
+persistRead (Disk * d, uint64_t offset, char *buf, size_t len)
+{
+	PersistCache *p = d->persist;
+	uint64_t block, last, end, b;
+	int ret;
+
+	if (len == 0)
+		return 0;
+	block = offset / PERSIST_BLOCK;
+	last = (offset + len - 1) / PERSIST_BLOCK;
+	while (block <= last)
+	{
+		uint64_t blockStart = block * PERSIST_BLOCK;
+		size_t from = (offset > blockStart) ? offset - blockStart : 0;
+		size_t to = (offset + len < blockStart + PERSIST_BLOCK) ? offset + len - blockStart : PERSIST_BLOCK;
+
+		if (persistLookup (p, block, buf + (blockStart + from - offset), from, to - from))
+		{
+			block++;
+			continue;
+		}
+		for (end = block + 1; end <= last && end - block < PERSIST_MAXRUN && !persistHas (p, end); end++)
+			;
+
+// A run wholly inside the request is read in place, a partly requested one into a buffer
+		uint64_t runLen = (end - 1) * PERSIST_BLOCK + persistBlockLength (d, end - 1) - blockStart;
+		int inPlace = (blockStart >= offset && blockStart + runLen <= offset + len);
+		char *run = inPlace ? buf + (blockStart - offset) : malloc (runLen);
+		if (!run)
+			return VERR_NO_MEMORY;
+		if (RT_FAILURE (ret = diskReadHandle (d, blockStart, run, runLen)))
+		{
+			if (!inPlace)
+				free (run);
+			return ret;
+		}
+		for (b = block; b < end; b++)
+			persistStore (p, b, run + (b - block) * PERSIST_BLOCK, persistBlockLength (d, b));
+		if (!inPlace)
+		{
+			uint64_t copyFrom = (offset > blockStart) ? offset : blockStart;
+			uint64_t copyTo = (offset + len < blockStart + runLen) ? offset + len : blockStart + runLen;
+			memcpy (buf + (copyFrom - offset), run + (copyFrom - blockStart), copyTo - copyFrom);
+			free (run);
+		}
+		block = end;
+	}
+	return 0;
+}
+
+// Makes the cache file clean again, unless a write failed or the image changed while mounted
+void
+persistClose (Disk * d)
+{
+	PersistCache *p = d->persist;
+	uint64_t name, identity[2];
+
+	if (!p)
+		return;
+	d->persist = NULL;
+	persistIdentity (d, &name, identity);
+	if (p->failed || memcmp (identity, p->header.identity, sizeof (identity)) != 0)
+		vlog (LOGLEVEL_WARN, "the cache file %s is left to be started afresh", p->path);
+	else
+	{
+		p->header.clean = 1;
+		if (fdatasync (p->fd) < 0 || persistWriteHeader (p) < 0)
+			vlog (LOGLEVEL_WARN, "cannot write the cache file %s: %s", p->path, strerror (errno));
+	}
+	vbprintf ("persistent cache of %s: %llu hits, %llu misses", d->name,
+						(unsigned long long) p->hits, (unsigned long long) p->misses);
+	close (p->fd);
+	pthread_mutex_destroy (&p->lock);
+	free (p->path);
+	free (p->slots);
+	free (p->buckets);
+	free (p);
+}
+
+int
+diskReadImage (Disk * d, uint64_t offset, void *buf, size_t len)
+{
+	if (d->persist)
+		return persistRead (d, offset, buf, len);
+	return diskReadHandle (d, offset, buf, len);
+}
+
+//====================================================================================================
+//                                        Copy-on-write overlay
+//====================================================================================================
+//
+// With -o overlay=DIR writes never reach the image.  Each image gets an overlay file in DIR,
+// unlinked as soon as it is created so nothing is left behind, in which every OVERLAY_BLOCK written
+// is kept at its own disk offset, so the file stays as sparse as the writes.  The index of the
+// blocks held is a two level radix bitmap: a leaf covers OVERLAY_LEAF_BLOCKS blocks and is only
+// allocated once one of them is written, so a lookup is two loads and untouched regions cost a null
+// pointer.  Reads take each run of blocks from the overlay or the image, whichever holds it.  The
+// overlay sits below the block cache and the write-back buffer, which therefore work unchanged.
+//
+// A partly written block is first copied up from the image.  Writes to the overlay are serialised
+// by overlayLock, and a block's bit is only set once its data is in the file, so a concurrent read
+// sees either the old or the new contents.  At unmount the overlay is discarded, or written into
+// the image with -o overlay_commit, in which case the image is opened for writing from the start.
+
+#define OVERLAY_BLOCK 4096
+#define OVERLAY_LEAF_BLOCKS (1 << 15)	// a leaf is 4 KiB of bits covering 128 MiB of disk
+#define OVERLAY_COMMIT_RUN (1024 * 1024)	// bytes written back into the image at a time
+
+int
+overlayOpen (Disk * d)
+{
+	d->overlayFd = -1;
+	if (!overlayDir)
+		return 0;
+
+	char path[strlen (overlayDir) + 32];
+	snprintf (path, sizeof (path), "%s/vdfuse-overlay.XXXXXX", overlayDir);
+	if ((d->overlayFd = mkstemp (path)) < 0)
+	{
+		vlog (LOGLEVEL_ERROR, "cannot create an overlay file in %s: %s", overlayDir, strerror (errno));
+		return -1;
+	}
+	unlink (path);
+	d->overlayNLeaves = (d->size / OVERLAY_BLOCK + OVERLAY_LEAF_BLOCKS) / OVERLAY_LEAF_BLOCKS;
+	if ((d->overlayLeaves = calloc (d->overlayNLeaves, sizeof (uint64_t *))) == NULL)
+	{
+		close (d->overlayFd);
+		d->overlayFd = -1;
+		return -1;
+	}
+	pthread_mutex_init (&d->overlayLock, NULL);
+	vbprintf ("writes to %s are kept in an overlay in %s, %s at unmount", d->name, overlayDir,
+						overlayCommit ? "committed" : "discarded");
+	return 0;
+}
+
+static int
+overlayTest (Disk * d, uint64_t blk)
+{
+	uint64_t *leaf = __atomic_load_n (&d->overlayLeaves[blk / OVERLAY_LEAF_BLOCKS], __ATOMIC_ACQUIRE);
+	blk %= OVERLAY_LEAF_BLOCKS;
+	return leaf && ((__atomic_load_n (&leaf[blk >> 6], __ATOMIC_ACQUIRE) >> (blk & 63)) & 1);
+}
+
+// Returns the end (capped at limit) of the run of blocks starting at offset that are all in the
+// overlay or all in the image, and which of the two in *inOverlay
+static uint64_t
+overlayExtent (Disk * d, uint64_t offset, uint64_t limit, int *inOverlay)
+{
+	uint64_t blk = offset / OVERLAY_BLOCK, end;
+
+	*inOverlay = overlayTest (d, blk);
+	for (blk++; blk * OVERLAY_BLOCK < limit; blk++)
+	{
+		if (blk % OVERLAY_LEAF_BLOCKS == 0 && !*inOverlay
+				&& !__atomic_load_n (&d->overlayLeaves[blk / OVERLAY_LEAF_BLOCKS], __ATOMIC_ACQUIRE))
+		{
+			blk += OVERLAY_LEAF_BLOCKS - 1;	// nothing under this leaf was written
+			continue;
+		}
+		if (overlayTest (d, blk) != *inOverlay)
+			break;
+	}
+	end = blk * OVERLAY_BLOCK;
+	return (end < limit) ? end : limit;
+}
+
+// Returns whether any of [offset, offset + len) is in the overlay
+static int
+overlayHas (Disk * d, uint64_t offset, size_t len)
+{
+	int inOverlay;
+
+	if (!d->overlayLeaves)
+		return 0;
+	return overlayExtent (d, offset, offset + len, &inOverlay) < offset + len || inOverlay;
+}
+
+static int
+overlayPread (Disk * d, void *buf, size_t len, uint64_t offset)
+{
+	ssize_t n;
+
+	for (; len > 0; buf = (char *) buf + n, len -= n, offset += n)
+		if ((n = pread (d->overlayFd, buf, len, offset)) <= 0)
+		{
+			if (n < 0)
+				return VERR_GENERAL_FAILURE;
+			memset (buf, 0, len);			// a hole at the end of the file
+			break;
+		}
+	return 0;
+}
+
+static int
+overlayPwrite (Disk * d, const void *buf, size_t len, uint64_t offset)
+{
+	ssize_t n;
+
+	for (; len > 0; buf = (const char *) buf + n, len -= n, offset += n)
+		if ((n = pwrite (d->overlayFd, buf, len, offset)) <= 0)
+			return VERR_GENERAL_FAILURE;
+	return 0;
+}
+
+static int
+overlayRead (Disk * d, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t pos, next, end = offset + len;
+	int inOverlay, ret = 0;
+
+	for (pos = offset; pos < end && RT_SUCCESS (ret); pos = next)
+	{
+		next = overlayExtent (d, pos, end, &inOverlay);
+		if (inOverlay)
+			ret = overlayPread (d, buf + (pos - offset), next - pos, pos);
+		else
+			ret = diskReadImage (d, pos, buf + (pos - offset), next - pos);
+	}
+	return ret;
+}
+
+// Copies block blk from the image into the overlay unless the overlay already has it
+static int
+overlayCopyUp (Disk * d, uint64_t blk)
+{
+	char block[OVERLAY_BLOCK];
+	uint64_t offset = blk * OVERLAY_BLOCK;
+	size_t len = (d->size - offset < OVERLAY_BLOCK) ? d->size - offset : OVERLAY_BLOCK;
+	int ret;
+
+	if (overlayTest (d, blk))
+		return 0;
+	if (RT_FAILURE (ret = diskReadImage (d, offset, block, len)))
+		return ret;
+	return overlayPwrite (d, block, len, offset);
+}
+
+static int
+overlayWrite (Disk * d, uint64_t offset, const char *buf, size_t len)
+{
+	uint64_t first = offset / OVERLAY_BLOCK, last = (offset + len - 1) / OVERLAY_BLOCK, blk;
+	uint64_t start = statNow ();
+	int ret = 0;
+
+	if (len == 0)
+		return 0;
+	pthread_mutex_lock (&d->overlayLock);
+	if (offset % OVERLAY_BLOCK != 0)
+		ret = overlayCopyUp (d, first);
+	if (RT_SUCCESS (ret) && (offset + len) % OVERLAY_BLOCK != 0 && offset + len < d->size
+			&& (last != first || offset % OVERLAY_BLOCK == 0))
+		ret = overlayCopyUp (d, last);
+	if (RT_SUCCESS (ret))
+		ret = overlayPwrite (d, buf, len, offset);
+	for (blk = first; RT_SUCCESS (ret) && blk <= last; blk++)
+	{
+		uint64_t **slot = &d->overlayLeaves[blk / OVERLAY_LEAF_BLOCKS];
+		uint64_t bit = blk % OVERLAY_LEAF_BLOCKS;
+		if (!*slot)
+		{
+			uint64_t *leaf = calloc (OVERLAY_LEAF_BLOCKS / 64, sizeof (uint64_t));
+			if (!leaf)
+			{
+				ret = VERR_GENERAL_FAILURE;
+				break;
+			}
+			__atomic_store_n (slot, leaf, __ATOMIC_RELEASE);
+		}
+		if (!((*slot)[bit >> 6] & (1ULL << (bit & 63))))
+		{
+			__atomic_fetch_or (&(*slot)[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELEASE);
+			d->overlayBlocks++;
+		}
+	}
+	pthread_mutex_unlock (&d->overlayLock);
+	statRecord (STAT_BACKEND_WRITE, start, len, RT_FAILURE (ret));
+	return ret;
+}
+
+// Commits the overlay into the image if asked to, then drops it
+void
+overlayClose (Disk * d)
+{
+	char *buf;
+	uint64_t pos, next, committed = 0;
+	uint64_t leaf;
+	int inOverlay, ret = 0;
+
+	if (!d->overlayLeaves)
+		return;
+	if (overlayCommit && d->overlayBlocks > 0 && (buf = malloc (OVERLAY_COMMIT_RUN)) != NULL)
+	{
+		for (pos = 0; pos < d->size && RT_SUCCESS (ret); pos = next)
+		{
+			next = overlayExtent (d, pos, (pos + OVERLAY_COMMIT_RUN < d->size)
+														? pos + OVERLAY_COMMIT_RUN : d->size, &inOverlay);
+			if (!inOverlay)
+				continue;
+			ret = overlayPread (d, buf, next - pos, pos);
+			if (RT_SUCCESS (ret))
+				ret = diskWriteImage (d, pos, buf, next - pos);
+			committed += next - pos;
+		}
+		free (buf);
+		if (RT_SUCCESS (ret))
+			ret = DISKflush (d);
+		if (RT_FAILURE (ret))
+			vlog (LOGLEVEL_ERROR, "committing the overlay of %s failed after %llu bytes", d->name,
+						(unsigned long long) committed);
+		else
+			vbprintf ("committed %llu bytes of overlay into %s", (unsigned long long) committed, d->name);
+	}
+	else if (overlayCommit && d->overlayBlocks > 0)
+		vlog (LOGLEVEL_ERROR, "no memory to commit the overlay of %s", d->name);
+	else
+		vbprintf ("discarded %llu bytes of overlay of %s",
+							(unsigned long long) d->overlayBlocks * OVERLAY_BLOCK, d->name);
+
+	for (leaf = 0; leaf < d->overlayNLeaves; leaf++)
+		free (d->overlayLeaves[leaf]);
+	free (d->overlayLeaves);
+	d->overlayLeaves = NULL;
+	close (d->overlayFd);
+	d->overlayFd = -1;
+}
+
+int
+diskRead (Disk * d, uint64_t offset, void *buf, size_t len)
+{
+	if (d->overlayLeaves)
+		return overlayRead (d, offset, buf, len);
+	return diskReadImage (d, offset, buf, len);
+}
+
+int
+diskWrite (Disk * d, uint64_t offset, const void *buf, size_t len)
+{
+	if (d->overlayLeaves)
+		return overlayWrite (d, offset, buf, len);
+	return diskWriteImage (d, offset, buf, len);
+}
+
+//====================================================================================================
+//                                              Block cache
+//====================================================================================================
+//
+// Reads are served from a cache of CACHE_BLOCKSIZE blocks of the whole disk, so EntireDisk and the
+// PartitionN files share it.  The cache is split into CACHE_SHARDS independently locked shards
+// (block number modulo CACHE_SHARDS) each running CLOCK eviction over a fixed set of slots, and no
+// lock is held while a miss is fetched from the disk.  When several images are served they all
+// share the one cache, so -o cache_mb bounds the memory used however many images are open, and
+// blocks are keyed by image as well as block number.
+//
+// Writes go straight to the disk and then drop the blocks they overlap.  A miss that was already
+// in flight when the write happened must not re-insert what it read, so the image's
+// cacheGeneration is bumped before the drop and a fill only lands if the generation it started
+// with is still current.
+
+#define CACHE_EMPTY UINT64_MAX
+#define CACHE_KEY(d,block) (((uint64_t) (d)->index << 40) | (block))
+
+typedef struct
+{
+	uint64_t key;									// CACHE_KEY of the image and block, or CACHE_EMPTY
+	uint32_t len;									// valid bytes, short only for the last block of the disk
+	int referenced;								// CLOCK reference bit
+	int next;											// next slot in the same hash bucket, or -1
+	char *data;
+} CacheSlot;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	CacheSlot *slots;
+	int *buckets;									// head slot of each hash chain, or -1
+	int nSlots;
+	int hand;											// CLOCK hand
+	uint64_t hits;
+	uint64_t misses;
+} CacheShard;
+
+static CacheShard cacheShards[CACHE_SHARDS];
+static int cacheEnabled = 0;
+
+void
+cacheInit (void)
+{
+	int s, i;
+	int nSlots = (int) (((uint64_t) cacheMB << 20) / CACHE_BLOCKSIZE / CACHE_SHARDS);
+
+	if (nSlots == 0)
+	{
+		vbprintf ("block cache disabled");
+		return;
+	}
+	for (s = 0; s < CACHE_SHARDS; s++)
+	{
+		CacheShard *sh = cacheShards + s;
+		char *slab = NULL;
+		// Page aligned, so that with -o odirect cache fills need no bounce buffer
+		if (posix_memalign ((void **) &slab, 4096, (size_t) nSlots * CACHE_BLOCKSIZE) != 0)
+			slab = NULL;
+		sh->slots = calloc (nSlots, sizeof (CacheSlot));
+		sh->buckets = malloc (nSlots * sizeof (int));
+		if (!slab || !sh->slots || !sh->buckets)
+			usageAndExit ("cannot allocate %d MiB block cache", cacheMB);
+		for (i = 0; i < nSlots; i++)
+		{
+			sh->slots[i].key = CACHE_EMPTY;
+			sh->slots[i].next = -1;
+			sh->slots[i].data = slab + (size_t) i * CACHE_BLOCKSIZE;
+			sh->buckets[i] = -1;
+		}
+		sh->nSlots = nSlots;
+		pthread_mutex_init (&sh->lock, NULL);
+	}
+	cacheEnabled = 1;
+	vbprintf ("block cache of %d x %d KiB blocks", nSlots * CACHE_SHARDS,
+						CACHE_BLOCKSIZE / 1024);
+}
+
+// Spreads the same block number of different images over the shards and buckets
+static inline uint64_t
+cacheHash (uint64_t key)
+{
+	return (key & ((1ULL << 40) - 1)) + (key >> 40) * 2654435761ULL;
+}
+
+static inline CacheShard *
+cacheShard (uint64_t key)
+{
+	return cacheShards + cacheHash (key) % CACHE_SHARDS;
+}
+
+static inline int *
+cacheBucket (CacheShard * sh, uint64_t key)
+{
+	return sh->buckets + (cacheHash (key) / CACHE_SHARDS) % sh->nSlots;
+}
+
+// Must be called with the shard locked
+static CacheSlot *
+cacheFind (CacheShard * sh, uint64_t key)
+{
+	int i;
+	for (i = *cacheBucket (sh, key); i >= 0; i = sh->slots[i].next)
+		if (sh->slots[i].key == key)
+			return sh->slots + i;
+	return NULL;
+}
+
+// Must be called with the shard locked
+static void
+cacheUnlink (CacheShard * sh, CacheSlot * slot)
+{
+	int *link = cacheBucket (sh, slot->key);
+	int i = slot - sh->slots;
+	while (*link != i)
+		link = &sh->slots[*link].next;
+	*link = slot->next;
+	slot->next = -1;
+	slot->key = CACHE_EMPTY;
+}
+
+// Copies bytes [from, from + n) of the block into dst if the block is cached
+static int
+cacheLookup (uint64_t key, char *dst, size_t from, size_t n)
+{
+	CacheShard *sh = cacheShard (key);
+	CacheSlot *slot;
+
+	pthread_mutex_lock (&sh->lock);
+	slot = cacheFind (sh, key);
+	if (slot)
+	{
+		memcpy (dst, slot->data + from, n);
+		slot->referenced = 1;
+		sh->hits++;
+	}
+	else
+		sh->misses++;
+	pthread_mutex_unlock (&sh->lock);
+	return slot != NULL;
+}
+
+static int
+cacheContains (uint64_t key)
+{
+	CacheShard *sh = cacheShard (key);
+	int cached;
+
+	pthread_mutex_lock (&sh->lock);
+	cached = (cacheFind (sh, key) != NULL);
+	pthread_mutex_unlock (&sh->lock);
+	return cached;
+}
+
+// Counts a miss if the block is not cached, but does not count a hit if it is
+static int
+cacheProbe (uint64_t key)
+{
+	CacheShard *sh = cacheShard (key);
+	int cached;
+
+	pthread_mutex_lock (&sh->lock);
+	if (!(cached = (cacheFind (sh, key) != NULL)))
+		sh->misses++;
+	pthread_mutex_unlock (&sh->lock);
+	return cached;
+}
+
+static void
+cacheInsert (Disk * d, uint64_t block, const char *src, uint32_t len, uint64_t generation)
+{
+	uint64_t key = CACHE_KEY (d, block);
+	CacheShard *sh = cacheShard (key);
+	CacheSlot *slot;
+
+	pthread_mutex_lock (&sh->lock);
+	if (generation == d->cacheGeneration && !cacheFind (sh, key))
+	{
+		for (;;)
+		{
+			slot = sh->slots + sh->hand;
+			sh->hand = (sh->hand + 1) % sh->nSlots;
+			if (slot->key == CACHE_EMPTY)
+				break;
+			if (!slot->referenced)
+			{
+				cacheUnlink (sh, slot);
+				break;
+			}
+			slot->referenced = 0;
+		}
+		memcpy (slot->data, src, len);
+		slot->key = key;
+		slot->len = len;
+		slot->referenced = 0;
+		slot->next = *cacheBucket (sh, key);
+		*cacheBucket (sh, key) = slot - sh->slots;
+	}
+	pthread_mutex_unlock (&sh->lock);
+}
+
+static inline uint32_t
+cacheBlockLength (Disk * d, uint64_t block)
+{
+	uint64_t start = block * CACHE_BLOCKSIZE;
+	return (d->size - start < CACHE_BLOCKSIZE) ? d->size - start : CACHE_BLOCKSIZE;
+}
+
+// Reads blocks [block, end) with a single DISKread and inserts them into the cache.  On success
+// *runp holds the data read, which the caller must free.
+static int
+cacheFetchRun (Disk * d, uint64_t block, uint64_t end, char **runp, uint64_t * runLenp)
+{
+	uint64_t generation = d->cacheGeneration;
+	uint64_t blockStart = block * CACHE_BLOCKSIZE;
+	uint64_t runLen = (end - 1) * CACHE_BLOCKSIZE + cacheBlockLength (d, end - 1) - blockStart;
+	char *run = malloc (runLen);
+	uint64_t b;
+	int ret;
+
+	if (!run)
+		return VERR_NO_MEMORY;
+	ret = DISKread (d, blockStart, run, runLen);
+	if (RT_FAILURE (ret))
+	{
+		free (run);
+		return ret;
+	}
+	for (b = block; b < end; b++)
+		cacheInsert (d, b, run + (b - block) * CACHE_BLOCKSIZE, cacheBlockLength (d, b), generation);
+	*runp = run;
+	*runLenp = runLen;
+	return 0;
+}
+
+int
+cacheRead (Disk * d, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t block, last;
+	int ret;
+
+	if (!cacheEnabled)
+		return DISKread (d, offset, buf, len);
+	if (len == 0)
+		return 0;
+
+	block = offset / CACHE_BLOCKSIZE;
+	last = (offset + len - 1) / CACHE_BLOCKSIZE;
+	while (block <= last)
+	{
+		uint64_t blockStart = block * CACHE_BLOCKSIZE;
+		size_t from = (offset > blockStart) ? offset - blockStart : 0;
+		size_t to = (offset + len < blockStart + CACHE_BLOCKSIZE) ? offset + len - blockStart : CACHE_BLOCKSIZE;
+
+		if (cacheLookup (CACHE_KEY (d, block), buf + (blockStart + from - offset), from, to - from))
+		{
+			block++;
+			continue;
+		}
+
+		// Gather the run of missing blocks and fetch it with a single disk read
+		uint64_t end = block + 1;
+		while (end <= last && end - block < CACHE_MAXRUN
+					 && !cacheProbe (CACHE_KEY (d, end)))
+			end++;
+
+		char *run;
+		uint64_t runLen;
+		if (RT_FAILURE (ret = cacheFetchRun (d, block, end, &run, &runLen)))
+			return ret;
+
+		uint64_t copyFrom = (offset > blockStart) ? offset : blockStart;
+		uint64_t copyTo = (offset + len < blockStart + runLen) ? offset + len : blockStart + runLen;
+		memcpy (buf + (copyFrom - offset), run + (copyFrom - blockStart), copyTo - copyFrom);
+		free (run);
+		block = end;
+	}
+	return 0;
+}
+
+// Loads [offset, offset + len) into the cache without counting hits or misses
+void
+cachePrefetch (Disk * d, uint64_t offset, uint64_t len)
+{
+	uint64_t block, last;
+
+	if (!cacheEnabled || len == 0)
+		return;
+	block = offset / CACHE_BLOCKSIZE;
+	last = (offset + len - 1) / CACHE_BLOCKSIZE;
+	while (block <= last)
+	{
+		if (cacheContains (CACHE_KEY (d, block)))
+		{
+			block++;
+			continue;
+		}
+		uint64_t end = block + 1, runLen;
+		char *run;
+		while (end <= last && end - block < CACHE_MAXRUN && !cacheContains (CACHE_KEY (d, end)))
+			end++;
+		if (RT_FAILURE (cacheFetchRun (d, block, end, &run, &runLen)))
+			return;
+		free (run);
+		block = end;
+	}
+}
+
+void
+cacheInvalidate (Disk * d, uint64_t offset, size_t len)
+{
+	uint64_t block, last;
+
+	if (!cacheEnabled || len == 0)
+		return;
+	__sync_fetch_and_add (&d->cacheGeneration, 1);
+	last = (offset + len - 1) / CACHE_BLOCKSIZE;
+	for (block = offset / CACHE_BLOCKSIZE; block <= last; block++)
+	{
+		uint64_t key = CACHE_KEY (d, block);
+		CacheShard *sh = cacheShard (key);
+		CacheSlot *slot;
+		pthread_mutex_lock (&sh->lock);
+		if ((slot = cacheFind (sh, key)) != NULL)
+			cacheUnlink (sh, slot);
+		pthread_mutex_unlock (&sh->lock);
+	}
+}
+
+void
+cacheCounters (uint64_t * hits, uint64_t * misses)
+{
+	int s;
+
+	*hits = *misses = 0;
+	if (!cacheEnabled)
+		return;
+	for (s = 0; s < CACHE_SHARDS; s++)
+	{
+		pthread_mutex_lock (&cacheShards[s].lock);
+		*hits += cacheShards[s].hits;
+		*misses += cacheShards[s].misses;
+		pthread_mutex_unlock (&cacheShards[s].lock);
+	}
+}
+
+void
+cacheReport (void)
+{
+	uint64_t hits, misses;
+
+	if (!cacheEnabled)
+		return;
+	cacheCounters (&hits, &misses);
+	vbprintf ("block cache: %llu hits, %llu misses (%.1f%% hit rate)",
+						(unsigned long long) hits, (unsigned long long) misses,
+						(hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+//====================================================================================================
+//                                           Sparse image map
+//====================================================================================================
+//
+// Dynamic VDI and VHD images only store the blocks that have been written.  sparseInit reads the
+// block map of every image in the chain (see vdimage.c) and folds them into sparseBits, one bit per
+// block of the disk that is set if reading the block can return anything but zeros.  A block is
+// taken from the topmost image that does not mark it free, as VD does, so a VDI zero block hides
+// whatever its parents hold.  Reads of clear blocks are answered with memset instead of going
+// through the block cache and VDRead, and writes set the bits they touch before the data goes to
+// the disk.  Sparse VMDK grain tables are read the same way.  If any image in the chain has no
+// block map (raw, fixed VHD, VMDK descriptor) every block counts as data and sparseBits stays
+// NULL.  Each image has its own map, with sparseShift the log2 of the bytes covered by each bit.
+
+static uint64_t sparseZeroBytes = 0;	// bytes of reads answered without touching the disk
+
+static inline int
+sparseTest (Disk * d, uint64_t blk)
+{
+	return (d->sparseBits[blk >> 6] >> (blk & 63)) & 1;
+}
+
+void
+sparseInit (Disk * d)
+{
+	VDImage img[DIFFERENCING_MAX + 1];
+	uint32_t granularity = UINT32_MAX;
+	uint64_t blk, nBlocks, data = 0;
+	int l, opened, mapped = 1;
+
+	for (opened = 0; opened < d->layerCount; opened++)
+	{
+		VDImage *m = img + opened;
+		if (vdImageOpen (m, d->layerFile[opened], 0) < 0)
+		{
+			mapped = 0;
+			break;
+		}
+		vbprintf ("%s is a %s image", d->layerFile[opened], vdImageKindName (m->kind));
+		if (!m->blockMap || (m->blockSize & (m->blockSize - 1)) != 0)
+			mapped = 0;
+		else if (m->blockSize < granularity)
+			granularity = m->blockSize;
+	}
+
+	if (mapped && d->layerCount > 0)
+	{
+		d->sparseShift = __builtin_ctz (granularity);
+		nBlocks = (d->size + granularity - 1) >> d->sparseShift;
+		if ((d->sparseBits = calloc ((nBlocks + 63) / 64, sizeof (uint64_t))) == NULL)
+			usageAndExit ("out of memory");
+		for (blk = 0; blk < nBlocks; blk++)
+		{
+			for (l = d->layerCount - 1; l >= 0; l--)
+			{
+				uint64_t lblk = (blk << d->sparseShift) / img[l].blockSize;
+				uint32_t e = (lblk < img[l].nBlocks) ? img[l].blockMap[lblk] : VDIMAGE_BLOCK_FREE;
+				if (e == VDIMAGE_BLOCK_FREE)
+					continue;
+				if (e != VDIMAGE_BLOCK_ZERO)
+				{
+					d->sparseBits[blk >> 6] |= 1ULL << (blk & 63);
+					data++;
+				}
+				break;
+			}
+		}
+		vbprintf ("sparse map: %llu of %llu blocks of %u KiB hold data",
+							(unsigned long long) data, (unsigned long long) nBlocks, granularity / 1024);
+	}
+	else
+		vbprintf ("sparse map disabled, every block is read from the image");
+
+	for (l = 0; l < opened; l++)
+		vdImageClose (img + l);
+}
+
+// Returns the end (capped at limit) of the run of blocks starting at offset that share the state
+// of the block holding offset, and that state in *isData
+static uint64_t
+sparseExtent (Disk * d, uint64_t offset, uint64_t limit, int *isData)
+{
+	uint64_t blk, end;
+
+	*isData = 1;
+	if (!d->sparseBits)
+		return limit;
+	blk = offset >> d->sparseShift;
+	*isData = sparseTest (d, blk);
+	for (blk++; (blk << d->sparseShift) < limit; blk++)
+	{
+		if ((blk & 63) == 0 && d->sparseBits[blk >> 6] == (*isData ? ~0ULL : 0ULL))
+		{
+			blk += 63;								// whole word has the same state
+			continue;
+		}
+		if (sparseTest (d, blk) != *isData)
+			break;
+	}
+	end = blk << d->sparseShift;
+	return (end < limit) ? end : limit;
+}
+
+int
+sparseRead (Disk * d, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t pos = offset, end = offset + len, next;
+	int isData, ret = 0;
+
+	while (pos < end && RT_SUCCESS (ret))
+	{
+		next = sparseExtent (d, pos, end, &isData);
+		if (isData)
+			ret = cacheRead (d, pos, buf + (pos - offset), next - pos);
+		else
+		{
+			memset (buf + (pos - offset), 0, next - pos);
+			__sync_fetch_and_add (&sparseZeroBytes, next - pos);
+		}
+		pos = next;
+	}
+	return ret;
+}
+
+void
+sparsePrefetch (Disk * d, uint64_t offset, uint64_t len)
+{
+	uint64_t pos = offset, end = offset + len, next;
+	int isData;
+
+	while (pos < end)
+	{
+		next = sparseExtent (d, pos, end, &isData);
+		if (isData)
+			cachePrefetch (d, pos, next - pos);
+		pos = next;
+	}
+}
+
+void
+sparseMarkData (Disk * d, uint64_t offset, size_t len)
+{
+	uint64_t blk, last;
+
+	if (!d->sparseBits || len == 0)
+		return;
+	last = (offset + len - 1) >> d->sparseShift;
+	for (blk = offset >> d->sparseShift; blk <= last; blk++)
+		if (!sparseTest (d, blk))
+			__sync_fetch_and_or (&d->sparseBits[blk >> 6], 1ULL << (blk & 63));
+}
+
+uint64_t
+sparseDataBytes (Disk * d, uint64_t offset, uint64_t len)
+{
+	uint64_t pos = offset, end = offset + len, next, bytes = 0;
+	int isData;
+
+	while (pos < end)
+	{
+		next = sparseExtent (d, pos, end, &isData);
+		if (isData)
+			bytes += next - pos;
+		pos = next;
+	}
+	return bytes;
+}
+
+//====================================================================================================
+//                                           Write-back buffer
+//====================================================================================================
+//
+// With -o writeback, VD_write copies into a table of dirty CACHE_BLOCKSIZE blocks instead of going to
+// the disk.  A block is filled from the disk the first time it is partly written, so every dirty
+// block is whole and a flush can write runs of adjacent dirty blocks with one DISKwrite each, in
+// disk order.  Flushes happen on a background thread every WRITEBACK_INTERVAL seconds, as soon as
+// half of the dirty limit (-o writeback_mb=N) is used, and on flush, fsync and destroy; a writer
+// that finds the limit reached flushes before buffering more.  Each image has its own table, but
+// the limit is on the dirty blocks of all images together, so a writer that is still over it once
+// its own image is written back flushes the others too.
+//
+// Reads look at the dirty table before the block cache.  An entry is only removed once its data
+// is on the disk and the block cache has been invalidated, so a read that misses the table always
+// finds the latest data below it.  A block written to again while its flush is in progress keeps
+// its entry (its seq moved on) and goes out with the next flush.  Flushes of an image are
+// serialised by its writebackFlushLock so that two of them can never write the same block out of
+// order.
+
+typedef struct WriteBlock
+{
+	uint64_t block;
+	uint64_t seq;									// bumped by every write to the block
+	struct WriteBlock *next;			// hash chain
+	char *data;
+} WriteBlock;
+
+static int writebackEnabled = 0;
+static volatile size_t writebackDirty = 0;	// dirty blocks of all images
+static size_t writebackLimit;		// most dirty blocks held before writers have to flush
+static pthread_mutex_t writebackWorkerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writebackCond = PTHREAD_COND_INITIALIZER;
+static pthread_t writebackThread;
+static int writebackThreadRunning = 0;
+static int writebackStopping = 0;
+
+void
+writebackInit (void)
+{
+	if (!writeback || readonly)
+		return;
+	writebackLimit = ((uint64_t) writebackMB << 20) / CACHE_BLOCKSIZE;
+	if (writebackLimit < WRITEBACK_MAXRUN)
+		writebackLimit = WRITEBACK_MAXRUN;
+	writebackEnabled = 1;
+	vbprintf ("write-back of up to %d MiB of dirty %d KiB blocks", writebackMB,
+						CACHE_BLOCKSIZE / 1024);
+}
+
+// Sets up the image's dirty table, which may come to hold every dirty block
+void
+writebackOpen (Disk * d)
+{
+	if (!writebackEnabled)
+		return;
+	for (d->writebackNBuckets = 1; d->writebackNBuckets < (int) writebackLimit;
+			 d->writebackNBuckets <<= 1)
+		;
+	if (!(d->writebackBuckets = calloc (d->writebackNBuckets, sizeof (WriteBlock *))))
+		usageAndExit ("cannot allocate the write-back table");
+}
+
+// Must be called with the image's writebackLock held
+static WriteBlock **
+writebackFind (Disk * d, uint64_t block)
+{
+	WriteBlock **link = d->writebackBuckets + (block & (d->writebackNBuckets - 1));
+	while (*link && (*link)->block != block)
+		link = &(*link)->next;
+	return link;
+}
+
+static int
+writebackCompare (const void *a, const void *b)
+{
+	uint64_t x = (*(WriteBlock * const *) a)->block, y = (*(WriteBlock * const *) b)->block;
+	return (x > y) - (x < y);
+}
+
+// Writes every block of the image that is dirty when called to the disk, returns 0 or -1 if any
+// write failed
+int
+writebackFlush (Disk * d)
+{
+	WriteBlock **dirty;
+	uint64_t seq[WRITEBACK_MAXRUN];
+	char *run = NULL;
+	size_t n = 0, i, j, k;
+	int ret = 0;
+
+	if (!writebackEnabled)
+		return 0;
+	pthread_mutex_lock (&d->writebackFlushLock);
+
+// Only the flusher frees entries, so the snapshot stays valid while the table lock is dropped
+	pthread_mutex_lock (&d->writebackLock);
+	dirty = malloc ((d->writebackCount + 1) * sizeof (WriteBlock *));
+	for (i = 0; dirty && i < (size_t) d->writebackNBuckets; i++)
+	{
+		WriteBlock *w;
+		for (w = d->writebackBuckets[i]; w; w = w->next)
+			dirty[n++] = w;
+	}
+	pthread_mutex_unlock (&d->writebackLock);
+	if (n)
+		run = malloc ((size_t) WRITEBACK_MAXRUN * CACHE_BLOCKSIZE);
+	if (!dirty || (n && !run))
+	{
+		free (dirty);
+		pthread_mutex_unlock (&d->writebackFlushLock);
+		return -1;
+	}
+	qsort (dirty, n, sizeof (WriteBlock *), writebackCompare);
+
+	for (i = 0; i < n; i = j)
+	{
+		size_t len = 0;
+		for (j = i + 1; j < n && j - i < WRITEBACK_MAXRUN
+				 && dirty[j]->block == dirty[j - 1]->block + 1; j++)
+			;
+		pthread_mutex_lock (&d->writebackLock);
+		for (k = i; k < j; k++)
+		{
+			size_t blen = cacheBlockLength (d, dirty[k]->block);
+			memcpy (run + len, dirty[k]->data, blen);
+			seq[k - i] = dirty[k]->seq;
+			len += blen;
+		}
+		pthread_mutex_unlock (&d->writebackLock);
+
+		uint64_t offset = dirty[i]->block * CACHE_BLOCKSIZE;
+		if (RT_FAILURE (DISKwrite (d, offset, run, len)))
+		{
+			ret = -1;
+			continue;
+		}
+		cacheInvalidate (d, offset, len);
+
+		pthread_mutex_lock (&d->writebackLock);
+		for (k = i; k < j; k++)
+		{
+			WriteBlock **link = writebackFind (d, dirty[k]->block);
+			if ((*link)->seq != seq[k - i])
+				continue;							// written again meanwhile
+			*link = dirty[k]->next;
+			d->writebackCount--;
+			__sync_fetch_and_sub (&writebackDirty, 1);
+			d->writebackRetired++;
+			free (dirty[k]->data);
+			free (dirty[k]);
+		}
+		pthread_mutex_unlock (&d->writebackLock);
+	}
+	free (run);
+	free (dirty);
+	if (ret < 0)
+		d->writebackError = 1;
+	pthread_mutex_unlock (&d->writebackFlushLock);
+	return ret;
+}
+
+// Writes back every open image that has dirty blocks, returns -1 if any of them failed
+int
+writebackFlushAll (void)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < diskCount; i++)
+		if (__atomic_load_n (&disks[i]->state, __ATOMIC_ACQUIRE) == DISK_OPEN
+				&& disks[i]->writebackCount > 0 && writebackFlush (disks[i]) < 0)
+			ret = -1;
+	return ret;
+}
+
+// Flushes and reports whether any flush, including background ones, failed since the last call
+int
+writebackSync (Disk * d)
+{
+	int ret = writebackFlush (d);
+	if (d->writebackError)
+	{
+		d->writebackError = 0;
+		ret = -1;
+	}
+	return ret;
+}
+
+// Buffers a write, returns 0 or a VBox status code if the block could not be filled from the disk
+int
+writebackWrite (Disk * d, uint64_t offset, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		uint64_t block = offset / CACHE_BLOCKSIZE;
+		size_t from = offset % CACHE_BLOCKSIZE;
+		size_t blen = cacheBlockLength (d, block);
+		size_t n = (len < blen - from) ? len : blen - from;
+		WriteBlock *w, *fresh = NULL;
+		int filled = 0;
+
+		pthread_mutex_lock (&d->writebackLock);
+		while (writebackDirty >= writebackLimit && *writebackFind (d, block) == NULL)
+		{
+			int stuck;
+			pthread_mutex_unlock (&d->writebackLock);
+			if (writebackFlush (d) < 0)
+				return VERR_GENERAL_FAILURE;	// the flush failed and the blocks are still dirty
+			stuck = (writebackDirty >= writebackLimit && writebackFlushAll () < 0);
+			pthread_mutex_lock (&d->writebackLock);
+			if (stuck)
+				break;									// rather go over the limit than wait for another image
+		}
+		while ((w = *writebackFind (d, block)) == NULL && !filled)
+		{
+// Fill a new block from below, outside the lock.  No entry means the disk is up to date, unless
+// another writer's entry for the block was retired while the fill was being read.
+			uint64_t retired = d->writebackRetired;
+			pthread_mutex_unlock (&d->writebackLock);
+			if (!fresh)
+			{
+				fresh = calloc (1, sizeof (WriteBlock));
+				if (!fresh || !(fresh->data = malloc (CACHE_BLOCKSIZE)))
+				{
+					free (fresh);
+					return VERR_NO_MEMORY;
+				}
+				fresh->block = block;
+			}
+			if (n < blen)
+			{
+				int ret = sparseRead (d, block * CACHE_BLOCKSIZE, fresh->data, blen);
+				if (RT_FAILURE (ret))
+				{
+					free (fresh->data);
+					free (fresh);
+					return ret;
+				}
+			}
+			pthread_mutex_lock (&d->writebackLock);
+			filled = (d->writebackRetired == retired);
+		}
+		if (!w)
+		{
+			w = fresh;
+			*writebackFind (d, block) = w;
+			fresh = NULL;
+			d->writebackCount++;
+			if (__sync_add_and_fetch (&writebackDirty, 1) >= writebackLimit / 2)
+			{
+				pthread_mutex_lock (&writebackWorkerLock);
+				pthread_cond_broadcast (&writebackCond);
+				pthread_mutex_unlock (&writebackWorkerLock);
+			}
+		}
+		memcpy (w->data + from, buf, n);
+		w->seq++;
+		pthread_mutex_unlock (&d->writebackLock);
+
+		if (fresh)										// another writer created the block first
+		{
+			free (fresh->data);
+			free (fresh);
+		}
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Reads through the dirty table, falling back to sparseRead for the ranges it does not hold
+int
+writebackRead (Disk * d, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t pending = offset;		// start of the range not yet read from below
+	uint64_t end = offset + len;
+	int ret = 0;
+
+	if (!writebackEnabled || d->writebackCount == 0)
+		return sparseRead (d, offset, buf, len);
+	while (offset < end)
+	{
+		uint64_t block = offset / CACHE_BLOCKSIZE;
+		size_t from = offset % CACHE_BLOCKSIZE;
+		size_t n = cacheBlockLength (d, block) - from;
+		WriteBlock *w;
+		if (n > end - offset)
+			n = end - offset;
+
+		pthread_mutex_lock (&d->writebackLock);
+		if ((w = *writebackFind (d, block)) != NULL)
+			memcpy (buf + (offset - (end - len)), w->data + from, n);
+		pthread_mutex_unlock (&d->writebackLock);
+
+		if (w)
+		{
+			if (pending < offset
+					&& RT_FAILURE (ret = sparseRead (d, pending, buf + (pending - (end - len)),
+																					 offset - pending)))
+				return ret;
+			pending = offset + n;
+		}
+		offset += n;
+	}
+	if (pending < end)
+		ret = sparseRead (d, pending, buf + (pending - (end - len)), end - pending);
+	return ret;
+}
+
+// Whether any of [offset, offset + len) is dirty, so must not be read from the image directly
+int
+writebackContains (Disk * d, uint64_t offset, size_t len)
+{
+	uint64_t block, last;
+	int found = 0;
+
+	if (!writebackEnabled || d->writebackCount == 0 || len == 0)
+		return 0;
+	pthread_mutex_lock (&d->writebackLock);
+	last = (offset + len - 1) / CACHE_BLOCKSIZE;
+	for (block = offset / CACHE_BLOCKSIZE; block <= last && !found; block++)
+		found = (*writebackFind (d, block) != NULL);
+	pthread_mutex_unlock (&d->writebackLock);
+	return found;
+}
+
+static void *
+writebackWorker (void *arg UNUSED)
+{
+	int failed = 0;								// after a failed flush, retry only once the interval is up
+
+	pthread_mutex_lock (&writebackWorkerLock);
+	while (!writebackStopping)
+	{
+		struct timespec until;
+		clock_gettime (CLOCK_REALTIME, &until);
+		until.tv_sec += WRITEBACK_INTERVAL;
+		while (!writebackStopping && (failed || writebackDirty < writebackLimit / 2)
+					 && pthread_cond_timedwait (&writebackCond, &writebackWorkerLock, &until) == 0)
+			;
+		if (writebackStopping || writebackDirty == 0)
+			continue;
+		pthread_mutex_unlock (&writebackWorkerLock);
+		failed = (writebackFlushAll () < 0);
+		pthread_mutex_lock (&writebackWorkerLock);
+	}
+	pthread_mutex_unlock (&writebackWorkerLock);
+	return NULL;
+}
+
+void
+writebackStart (void)
+{
+	if (writebackEnabled && pthread_create (&writebackThread, NULL, writebackWorker, NULL) == 0)
+		writebackThreadRunning = 1;
+}
+
+// Stops the background flusher and writes out whatever is still dirty
+void
+writebackStop (void)
+{
+	int i;
+
+	if (writebackThreadRunning)
+	{
+		pthread_mutex_lock (&writebackWorkerLock);
+		writebackStopping = 1;
+		pthread_cond_broadcast (&writebackCond);
+		pthread_mutex_unlock (&writebackWorkerLock);
+		pthread_join (writebackThread, NULL);
+		writebackThreadRunning = 0;
+	}
+	for (i = 0; i < diskCount; i++)
+		if (disks[i]->state == DISK_OPEN && writebackSync (disks[i]) < 0)
+			vlog (LOGLEVEL_ERROR, "%llu dirty blocks of %s could not be written back",
+						(unsigned long long) disks[i]->writebackCount, disks[i]->name);
+}
+
+//====================================================================================================
+//                                            Zero-copy reads
+//====================================================================================================
+//
+// When the image is a single raw, fixed VHD or preallocated VDI file, a disk range is just one or a
+// few ranges of that file.  VD_read then replies with fuse file descriptor buffers (FUSE_BUF_IS_FD)
+// instead of data, which fuse splices from the image file to /dev/fuse without copying it through
+// vdfuse, or the block cache.  Only allocated VDI blocks qualify; since blocks never move once
+// allocated, the map read at startup stays valid even while the mount is written to.  Everything
+// else (differencing chains, dynamic VHD, VMDK, unallocated VDI blocks) makes zeroCopyMap return
+// NULL, and VD_read copies the data through memory.  With -o odirect it is off too, as the splice
+// would read through the page cache.
+
+void
+zeroCopyInit (Disk * d)
+{
+	if (!zeroCopy || imageDirect || d->persist || d->layerCount != 1
+			|| vdImageOpen (&d->zeroCopyImage, d->layerFile[0], 0) < 0)
+		return;
+	switch (d->zeroCopyImage.kind)
+	{
+		case VDIMAGE_RAW:
+		case VDIMAGE_VHD_FIXED:
+		case VDIMAGE_VDI:
+			d->zeroCopyEnabled = 1;
+			vbprintf ("zero-copy reads enabled for %s image", vdImageKindName (d->zeroCopyImage.kind));
+			break;
+		default:
+			vdImageClose (&d->zeroCopyImage);
+	}
+}
+
+#if FUSE_VERSION >= 29
+// Returns a buffer vector mapping [offset, offset + len) of the disk onto the image file, or NULL
+static struct fuse_bufvec *
+zeroCopyMap (Disk * d, uint64_t offset, size_t len)
+{
+	VDImage *img = &d->zeroCopyImage;
+	struct fuse_bufvec *bv;
+	size_t k, count = 1;
+	uint64_t blk;
+
+	if (!d->zeroCopyEnabled || len == 0 || overlayHas (d, offset, len))
+		return NULL;
+	if (img->blockMap)
+	{
+		uint64_t last = (offset + len - 1) / img->blockSize;
+		for (blk = offset / img->blockSize; blk <= last; blk++)
+			if (blk >= img->nBlocks || img->blockMap[blk] >= VDIMAGE_BLOCK_ZERO)
+				return NULL;
+		count = last - offset / img->blockSize + 1;
+	}
+
+	bv = calloc (1, sizeof (struct fuse_bufvec) + (count - 1) * sizeof (struct fuse_buf));
+	if (!bv)
+		return NULL;
+	bv->count = count;
+	for (k = 0; k < count; k++)
+	{
+		struct fuse_buf *b = bv->buf + k;
+		uint32_t in = 0;
+		b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		b->fd = img->fd;
+		b->size = len;
+		b->pos = offset;
+		if (img->blockMap)
+		{
+			blk = offset / img->blockSize;
+			in = offset % img->blockSize;
+			b->size = (len < img->blockSize - in) ? len : img->blockSize - in;
+			b->pos = img->dataOffset + (uint64_t) img->blockMap[blk] * (img->blockSize + img->blockExtra)
+				+ img->blockExtra + in;
+		}
+		offset += b->size;
+		len -= b->size;
+	}
+	return bv;
+}
+#endif
+
+//====================================================================================================
+//                                         Sequential read-ahead
+//====================================================================================================
+//
+// Every open file carries a ReadAhead detector that watches the disk offsets VD_read is asked
+// for.  Once READAHEAD_TRIGGER reads in a row continue where the previous ones stopped, the
+// range beyond the furthest read is queued for the prefetch threads, which load it into the block
+// cache.  The window doubles each time the reader consumes half of what is queued, up to
+// readahead_kb, and collapses back to READAHEAD_MIN on the first non sequential read.  The kernel
+// issues readahead requests concurrently and not always in order, so a read landing within one
+// window of the expected offset still counts as sequential.  Offsets are absolute disk offsets and
+// prefetches never run past the end of the partition the file maps.
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	uint64_t next;								// disk offset just past the furthest read so far
+	uint64_t queued;							// disk offset up to which prefetches have been queued
+	uint64_t window;							// current prefetch window in bytes
+	int streak;										// number of consecutive sequential reads
+} ReadAhead;
+
+typedef struct
+{
+	Disk *disk;
+	uint64_t offset;
+	uint64_t len;
+} PrefetchRequest;
+
+static PrefetchRequest prefetchQueue[READAHEAD_QUEUE];
+static int prefetchHead = 0;
+static int prefetchCount = 0;
+static int prefetchStop = 0;
+static pthread_mutex_t prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchCond = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetchThread[READAHEAD_THREADS_MAX];
+static int prefetchThreadCount = 0;
+static uint64_t readaheadMax = 0;	// 0 while read-ahead is inactive
+
+static void *
+prefetchWorker (void *arg UNUSED)
+{
+	PrefetchRequest r;
+	for (;;)
+	{
+		pthread_mutex_lock (&prefetchLock);
+		while (prefetchCount == 0 && !prefetchStop)
+			pthread_cond_wait (&prefetchCond, &prefetchLock);
+		if (prefetchStop)
+		{
+			pthread_mutex_unlock (&prefetchLock);
+			return NULL;
+		}
+		r = prefetchQueue[prefetchHead];
+		prefetchHead = (prefetchHead + 1) % READAHEAD_QUEUE;
+		prefetchCount--;
+		pthread_mutex_unlock (&prefetchLock);
+
+		sparsePrefetch (r.disk, r.offset, r.len);
+	}
+}
+
+// Queues [offset, offset + len) in chunks so that the prefetch threads can load a large window in
+// parallel.  Read-ahead is only a hint, so requests that do not fit in the queue are dropped.
+static void
+prefetchEnqueue (Disk * d, uint64_t offset, uint64_t len)
+{
+	const uint64_t chunk = CACHE_MAXRUN * CACHE_BLOCKSIZE;
+
+	pthread_mutex_lock (&prefetchLock);
+	while (len > 0 && prefetchCount < READAHEAD_QUEUE)
+	{
+		PrefetchRequest *r = prefetchQueue + (prefetchHead + prefetchCount) % READAHEAD_QUEUE;
+		r->disk = d;
+		r->offset = offset;
+		r->len = (len < chunk) ? len : chunk;
+		offset += r->len;
+		len -= r->len;
+		prefetchCount++;
+	}
+	pthread_cond_broadcast (&prefetchCond);
+	pthread_mutex_unlock (&prefetchLock);
+}
+
+// Called from VD_init since the prefetch threads must be created after fuse has daemonised
+void
+readaheadStart (void)
+{
+	uint64_t cacheBytes = (uint64_t) cacheMB << 20;
+	int t;
+
+	if (!cacheEnabled || readaheadKB == 0)
+		return;
+	readaheadMax = (uint64_t) readaheadKB * 1024;
+	if (readaheadMax > cacheBytes / 4)	// leave room in the cache for what is being read
+		readaheadMax = cacheBytes / 4;
+	if (readaheadMax < READAHEAD_MIN)
+		readaheadMax = READAHEAD_MIN;
+
+	for (t = 0; t < readaheadThreads; t++)
+	{
+		if (pthread_create (&prefetchThread[t], NULL, prefetchWorker, NULL) != 0)
+			break;
+		prefetchThreadCount++;
+	}
+	if (prefetchThreadCount == 0)
+		readaheadMax = 0;
+	vbprintf ("read-ahead up to %llu KiB with %d thread(s)",
+						(unsigned long long) readaheadMax / 1024, prefetchThreadCount);
+}
+
+void
+readaheadStop (void)
+{
+	int t;
+	pthread_mutex_lock (&prefetchLock);
+	prefetchStop = 1;
+	readaheadMax = 0;
+	pthread_cond_broadcast (&prefetchCond);
+	pthread_mutex_unlock (&prefetchLock);
+	for (t = 0; t < prefetchThreadCount; t++)
+		pthread_join (prefetchThread[t], NULL);
+	prefetchThreadCount = 0;
+}
+
+static ReadAhead *
+readaheadNew (void)
+{
+	ReadAhead *ra = calloc (1, sizeof (ReadAhead));
+	if (ra)
+	{
+		pthread_mutex_init (&ra->lock, NULL);
+		ra->window = READAHEAD_MIN;
+	}
+	return ra;
+}
+
+static void
+readaheadFree (ReadAhead * ra)
+{
+	if (ra)
+	{
+		pthread_mutex_destroy (&ra->lock);
+		free (ra);
+	}
+}
+
+// Records a read of [start, start + len) of the image and queues the next window if the file is
+// being streamed.  limit is the end of the partition being read.
+static void
+readaheadObserve (ReadAhead * ra, Disk * d, uint64_t start, size_t len, uint64_t limit)
+{
+	uint64_t from = 0, to = 0;
+
+	if (!ra || readaheadMax == 0)
+		return;
+	pthread_mutex_lock (&ra->lock);
+	if (start + ra->window >= ra->next && start <= ra->next + ra->window)
+		ra->streak++;
+	else
+	{
+		ra->streak = 0;
+		ra->window = READAHEAD_MIN;
+		ra->queued = 0;
+	}
+	if (start + len > ra->next)
+		ra->next = start + len;
+
+	if (ra->streak >= READAHEAD_TRIGGER)
+	{
+		if (ra->queued < ra->next)
+			ra->queued = ra->next;
+		if (ra->queued < limit && ra->queued - ra->next < ra->window / 2)
+		{
+			from = ra->queued;
+			to = (from + ra->window < limit) ? from + ra->window : limit;
+			ra->queued = to;
+			if (ra->window < readaheadMax)
+				ra->window = (ra->window * 2 < readaheadMax) ? ra->window * 2 : readaheadMax;
+		}
+	}
+	pthread_mutex_unlock (&ra->lock);
+
+	if (to > from)
+		prefetchEnqueue (d, from, to - from);
+}
+
+//====================================================================================================
+//                                              Open files
+//====================================================================================================
+//
+// VD_open resolves the inode once into an OpenFile kept in fi->fh, so reads and writes go straight
+// to the partition's extent and carry their own read-ahead state and counters.  The entry is a copy
+// tagged with the table version it came from; once a re-read publishes a new version, requests
+// take the entry from the current table instead.
+//
+// Files of one image exclude each other by the bytes they cover: a file cannot be opened for
+// writing while a different file overlapping it is open, nor opened at all while an overlapping
+// different file is open for writing.  EntireDisk and the partitions can therefore be read side by
+// side, and separate partitions written side by side.  Opening the same file several times is
+// always allowed, as the kernel keeps a single page cache for it.
+
+typedef struct OpenFile
+{
+	Disk *disk;
+	int n;												// partition table index, 0 for EntireDisk
+	int writable;
+	uint64_t version;							// version of the table part was copied from
+	Partition part;
+	ReadAhead *readahead;
+	uint64_t reads;								// this open's share of the counters in /.stats
+	uint64_t readBytes;
+	uint64_t writes;
+	uint64_t writeBytes;
+	struct OpenFile *next;				// the image's other open files, guarded by its partLock
+} OpenFile;
+
+// Returns the partition the file maps as of the current table, or NULL if it has gone.  The result
+// stays valid until the end of the request.
+static const Partition *
+openFilePartition (OpenFile * f)
+{
+	const PartitionTable *t = partitionsCurrent (f->disk);
+
+	if (t->version == f->version)
+		return &f->part;
+	if (f->n > t->last || t->p[f->n].no == UNALLOCATED)
+		return NULL;
+	return t->p + f->n;
+}
+
+// Returns whether file n, about to be opened, overlaps a different open file and either of them
+// writes.  Called with partLock held.
+static int
+openFileConflict (Disk * d, int n, const Partition * p, int writable)
+{
+	OpenFile *f;
+
+	for (f = d->openFiles; f; f = f->next)
+	{
+		const Partition *q = openFilePartition (f);
+		if (f->n == n || !q || !(writable || f->writable))
+			continue;
+		if ((uint64_t) p->offset < q->offset + q->size && (uint64_t) q->offset < p->offset + p->size)
+			return 1;
+	}
+	return 0;
+}
+
+// Opens partition n of d, returning NULL with errno set if it has gone, conflicts or memory runs out
+static OpenFile *
+openFileNew (Disk * d, int n, int writable)
+{
+	OpenFile *f;
+	const PartitionTable *t;
+
+	pthread_mutex_lock (&d->partLock);
+// Tables are only replaced under partLock, so t stays current until the file is on the list
+	t = partitionsCurrent (d);
+	if (n > t->last || t->p[n].no == UNALLOCATED)
+		errno = ENOENT;
+	else if (openFileConflict (d, n, t->p + n, writable))
+		errno = EBUSY;
+	else if ((f = calloc (1, sizeof (OpenFile))) == NULL)
+		errno = ENOMEM;
+	else
+	{
+		f->disk = d;
+		f->n = n;
+		f->writable = writable;
+		f->version = t->version;
+		f->part = t->p[n];
+		f->readahead = readaheadNew ();
+		f->next = d->openFiles;
+		d->openFiles = f;
+		d->opened++;
+		pthread_mutex_unlock (&d->partLock);
+		return f;
+	}
+	pthread_mutex_unlock (&d->partLock);
+	return NULL;
+}
+
+// Closes f, re-reading the partition table once the image's last file is closed if it was written
+static void
+openFileFree (OpenFile * f)
+{
+	Disk *d = f->disk;
+	OpenFile **l;
+
+	pthread_mutex_lock (&d->partLock);
+	for (l = &d->openFiles; *l != f; l = &(*l)->next)
+		;
+	*l = f->next;
+	d->opened--;
+	if (d->opened == 0 && d->partitionsStale)
+		partitionsUpdate (d);
+	pthread_mutex_unlock (&d->partLock);
+
+	vlog (LOGLEVEL_DEBUG, "release: %s read %llu bytes in %llu reads, wrote %llu bytes in %llu writes",
+				f->part.name, (unsigned long long) f->readBytes, (unsigned long long) f->reads,
+				(unsigned long long) f->writeBytes, (unsigned long long) f->writes);
+	readaheadFree (f->readahead);
+	free (f);
+}
+
+// Reads [offset, offset + len) of f, which maps partition p and has already been clipped to it
+static int
+openFileRead (OpenFile * f, const Partition * p, uint64_t offset, char *buf, size_t len)
+{
+	Disk *d = f->disk;
+	int ret;
+
+	readaheadObserve (f->readahead, d, offset + p->offset, len, p->offset + p->size);
+	ret = writebackRead (d, offset + p->offset, buf, len);
+	__atomic_fetch_add (&f->reads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&f->readBytes, RT_SUCCESS (ret) ? len : 0, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static int
+openFileWrite (OpenFile * f, const Partition * p, uint64_t offset, const char *in, size_t len)
+{
+	Disk *d = f->disk;
+	int ret;
+
+	sparseMarkData (d, offset + p->offset, len);
+	if (writebackEnabled)
+		ret = writebackWrite (d, offset + p->offset, in, len);
+	else
+	{
+		ret = DISKwrite (d, offset + p->offset, in, len);
+		cacheInvalidate (d, offset + p->offset, len);
+	}
+
+// Only writes to the bytes the partition table was read from lead to it being read again
+	if (RT_SUCCESS (ret) && !d->partitionsStale
+			&& partitionsWritten (partitionsCurrent (d), offset + p->offset, len))
+		__atomic_store_n (&d->partitionsStale, 1, __ATOMIC_SEQ_CST);
+
+	__atomic_fetch_add (&f->writes, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&f->writeBytes, RT_SUCCESS (ret) ? len : 0, __ATOMIC_RELAXED);
+	return ret;
+}
+
+//====================================================================================================
+//                                          Performance counters
+//====================================================================================================
+//
+// Every request and backend call is counted (operations, bytes, errors and total time) along with a
+// histogram of its latency in power of two nanosecond buckets: bucket k counts the operations that
+// took from 2^k up to 2^(k+1) ns.  lock_wait counts disk handle acquisitions and how long each
+// waited.  Each thread adds to one of STATS_SHARDS cache line aligned copies of the counters, handed
+// out round robin, and the copies are only summed when /.stats is opened.  -o stats=0 turns the
+// counting and the file off.
+
+typedef struct
+{
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t ns;
+	uint64_t hist[STATS_BUCKETS];
+} StatCounter;
+
+typedef struct
+{
+	StatCounter op[STAT_COUNT];
+} __attribute__ ((aligned (64))) StatShard;
+
+typedef struct
+{
+	char *text;
+	size_t len;
+	size_t size;
+} StatsText;
+
+static const char *statNames[STAT_COUNT] = {
+	"read", "write", "flush", "fsync", "backend_read", "backend_write", "lock_wait"
+};
+
+static StatShard statShards[STATS_SHARDS];
+
+uint64_t
+clockNs (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Like clockNs, but free when neither the counters nor the trace need the time
+uint64_t
+statNow (void)
+{
+	if (!statsEnabled && !traceFile)
+		return 0;
+	return clockNs ();
+}
+
+void
+statRecordNs (StatOp op, uint64_t ns, uint64_t bytes, int failed)
+{
+	static unsigned nextShard = 0;
+	static __thread StatShard *shard = NULL;
+	StatCounter *c;
+	int b;
+
+	if (!statsEnabled)
+		return;
+	if (!shard)
+		shard = statShards + __sync_fetch_and_add (&nextShard, 1) % STATS_SHARDS;
+	c = &shard->op[op];
+	b = ns ? 63 - __builtin_clzll (ns) : 0;
+	if (b >= STATS_BUCKETS)
+		b = STATS_BUCKETS - 1;
+	__atomic_fetch_add (&c->ops, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&c->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&c->ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&c->hist[b], 1, __ATOMIC_RELAXED);
+	if (failed)
+		__atomic_fetch_add (&c->errors, 1, __ATOMIC_RELAXED);
+}
+
+// Records an operation that started at statNow () time start
+void
+statRecord (StatOp op, uint64_t start, uint64_t bytes, int failed)
+{
+	if (statsEnabled)
+		statRecordNs (op, statNow () - start, bytes, failed);
+}
+
+static void
+statsPrintf (StatsText * t, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;)
+	{
+		va_start (ap, format);
+		n = vsnprintf (t->text + t->len, t->size - t->len, format, ap);
+		va_end (ap);
+		if (n < 0)
+			return;
+		if (t->len + n < t->size)
+			break;
+		char *grown = realloc (t->text, t->size * 2 + n);
+		if (!grown)
+			return;
+		t->text = grown;
+		t->size = t->size * 2 + n;
+	}
+	t->len += n;
+}
+
+// Returns a snapshot of all counters as "name value" lines, which the caller frees
+char *
+statsReport (size_t *len)
+{
+	StatsText t = { malloc (4096), 0, 4096 };
+	uint64_t hits, misses, dropped, limited, traced, traceDropped;
+	int op, s, b, i, openImages = 0;
+	uint64_t overlayBytes = 0, persistHits = 0, persistMisses = 0;
+
+	if (!t.text)
+		return NULL;
+	t.text[0] = '\0';
+	statsPrintf (&t, "# vdfuse statistics, one \"name value\" pair per line; name.latency_ns.N\n"
+							 "# counts operations taking N up to 2N nanoseconds\n");
+	for (op = 0; op < STAT_COUNT; op++)
+	{
+		StatCounter sum;
+		memset (&sum, 0, sizeof (sum));
+		for (s = 0; s < STATS_SHARDS; s++)
+		{
+			StatCounter *c = &statShards[s].op[op];
+			sum.ops += __atomic_load_n (&c->ops, __ATOMIC_RELAXED);
+			sum.bytes += __atomic_load_n (&c->bytes, __ATOMIC_RELAXED);
+			sum.errors += __atomic_load_n (&c->errors, __ATOMIC_RELAXED);
+			sum.ns += __atomic_load_n (&c->ns, __ATOMIC_RELAXED);
+			for (b = 0; b < STATS_BUCKETS; b++)
+				sum.hist[b] += __atomic_load_n (&c->hist[b], __ATOMIC_RELAXED);
+		}
+		statsPrintf (&t, "%s.ops %llu\n%s.bytes %llu\n%s.errors %llu\n%s.time_ns %llu\n",
+								 statNames[op], (unsigned long long) sum.ops,
+								 statNames[op], (unsigned long long) sum.bytes,
+								 statNames[op], (unsigned long long) sum.errors,
+								 statNames[op], (unsigned long long) sum.ns);
+		for (b = 0; b < STATS_BUCKETS; b++)
+			if (sum.hist[b])
+				statsPrintf (&t, "%s.latency_ns.%llu %llu\n", statNames[op],
+										 1ULL << b, (unsigned long long) sum.hist[b]);
+	}
+	cacheCounters (&hits, &misses);
+	statsPrintf (&t, "cache.hits %llu\ncache.misses %llu\n", (unsigned long long) hits,
+							 (unsigned long long) misses);
+	statsPrintf (&t, "sparse.zero_bytes %llu\n", (unsigned long long) sparseZeroBytes);
+	statsPrintf (&t, "writeback.dirty_bytes %llu\n",
+							 (unsigned long long) writebackDirty * CACHE_BLOCKSIZE);
+	for (i = 0; i < diskCount; i++)
+	{
+		if (__atomic_load_n (&disks[i]->state, __ATOMIC_ACQUIRE) != DISK_OPEN)
+			continue;
+		openImages++;
+		overlayBytes += disks[i]->overlayBlocks * OVERLAY_BLOCK;
+		if (disks[i]->persist)
+		{
+			persistHits += disks[i]->persist->hits;
+			persistMisses += disks[i]->persist->misses;
+		}
+	}
+	statsPrintf (&t, "images.count %d\nimages.open %d\n", diskCount, openImages);
+	statsPrintf (&t, "overlay.bytes %llu\n", (unsigned long long) overlayBytes);
+	statsPrintf (&t, "persist.hits %llu\npersist.misses %llu\n", (unsigned long long) persistHits,
+							 (unsigned long long) persistMisses);
+	logCounters (&dropped, &limited, &traced, &traceDropped);
+	statsPrintf (&t, "log.dropped %llu\nlog.rate_limited %llu\ntrace.records %llu\ntrace.dropped %llu\n",
+							 (unsigned long long) dropped, (unsigned long long) limited,
+							 (unsigned long long) traced, (unsigned long long) traceDropped);
+	*len = t.len;
+	return t.text;
+}
+
+//====================================================================================================
+//                                       Export and hashing
+//====================================================================================================
+//
+// -x NAME copies EntireDisk or a PartitionN out of the image without mounting it, and -H sha256
+// hashes it, or both at once.  The file is cut into EXPORT_CHUNK chunks that -o threads=N workers
+// read in parallel through the disk handle pool, skipping the holes the sparse image map knows of.
+// The block cache is bypassed as every byte is read once.  Chunks pass through a ring of
+// EXPORT_SLOTS_PER_THREAD slots per worker so that the main thread can hash them in order and
+// report progress, while workers run ahead by up to the size of the ring.  A regular output file
+// is written sparsely: it is sized with ftruncate and runs of EXPORT_SPARSE_BLOCK zero bytes are
+// never written.  Anything else, such as a block device, is written in full.
+
+#define EXPORT_CHUNK (1024 * 1024)
+#define EXPORT_SLOTS_PER_THREAD 2
+#define EXPORT_SPARSE_BLOCK 4096
+
+typedef struct
+{
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char block[64];
+} Sha256;
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256Block (Sha256 * s, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8
+			| p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + (ROTR (w[i - 15], 7) ^ ROTR (w[i - 15], 18) ^ (w[i - 15] >> 3))
+			+ w[i - 7] + (ROTR (w[i - 2], 17) ^ ROTR (w[i - 2], 19) ^ (w[i - 2] >> 10));
+	a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+	e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+	for (i = 0; i < 64; i++)
+	{
+		t1 = h + (ROTR (e, 6) ^ ROTR (e, 11) ^ ROTR (e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+		t2 = (ROTR (a, 2) ^ ROTR (a, 13) ^ ROTR (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g, g = f, f = e, e = d + t1;
+		d = c, c = b, b = a, a = t1 + t2;
+	}
+	s->h[0] += a, s->h[1] += b, s->h[2] += c, s->h[3] += d;
+	s->h[4] += e, s->h[5] += f, s->h[6] += g, s->h[7] += h;
+}
+
+static void
+sha256Init (Sha256 * s)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy (s->h, h0, sizeof (h0));
+	s->len = 0;
+}
+
+static void
+sha256Update (Sha256 * s, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t used = s->len % 64;
+
+	s->len += len;
+	if (used)
+	{
+		size_t n = (len < 64 - used) ? len : 64 - used;
+		memcpy (s->block + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256Block (s, s->block);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256Block (s, p);
+	memcpy (s->block, p, len);
+}
+
+// Writes the digest as 64 hex digits and a terminating 0
+static void
+sha256Final (Sha256 * s, char *hex)
+{
+	uint64_t bits = s->len * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t padLen = ((s->len % 64) < 56) ? 56 - s->len % 64 : 120 - s->len % 64;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		pad[padLen + i] = (unsigned char) (bits >> (56 - 8 * i));
+	sha256Update (s, pad, padLen + 8);
+	for (i = 0; i < 32; i++)
+		sprintf (hex + 2 * i, "%02x", (s->h[i / 4] >> (24 - 8 * (i % 4))) & 0xff);
+}
+
+typedef struct
+{
+	Disk *disk;
+	uint64_t start;								// disk offset of the file exported
+	uint64_t size;
+	int fd;												// output, or -1 if only hashing
+	int sparse;										// the output is a regular file that starts out empty
+	uint64_t nChunks;
+	uint64_t claimed;							// chunks handed to workers so far
+	uint64_t consumed;						// chunks the main thread is done with
+	int nSlots;
+	char **slot;									// chunk k is read into slot[k % nSlots]
+	int *ready;
+	int failed;
+	uint64_t dataBytes;						// bytes read from the image rather than known holes
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Export;
+
+static int
+exportIsZero (const char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp (buf, buf + 1, len - 1) == 0;
+}
+
+// Writes the non zero blocks of buf to the output at offset, or all of it if the output is not sparse
+static int
+exportWrite (Export * x, const char *buf, size_t len, uint64_t offset)
+{
+	size_t pos = 0, end, n = 0;
+	ssize_t w;
+
+	while (pos < len)
+	{
+		for (end = pos; end < len; end += n)
+		{
+			n = (len - end < EXPORT_SPARSE_BLOCK) ? len - end : EXPORT_SPARSE_BLOCK;
+			if (x->sparse && exportIsZero (buf + end, n))
+				break;
+		}
+		for (; pos < end; pos += w)
+			if ((w = pwrite (x->fd, buf + pos, end - pos, offset + pos)) <= 0)
+				return -1;
+		if (end < len)
+			pos = end + n;							// leave the zero block a hole
+	}
+	return 0;
+}
+
+static void *
+exportWorker (void *arg)
+{
+	Export *x = arg;
+	uint64_t k;
+
+	for (;;)
+	{
+		pthread_mutex_lock (&x->lock);
+// Wait while the next chunk's slot still holds the chunk nSlots before it
+		while (!x->failed && (k = x->claimed) < x->nChunks && k >= x->consumed + x->nSlots)
+			pthread_cond_wait (&x->cond, &x->lock);
+		if (x->failed || k >= x->nChunks)
+		{
+			pthread_mutex_unlock (&x->lock);
+			return NULL;
+		}
+		x->claimed++;
+		pthread_mutex_unlock (&x->lock);
+
+		char *buf = x->slot[k % x->nSlots];
+		uint64_t offset = k * EXPORT_CHUNK;
+		uint64_t len = (x->size - offset < EXPORT_CHUNK) ? x->size - offset : EXPORT_CHUNK;
+		uint64_t pos, next, data = 0;
+		int isData, ret = 0;
+
+		for (pos = x->start + offset; pos < x->start + offset + len && RT_SUCCESS (ret); pos = next)
+		{
+			next = sparseExtent (x->disk, pos, x->start + offset + len, &isData);
+			if (!isData)
+				memset (buf + (pos - x->start - offset), 0, next - pos);
+			else
+			{
+				ret = DISKread (x->disk, pos, buf + (pos - x->start - offset), next - pos);
+				data += next - pos;
+			}
+		}
+		if (RT_FAILURE (ret))
+			vlog (LOGLEVEL_ERROR, "cannot read %llu bytes at %llu of the image",
+						(unsigned long long) len, (unsigned long long) (x->start + offset));
+		else if (x->fd >= 0 && exportWrite (x, buf, len, offset) < 0)
+		{
+			vlog (LOGLEVEL_ERROR, "cannot write the output: %s", strerror (errno));
+			ret = VERR_GENERAL_FAILURE;
+		}
+
+		pthread_mutex_lock (&x->lock);
+		x->dataBytes += data;
+		if (RT_FAILURE (ret))
+			x->failed = 1;
+		x->ready[k % x->nSlots] = 1;
+		pthread_cond_broadcast (&x->cond);
+		pthread_mutex_unlock (&x->lock);
+	}
+}
+
+// Exports file name of d to output and/or hashes it with hash, see above.  Returns the exit status.
+int
+exportFile (Disk * d, const char *name, const char *output, const char *hash)
+{
+	Export x;
+	Sha256 sha;
+	pthread_t thread[WORKER_THREADS_MAX];
+	const PartitionTable *t;
+	char hex[65];
+	struct stat st;
+	uint64_t started = clockNs (), lastReport = started, k;
+	int threads = workerThreads, n, i;
+	int progress = isatty (STDERR_FILENO);
+
+	if (readers == 0 && !DISK_THREADSAFE)
+		readers = (workerThreads < DISKHANDLE_MAX) ? workerThreads : DISKHANDLE_MAX;
+	if (diskPartitions (d) < 0)
+		usageAndExit ("cannot read the partition table of %s", d->layerFile[0]);
+	t = partitionsCurrent (d);
+	if ((n = findPartition (t, name)) < 0)
+		usageAndExit ("%s has no file called %s", d->layerFile[0], name);
+
+	memset (&x, 0, sizeof (x));
+	x.disk = d;
+	x.start = t->p[n].offset;
+	x.size = t->p[n].size;
+	x.fd = -1;
+	if (output)
+	{
+		if ((x.fd = open (output, O_WRONLY | O_CREAT, 0644)) < 0 || fstat (x.fd, &st) < 0)
+			usageAndExit ("cannot create %s: %s", output, strerror (errno));
+		x.sparse = S_ISREG (st.st_mode);
+		if (x.sparse && (ftruncate (x.fd, 0) < 0 || ftruncate (x.fd, x.size) < 0))
+			usageAndExit ("cannot size %s: %s", output, strerror (errno));
+	}
+	x.nChunks = (x.size + EXPORT_CHUNK - 1) / EXPORT_CHUNK;
+	if ((uint64_t) threads > x.nChunks)
+		threads = (x.nChunks > 0) ? (int) x.nChunks : 1;
+	x.nSlots = threads * EXPORT_SLOTS_PER_THREAD;
+	x.slot = calloc (x.nSlots, sizeof (char *));
+	x.ready = calloc (x.nSlots, sizeof (int));
+	for (i = 0; x.slot && i < x.nSlots; i++)
+		if ((x.slot[i] = malloc (EXPORT_CHUNK)) == NULL)
+			break;
+	if (!x.slot || !x.ready || i < x.nSlots)
+		usageAndExit ("not enough memory for %d chunks of %d KiB", x.nSlots, EXPORT_CHUNK / 1024);
+	pthread_mutex_init (&x.lock, NULL);
+	pthread_cond_init (&x.cond, NULL);
+	sha256Init (&sha);
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create (&thread[i], NULL, exportWorker, &x) != 0)
+			break;
+	threads = i;
+	if (threads == 0)
+		usageAndExit ("cannot start the export threads");
+	vbprintf ("exporting %s: %llu bytes at %llu with %d thread(s) over %d disk handle(s)", name,
+						(unsigned long long) x.size, (unsigned long long) x.start, threads, d->handleCount);
+
+// Take the chunks in order, hashing each before its slot is handed back to the workers
+	for (k = 0; k < x.nChunks; k++)
+	{
+		uint64_t len = (x.size - k * EXPORT_CHUNK < EXPORT_CHUNK) ? x.size - k * EXPORT_CHUNK : EXPORT_CHUNK;
+		pthread_mutex_lock (&x.lock);
+		while (!x.failed && !x.ready[k % x.nSlots])
+			pthread_cond_wait (&x.cond, &x.lock);
+		pthread_mutex_unlock (&x.lock);
+		if (x.failed)
+			break;
+		if (hash)
+			sha256Update (&sha, x.slot[k % x.nSlots], len);
+		pthread_mutex_lock (&x.lock);
+		x.ready[k % x.nSlots] = 0;
+		x.consumed++;
+		pthread_cond_broadcast (&x.cond);
+		pthread_mutex_unlock (&x.lock);
+
+		uint64_t now = clockNs ();
+		if (progress && now - lastReport >= 1000000000ULL)
+		{
+			uint64_t done = k * EXPORT_CHUNK + len;
+			fprintf (stderr, "\r%s: %3d%% %llu of %llu MiB, %.1f MiB/s ", name,
+							 (int) (done * 100 / x.size), (unsigned long long) (done >> 20),
+							 (unsigned long long) (x.size >> 20), done / 1048576.0 / ((now - started) / 1e9));
+			lastReport = now;
+		}
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join (thread[i], NULL);
+
+	if (x.fd >= 0 && !x.failed && (fsync (x.fd) < 0 && errno != EINVAL))
+	{
+		vlog (LOGLEVEL_ERROR, "cannot write %s: %s", output, strerror (errno));
+		x.failed = 1;
+	}
+	if (x.fd >= 0 && close (x.fd) < 0)
+		x.failed = 1;
+	if (progress && lastReport != started)
+		fputc ('\n', stderr);
+	if (!x.failed)
+	{
+		double seconds = (clockNs () - started) / 1e9;
+		fprintf (stderr, "%s: %llu MiB, %llu MiB of it data, in %.1f s, %.1f MiB/s\n", name,
+						 (unsigned long long) (x.size >> 20), (unsigned long long) (x.dataBytes >> 20), seconds,
+						 (seconds > 0) ? x.size / 1048576.0 / seconds : 0);
+		if (hash)
+		{
+			sha256Final (&sha, hex);
+			printf ("%s  %s\n", hex, name);
+		}
+	}
+
+	for (i = 0; i < x.nSlots; i++)
+		free (x.slot[i]);
+	free (x.slot);
+	free (x.ready);
+	persistClose (d);
+	DISKclose (d);
+	return x.failed ? 1 : 0;
+}
+
+//====================================================================================================
+//                                              NBD server
+//====================================================================================================
+//
+// With -n SOCKET vdfuse serves the image over the NBD protocol on a unix socket instead of mounting
+// it, so that e.g. "nbd-client -unix SOCKET /dev/nbd0 -N Partition2" gives a block device without
+// fuse and a loop device in between.  EntireDisk and every PartitionN are exports under their file
+// names, EntireDisk also under the empty name.  Only the fixed newstyle handshake is spoken, with
+// NBD_OPT_EXPORT_NAME, NBD_OPT_INFO/GO, NBD_OPT_LIST and NBD_OPT_ABORT, and simple replies.
+//
+// Each connection is an OpenFile of its export, so connections exclude each other as open files do
+// and requests go through the same read-ahead, block cache, write-back and overlay layers as fuse
+// reads and writes.  A thread per connection reads requests, up to NBD_INFLIGHT of them ahead, and
+// queues them for -o threads workers, which reply as they finish, so replies may come out of order
+// as the protocol allows.  FLUSH and FUA write back the whole image, which is what makes several
+// connections to one export safe (NBD_FLAG_CAN_MULTI_CONN).  TRIM is accepted and ignored, as no
+// image format here can give a block back; WRITE_ZEROES writes zeros.
+
+#define NBD_MAGIC 0x4e42444d41474943ULL	// "NBDMAGIC"
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL	// "IHAVEOPT"
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+#define NBD_FLAG_FIXED_NEWSTYLE 1
+#define NBD_FLAG_NO_ZEROES 2
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_POLICY 0x80000002
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+#define NBD_INFO_EXPORT 0
+#define NBD_FLAG_HAS_FLAGS 1
+#define NBD_FLAG_READ_ONLY 2
+#define NBD_FLAG_SEND_FLUSH 4
+#define NBD_FLAG_SEND_FUA 8
+#define NBD_FLAG_SEND_TRIM 32
+#define NBD_FLAG_SEND_WRITE_ZEROES 64
+#define NBD_FLAG_CAN_MULTI_CONN 256
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+#define NBD_CMD_WRITE_ZEROES 6
+#define NBD_CMD_FLAG_FUA 1
+#define NBD_OPTION_MAX 4096					// longest option data accepted during the handshake
+#define NBD_REQUEST_MAX (32 * 1024 * 1024)	// largest read or write
+#define NBD_ZEROES_CHUNK (1024 * 1024)	// bytes written at a time for WRITE_ZEROES
+#define NBD_INFLIGHT 64							// requests a connection may have queued or running
+
+typedef struct NbdConn
+{
+	int fd;
+	Disk *disk;
+	OpenFile *file;
+	int refs;											// the reading thread and each queued request
+	int inFlight;
+	pthread_mutex_t sendLock;			// keeps the replies whole
+	struct NbdConn *next;					// on nbdConns
+} NbdConn;
+
+typedef struct NbdRequest
+{
+	NbdConn *conn;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t len;
+	char *data;										// what to write
+	struct NbdRequest *next;
+} NbdRequest;
+
+// nbdLock guards the queue, the connection list and every connection's refs and inFlight
+static pthread_mutex_t nbdLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nbdWork = PTHREAD_COND_INITIALIZER;	// a request was queued, or stopping
+static pthread_cond_t nbdSpace = PTHREAD_COND_INITIALIZER;	// a request finished
+static pthread_cond_t nbdIdle = PTHREAD_COND_INITIALIZER;	// a connection went away
+static NbdRequest *nbdHead = NULL, *nbdTail = NULL;
+static NbdConn *nbdConns = NULL;
+static int nbdStopping = 0;
+static int nbdSignalPipe[2] = { -1, -1 };
+
+static uint64_t
+nbdGet64 (const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static uint32_t
+nbdGet32 (const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static unsigned char *
+nbdPut64 (unsigned char *p, uint64_t v)
+{
+	int i;
+	for (i = 0; i < 8; i++)
+		p[i] = (unsigned char) (v >> (56 - 8 * i));
+	return p + 8;
+}
+
+static unsigned char *
+nbdPut32 (unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static unsigned char *
+nbdPut16 (unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static int
+nbdRecv (int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		if ((n = recv (fd, buf, len, MSG_WAITALL)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *) buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Sends head and then body, if any, as one message
+static int
+nbdSend (int fd, const void *head, size_t headLen, const void *body, size_t bodyLen)
+{
+	struct iovec iov[2] = { {(void *) head, headLen}, {(void *) body, bodyLen} };
+	struct msghdr msg;
+	ssize_t n;
+	int i = 0;
+
+	memset (&msg, 0, sizeof (msg));
+	while (i < 2)
+	{
+		if (iov[i].iov_len == 0)
+		{
+			i++;
+			continue;
+		}
+		msg.msg_iov = iov + i;
+		msg.msg_iovlen = 2 - i;
+		if ((n = sendmsg (fd, &msg, MSG_NOSIGNAL)) < 0 && errno != EINTR)
+			return -1;
+		for (; n > 0 && i < 2; i++)
+		{
+			if ((size_t) n < iov[i].iov_len)
+			{
+				iov[i].iov_base = (char *) iov[i].iov_base + n;
+				iov[i].iov_len -= n;
+				break;
+			}
+			n -= iov[i].iov_len;
+			iov[i].iov_len = 0;
+		}
+	}
+	return 0;
+}
+
+static int
+nbdOptionReply (int fd, uint32_t option, uint32_t type, const void *data, size_t len)
+{
+	unsigned char head[20], *p = head;
+
+	p = nbdPut64 (p, NBD_REP_MAGIC);
+	p = nbdPut32 (p, option);
+	p = nbdPut32 (p, type);
+	nbdPut32 (p, len);
+	return nbdSend (fd, head, sizeof (head), data, len);
+}
+
+static uint16_t
+nbdTransmissionFlags (void)
+{
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM
+		| NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN | (readonly ? NBD_FLAG_READ_ONLY : 0);
+}
+
+// Opens the export called name, replying to a GO with why not if it cannot be opened
+static OpenFile *
+nbdOpen (NbdConn * c, const char *name, uint32_t option)
+{
+	OpenFile *f = NULL;
+	int n;
+
+// Tables are only replaced under partLock, so the lookup needs no pin
+	pthread_mutex_lock (&c->disk->partLock);
+	n = (*name) ? findPartition (partitionsCurrent (c->disk), name) : 0;
+	pthread_mutex_unlock (&c->disk->partLock);
+	if (n >= 0)
+		f = openFileNew (c->disk, n, !readonly);
+	else
+		errno = ENOENT;
+	if (!f && option != NBD_OPT_EXPORT_NAME)
+	{
+		const char *why = (errno == EBUSY) ? "overlaps a file open for writing" : strerror (errno);
+		nbdOptionReply (c->fd, option, (errno == ENOENT) ? NBD_REP_ERR_UNKNOWN : NBD_REP_ERR_POLICY,
+										why, strlen (why));
+	}
+	if (!f)
+		vlog (LOGLEVEL_WARN, "nbd: cannot open export \"%s\": %s", name, strerror (errno));
+	return f;
+}
+
+// Sends the names of the exports in reply to NBD_OPT_LIST
+static int
+nbdList (NbdConn * c)
+{
+	char (*names)[PNAMESIZE + 1];
+	unsigned char entry[4 + PNAMESIZE + 1];
+	const PartitionTable *t;
+	int n, count = 0, ret = 0;
+
+	pthread_mutex_lock (&c->disk->partLock);
+	t = partitionsCurrent (c->disk);
+	if ((names = malloc ((t->last + 1) * sizeof (*names))) != NULL)
+		for (n = 0; n <= t->last; n++)
+			if (t->p[n].no != UNALLOCATED)
+				strcpy (names[count++], t->p[n].name);
+	pthread_mutex_unlock (&c->disk->partLock);
+	for (n = 0; n < count && ret == 0; n++)
+	{
+		size_t len = strlen (names[n]);
+		nbdPut32 (entry, len);
+		memcpy (entry + 4, names[n], len);
+		ret = nbdOptionReply (c->fd, NBD_OPT_LIST, NBD_REP_SERVER, entry, 4 + len);
+	}
+	free (names);
+	return ret ? ret : nbdOptionReply (c->fd, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+}
+
+// Closes an export.  Closing an image's last file may re-read its partition table, which must
+// happen pinned (see partitionsUpdate): workers are already, other threads share a slot.
+static void
+nbdClose (OpenFile * f, int pinned)
+{
+	static pthread_mutex_t readerPin = PTHREAD_MUTEX_INITIALIZER;
+
+	if (pinned)
+	{
+		openFileFree (f);
+		return;
+	}
+	pthread_mutex_lock (&readerPin);
+	partitionPin (PIN_SLOT_NBD_READERS);
+	openFileFree (f);
+	partitionUnpin (PIN_SLOT_NBD_READERS);
+	pthread_mutex_unlock (&readerPin);
+}
+
+// Negotiates an export, returning it open or NULL if the client went away or gave up
+static OpenFile *
+nbdHandshake (NbdConn * c)
+{
+	unsigned char buf[NBD_OPTION_MAX + 1], head[18], *p;
+	uint32_t clientFlags, option, len;
+	OpenFile *f;
+
+	p = nbdPut64 (head, NBD_MAGIC);
+	p = nbdPut64 (p, NBD_OPTS_MAGIC);
+	nbdPut16 (p, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (nbdSend (c->fd, head, sizeof (head), NULL, 0) < 0 || nbdRecv (c->fd, buf, 4) < 0)
+		return NULL;
+	clientFlags = nbdGet32 (buf);
+	if (clientFlags & ~(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+		return NULL;
+
+	for (;;)
+	{
+		if (nbdRecv (c->fd, buf, 16) < 0 || nbdGet64 (buf) != NBD_OPTS_MAGIC)
+			return NULL;
+		option = nbdGet32 (buf + 8);
+		if ((len = nbdGet32 (buf + 12)) > NBD_OPTION_MAX || nbdRecv (c->fd, buf, len) < 0)
+			return NULL;
+		buf[len] = 0;
+
+		switch (option)
+		{
+			case NBD_OPT_EXPORT_NAME:
+				if ((f = nbdOpen (c, (char *) buf, option)) == NULL)
+					return NULL;
+				p = nbdPut64 (buf, f->part.size);
+				p = nbdPut16 (p, nbdTransmissionFlags ());
+				memset (p, 0, 124);
+				if (nbdSend (c->fd, buf, 10 + ((clientFlags & NBD_FLAG_NO_ZEROES) ? 0 : 124), NULL, 0) < 0)
+				{
+					nbdClose (f, 0);
+					return NULL;
+				}
+				return f;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+			{
+				uint32_t nameLen = (len >= 4) ? nbdGet32 (buf) : UINT32_MAX;
+				unsigned char info[12];
+				if (nameLen > len - 4 || len < 6 + nameLen)
+				{
+					if (nbdOptionReply (c->fd, option, NBD_REP_ERR_INVALID, NULL, 0) < 0)
+						return NULL;
+					break;
+				}
+				memmove (buf, buf + 4, nameLen);
+				buf[nameLen] = 0;
+				if ((f = nbdOpen (c, (char *) buf, option)) == NULL)
+					break;
+				p = nbdPut16 (info, NBD_INFO_EXPORT);
+				p = nbdPut64 (p, f->part.size);
+				nbdPut16 (p, nbdTransmissionFlags ());
+				if (nbdOptionReply (c->fd, option, NBD_REP_INFO, info, sizeof (info)) < 0
+						|| nbdOptionReply (c->fd, option, NBD_REP_ACK, NULL, 0) < 0)
+				{
+					nbdClose (f, 0);
+					return NULL;
+				}
+				if (option == NBD_OPT_GO)
+					return f;
+				nbdClose (f, 0);
+				break;
+			}
+			case NBD_OPT_LIST:
+				if (nbdList (c) < 0)
+					return NULL;
+				break;
+			case NBD_OPT_ABORT:
+				nbdOptionReply (c->fd, option, NBD_REP_ACK, NULL, 0);
+				return NULL;
+			default:
+				if (nbdOptionReply (c->fd, option, NBD_REP_ERR_UNSUP, NULL, 0) < 0)
+					return NULL;
+		}
+	}
+}
+
+// Drops a reference to c, closing it once the reader and all its requests are done.  Closing the
+// file may re-read the partition table, so c only leaves nbdConns, which nbdServe waits to empty
+// before VD_destroy, once that is over.
+static void
+nbdRelease (NbdConn * c, int pinned)
+{
+	NbdConn **l;
+	int fd;
+
+	pthread_mutex_lock (&nbdLock);
+	if (--c->refs > 0)
+	{
+		pthread_mutex_unlock (&nbdLock);
+		return;
+	}
+	fd = c->fd;
+	c->fd = -1;										// so that nbdServe does not shut down a reused descriptor
+	pthread_mutex_unlock (&nbdLock);
+
+	close (fd);
+	if (c->file)
+		nbdClose (c->file, pinned);
+	pthread_mutex_destroy (&c->sendLock);
+
+	pthread_mutex_lock (&nbdLock);
+	for (l = &nbdConns; *l != c; l = &(*l)->next)
+		;
+	*l = c->next;
+	pthread_cond_broadcast (&nbdIdle);
+	pthread_mutex_unlock (&nbdLock);
+	free (c);
+}
+
+static int
+nbdFlush (Disk * d)
+{
+	int ret = writebackSync (d);
+	if (RT_FAILURE (DISKflush (d)))
+		ret = -1;
+	return ret;
+}
+
+// Carries out one request, returning the NBD error to reply with
+static uint32_t
+nbdExecute (NbdRequest * r, char *out)
+{
+	OpenFile *f = r->conn->file;
+	const Partition *p = openFilePartition (f);
+	uint64_t start = statNow (), pos;
+	StatOp op = (r->type == NBD_CMD_READ) ? STAT_READ : (r->type == NBD_CMD_FLUSH) ? STAT_FSYNC : STAT_WRITE;
+	int ret = 0;
+
+	if (!p)
+		ret = -1;										// the partition has gone
+	else if (r->type != NBD_CMD_FLUSH && (r->offset > p->size || r->len > p->size - r->offset))
+	{
+		statRecord (op, start, 0, 1);
+		return (r->type == NBD_CMD_READ) ? EINVAL : ENOSPC;
+	}
+	else if (r->type != NBD_CMD_READ && r->type != NBD_CMD_FLUSH && readonly)
+	{
+		statRecord (op, start, 0, 1);
+		return EPERM;
+	}
+	else
+		switch (r->type)
+		{
+			case NBD_CMD_READ:
+				ret = openFileRead (f, p, r->offset, out, r->len);
+				break;
+			case NBD_CMD_WRITE:
+				ret = openFileWrite (f, p, r->offset, r->data, r->len);
+				break;
+			case NBD_CMD_WRITE_ZEROES:
+				for (pos = 0; pos < r->len && RT_SUCCESS (ret); pos += NBD_ZEROES_CHUNK)
+					ret = openFileWrite (f, p, r->offset + pos, out,
+															 (r->len - pos < NBD_ZEROES_CHUNK) ? r->len - pos : NBD_ZEROES_CHUNK);
+				break;
+			case NBD_CMD_TRIM:
+				break;
+			case NBD_CMD_FLUSH:
+				ret = nbdFlush (f->disk);
+				break;
+			default:
+				statRecord (op, start, 0, 1);
+				return EINVAL;
+		}
+	if (RT_SUCCESS (ret) && (r->flags & NBD_CMD_FLAG_FUA) && r->type != NBD_CMD_READ)
+		ret = nbdFlush (f->disk);
+	statRecord (op, start, (RT_SUCCESS (ret) && r->type != NBD_CMD_FLUSH) ? r->len : 0, RT_FAILURE (ret));
+	return RT_SUCCESS (ret) ? 0 : EIO;
+}
+
+static void *
+nbdWorker (void *arg)
+{
+	int worker = (int) (intptr_t) arg;
+	char *zeroes = calloc (1, NBD_ZEROES_CHUNK);
+	NbdRequest *r;
+
+	for (;;)
+	{
+		pthread_mutex_lock (&nbdLock);
+		while (!nbdHead && !nbdStopping)
+			pthread_cond_wait (&nbdWork, &nbdLock);
+		if (!(r = nbdHead))
+		{
+			pthread_mutex_unlock (&nbdLock);
+			break;
+		}
+		if ((nbdHead = r->next) == NULL)
+			nbdTail = NULL;
+		pthread_mutex_unlock (&nbdLock);
+
+		unsigned char reply[16], *p;
+		char *out = (r->type == NBD_CMD_READ) ? malloc (r->len ? r->len : 1) : zeroes;
+		uint32_t error;
+
+		partitionPin (worker);
+		error = out ? nbdExecute (r, out) : ENOMEM;
+		p = nbdPut32 (reply, NBD_REPLY_MAGIC);
+		p = nbdPut32 (p, error);
+		nbdPut64 (p, r->handle);
+		pthread_mutex_lock (&r->conn->sendLock);
+		if (nbdSend (r->conn->fd, reply, sizeof (reply), out, (r->type == NBD_CMD_READ && !error) ? r->len : 0) < 0)
+			shutdown (r->conn->fd, SHUT_RDWR);	// the reader notices and the connection winds down
+		pthread_mutex_unlock (&r->conn->sendLock);
+		if (out != zeroes)
+			free (out);
+
+		pthread_mutex_lock (&nbdLock);
+		r->conn->inFlight--;
+		pthread_cond_broadcast (&nbdSpace);
+		pthread_mutex_unlock (&nbdLock);
+		nbdRelease (r->conn, 1);
+		partitionUnpin (worker);
+		free (r->data);
+		free (r);
+	}
+	free (zeroes);
+	return NULL;
+}
+
+// Negotiates an export, then reads the connection's requests and queues them for the workers
+static void *
+nbdReader (void *arg)
+{
+	NbdConn *c = arg;
+	unsigned char head[28];
+	NbdRequest *r;
+
+	if ((c->file = nbdHandshake (c)) != NULL)
+		vbprintf ("nbd: serving %s on connection %d", c->file->part.name, c->fd);
+	while (c->file && nbdRecv (c->fd, head, sizeof (head)) == 0 && nbdGet32 (head) == NBD_REQUEST_MAGIC)
+	{
+		if ((r = calloc (1, sizeof (NbdRequest))) == NULL)
+			break;
+		r->conn = c;
+		r->flags = (head[4] << 8) | head[5];
+		r->type = (head[6] << 8) | head[7];
+		r->handle = nbdGet64 (head + 8);
+		r->offset = nbdGet64 (head + 16);
+		r->len = nbdGet32 (head + 24);
+		if (r->type == NBD_CMD_DISC)
+		{
+			free (r);
+			break;
+		}
+// A payload too large to take cannot be skipped reliably, so the connection is dropped
+		if ((r->type == NBD_CMD_READ || r->type == NBD_CMD_WRITE) && r->len > NBD_REQUEST_MAX)
+		{
+			vlog (LOGLEVEL_WARN, "nbd: request of %u bytes on connection %d is too large", r->len, c->fd);
+			free (r);
+			break;
+		}
+		if (r->type == NBD_CMD_WRITE
+				&& ((r->data = malloc (r->len ? r->len : 1)) == NULL || nbdRecv (c->fd, r->data, r->len) < 0))
+		{
+			free (r->data);
+			free (r);
+			break;
+		}
+
+		pthread_mutex_lock (&nbdLock);
+		while (c->inFlight >= NBD_INFLIGHT)
+			pthread_cond_wait (&nbdSpace, &nbdLock);
+		c->inFlight++;
+		c->refs++;
+		if (nbdTail)
+			nbdTail->next = r;
+		else
+			nbdHead = r;
+		nbdTail = r;
+		pthread_cond_signal (&nbdWork);
+		pthread_mutex_unlock (&nbdLock);
+	}
+	vbprintf ("nbd: connection %d closed", c->fd);
+	nbdRelease (c, 0);
+	return NULL;
+}
+
+static void
+nbdSignal (int sig UNUSED)
+{
+	char b = 0;
+	ssize_t written = write (nbdSignalPipe[1], &b, 1);
+	(void) written;								// if the pipe is full, a wakeup is pending anyway
+}
+
+// Serves d on a unix socket at path until SIGINT or SIGTERM.  Returns the exit status.
+int
+nbdServe (Disk * d, const char *path)
+{
+	pthread_t worker[WORKER_THREADS_MAX], reader;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd fds[2];
+	struct stat st;
+	sigset_t all, saved;
+	NbdConn *c;
+	int listenFd, t, ready, started = 0;
+
+	if (readers == 0 && !DISK_THREADSAFE)
+		readers = (workerThreads < DISKHANDLE_MAX) ? workerThreads : DISKHANDLE_MAX;
+	if (diskPartitions (d) < 0)
+		usageAndExit ("cannot read the partition table of %s", d->layerFile[0]);
+	if (strlen (path) >= sizeof (addr.sun_path))
+		usageAndExit ("the socket path %s is too long", path);
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+	if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+		unlink (path);								// left behind by an earlier run
+	if ((listenFd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+			|| bind (listenFd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (listenFd, 16) < 0)
+		usageAndExit ("cannot listen on %s: %s", path, strerror (errno));
+	if (pipe (nbdSignalPipe) < 0)
+		usageAndExit ("cannot create a pipe: %s", strerror (errno));
+	fcntl (nbdSignalPipe[1], F_SETFL, O_NONBLOCK);
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = nbdSignal;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	logStart ();
+	readaheadStart ();
+	writebackStart ();
+// Only this thread takes the signals
+	sigfillset (&all);
+	pthread_sigmask (SIG_BLOCK, &all, &saved);
+	for (t = 0; t < workerThreads; t++)
+		if (pthread_create (&worker[started], NULL, nbdWorker, (void *) (intptr_t) started) == 0)
+			started++;
+	pthread_sigmask (SIG_SETMASK, &saved, NULL);
+	if (started == 0)
+		usageAndExit ("cannot start the nbd worker threads");
+	vbprintf ("serving %s over nbd on %s with %d threads", d->name, path, started);
+
+	fds[0].fd = listenFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = nbdSignalPipe[0];
+	fds[1].events = POLLIN;
+	for (;;)
+	{
+		if ((ready = poll (fds, 2, -1)) < 0 && errno == EINTR)
+			continue;
+		if (ready < 0 || fds[1].revents)
+			break;
+		if (!(fds[0].revents & POLLIN))
+			continue;
+		c = calloc (1, sizeof (NbdConn));
+		if (!c || (c->fd = accept (listenFd, NULL, NULL)) < 0)
+		{
+			free (c);
+			continue;
+		}
+		c->disk = d;
+		c->refs = 1;
+		pthread_mutex_init (&c->sendLock, NULL);
+		pthread_mutex_lock (&nbdLock);
+		c->next = nbdConns;
+		nbdConns = c;
+		pthread_mutex_unlock (&nbdLock);
+		pthread_sigmask (SIG_BLOCK, &all, &saved);
+		if (pthread_create (&reader, NULL, nbdReader, c) == 0)
+			pthread_detach (reader);
+		else
+			nbdRelease (c, 0);
+		pthread_sigmask (SIG_SETMASK, &saved, NULL);
+	}
+
+// Cut the connections off, let their queued requests finish, then stop the workers
+	vbprintf ("nbd: shutting down");
+	close (listenFd);
+	unlink (path);
+	pthread_mutex_lock (&nbdLock);
+	for (c = nbdConns; c; c = c->next)
+		if (c->fd >= 0)
+			shutdown (c->fd, SHUT_RDWR);
+	while (nbdConns)
+		pthread_cond_wait (&nbdIdle, &nbdLock);
+	nbdStopping = 1;
+	pthread_cond_broadcast (&nbdWork);
+	pthread_mutex_unlock (&nbdLock);
+	for (t = 0; t < started; t++)
+		pthread_join (worker[t], NULL);
+	VD_destroy (NULL);
+	return 0;
+}
+
+//====================================================================================================
+//                                        Fuse session worker threads
+//====================================================================================================
+//
+// fuse_session_loop_mt starts a thread per burst of requests and retires them again when idle, with
+// no way to bound how many run against the disk handles.  vdfuse instead starts a fixed set of
+// workers (-o threads=N) that each read requests off the channel into their own buffer.  As in
+// fuse_session_loop_mt, the workers have all signals blocked so that a SIGINT/SIGTERM interrupts the
+// main thread, which then cancels them out of their blocking read.  Each request is served pinned,
+// see the partition table versions.
+
+static struct fuse_session *workerSession;
+static sem_t workerFinished;
+static int workerError = 0;
+
+static void *
+sessionWorker (void *arg)
+{
+	int worker = (int) (intptr_t) arg;
+	struct fuse_chan *ch = fuseChannel;
+	size_t bufsize = fuse_chan_bufsize (ch);
+	char *mem = malloc (bufsize);
+
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push (free, mem);
+	while (mem && !fuse_session_exited (workerSession))
+	{
+		struct fuse_chan *c = ch;
+		int res;
+#if FUSE_VERSION >= 29
+		struct fuse_buf fbuf = {.mem = mem,.size = bufsize };
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_session_receive_buf (workerSession, &fbuf, &c);
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+#else
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_chan_recv (&c, mem, bufsize);
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+#endif
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+		{
+			if (res < 0)
+				workerError = -1;		// 0 means the filesystem was unmounted
+			break;
+		}
+		partitionPin (worker);
+#if FUSE_VERSION >= 29
+		fuse_session_process_buf (workerSession, &fbuf, c);
+#else
+		fuse_session_process (workerSession, mem, res, c);
+#endif
+		partitionUnpin (worker);
+	}
+	pthread_cleanup_pop (1);
+
+	fuse_session_exit (workerSession);
+	sem_post (&workerFinished);
+	return NULL;
+}
+
+// Serves requests on threads until the filesystem is unmounted or vdfuse is signalled
+int
+sessionLoop (struct fuse_session *se, int threads)
+{
+	pthread_t worker[WORKER_THREADS_MAX];
+	sigset_t all, saved;
+	int t, started = 0;
+
+	workerSession = se;
+	sem_init (&workerFinished, 0, 0);
+	sigfillset (&all);
+	pthread_sigmask (SIG_BLOCK, &all, &saved);
+	for (t = 0; t < threads; t++)
+		if (pthread_create (&worker[started], NULL, sessionWorker, (void *) (intptr_t) started) == 0)
+			started++;
+	pthread_sigmask (SIG_SETMASK, &saved, NULL);
+	vbprintf ("serving fuse requests on %d threads", started);
+
+	if (started == 0)
+		workerError = -1;
+	else
+		while (!fuse_session_exited (se))
+			sem_wait (&workerFinished);	// returns early with EINTR when signalled
+
+	for (t = 0; t < started; t++)
+		pthread_cancel (worker[t]);
+	for (t = 0; t < started; t++)
+		pthread_join (worker[t], NULL);
+	sem_destroy (&workerFinished);
+	return workerError;
+}
+
+//====================================================================================================
+//                                         Fuse Callback Routines
+//====================================================================================================
+//
+// in alphetic order to help find them: destroy ,flush ,fsync ,getattr ,init ,ioctl ,lookup ,open, read,
+// readdir, release, write.  Files are addressed by inode, see PARTITION_INODE.
+
+void
+VD_destroy (void *u UNUSED)
+{
+// called when the fuse filesystem is umounted
+	int i;
+	vbprintf ("destroy");
+	readaheadStop ();
+	writebackStop ();
+	cacheReport ();
+	vbprintf ("sparse map: %llu bytes read as zeros without touching the image",
+						(unsigned long long) sparseZeroBytes);
+	for (i = 0; i < diskCount; i++)
+	{
+		Disk *d = disks[i];
+		if (d->state != DISK_OPEN)
+			continue;
+		if (d->zeroCopyEnabled)
+			vdImageClose (&d->zeroCopyImage);
+		overlayClose (d);
+		persistClose (d);
+		DISKclose (d);
+	}
+	logStop ();
+}
+
+static void
+VD_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i)
+{
+	vlog (LOGLEVEL_DEBUG, "flush: %lu", ino);
+	if (ino == STATS_INODE && statsEnabled)
+	{
+		fuse_reply_err (req, 0);		// /.stats has nothing to write back
+		return;
+	}
+	OpenFile *f = (OpenFile *) (uintptr_t) i->fh;
+	uint64_t start = statNow ();
+	int ret = writebackSync (f->disk);
+	DISKflush (f->disk);
+	statRecord (STAT_FLUSH, start, 0, ret < 0);
+	traceRecord (VDFUSE_TRACE_FLUSH, f->n, 0, 0, 0, start, ret < 0);
+	fuse_reply_err (req, (ret < 0) ? EIO : 0);
+}
+
+static void
+VD_fsync (fuse_req_t req, fuse_ino_t ino, int datasync UNUSED,
+					struct fuse_file_info *i)
+{
+	vlog (LOGLEVEL_DEBUG, "fsync: %lu", ino);
+	if (ino == STATS_INODE && statsEnabled)
+	{
+		fuse_reply_err (req, 0);
+		return;
+	}
+	OpenFile *f = (OpenFile *) (uintptr_t) i->fh;
+	uint64_t start = statNow ();
+	int ret = writebackSync (f->disk);
+	DISKflush (f->disk);
+	statRecord (STAT_FSYNC, start, 0, ret < 0);
+	traceRecord (VDFUSE_TRACE_FSYNC, f->n, 0, 0, 0, start, ret < 0);
+	fuse_reply_err (req, (ret < 0) ? EIO : 0);
+}
+
+static void
+VD_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i UNUSED)
+{
+	struct stat stbuf;
+	vlog (LOGLEVEL_DEBUG, "getattr: %lu", ino);
+	if (inodeStat (ino, &stbuf) < 0)
+		fuse_reply_err (req, ENOENT);
+	else
+		fuse_reply_attr (req, &stbuf, attrTimeout);
+}
+
+void
+VD_init (void *u UNUSED, struct fuse_conn_info *conn)
+{
+// called once fuse has daemonised and is about to start serving requests
+	vbprintf ("init");
+	if (bigWrites)
+		conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+	if (maxWrite)
+		conn->max_write = maxWrite;
+#if FUSE_VERSION >= 29
+	if (splice)
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE
+																	 | FUSE_CAP_SPLICE_MOVE);
+// Images that are not open yet may turn out to qualify for zero-copy reads
+	if (multiImage ? zeroCopy : disks[0]->zeroCopyEnabled)
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+	logStart ();
+	readaheadStart ();
+	writebackStart ();
+}
+
+#if FUSE_VERSION >= 28
+static void
+VD_ioctl (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg UNUSED,
+					struct fuse_file_info *i, unsigned flags, const void *in_buf,
+					size_t in_bufsz, size_t out_bufsz)
+{
+	vlog (LOGLEVEL_DEBUG, "ioctl: %lu, 0X%08X", ino, cmd);
+	if (ino == STATS_INODE && statsEnabled)
+	{
+		fuse_reply_err (req, ENOTTY);
+		return;
+	}
+	OpenFile *f = (OpenFile *) (uintptr_t) i->fh;
+	Disk *d = f->disk;
+	if (flags & FUSE_IOCTL_COMPAT)
+	{
+		fuse_reply_err (req, ENOSYS);
+		return;
+	}
+	if ((unsigned int) cmd == VDFUSE_IOC_REREAD)
+	{
+		pthread_mutex_lock (&d->partLock);
+		int ret = partitionsUpdate (d);
+		pthread_mutex_unlock (&d->partLock);
+		if (ret < 0)
+			fuse_reply_err (req, EIO);
+		else
+			fuse_reply_ioctl (req, 0, NULL, 0);
+		return;
+	}
+	if ((unsigned int) cmd != VDFUSE_IOC_EXTENT)
+	{
+		fuse_reply_err (req, ENOTTY);
+		return;
+	}
+	if (in_bufsz < sizeof (struct vdfuse_extent) || out_bufsz < sizeof (struct vdfuse_extent))
+	{
+		fuse_reply_err (req, EINVAL);
+		return;
+	}
+
+// Skip holes from the requested offset onwards and report the data extent that follows
+	struct vdfuse_extent e;
+	const Partition *p = openFilePartition (f);
+	if (!p)
+	{
+		fuse_reply_err (req, ENOENT);
+		return;
+	}
+	memcpy (&e, in_buf, sizeof (e));
+	uint64_t limit = p->offset + p->size;
+	uint64_t pos = p->offset + ((e.offset < p->size) ? e.offset : p->size);
+	uint64_t next = limit;
+	int isData;
+
+	while (pos < limit)
+	{
+		next = sparseExtent (d, pos, limit, &isData);
+		if (isData)
+			break;
+		pos = next;
+	}
+	e.dataStart = pos - p->offset;
+	e.dataEnd = ((pos < limit) ? next : pos) - p->offset;
+	fuse_reply_ioctl (req, 0, &e, sizeof (e));
+}
+#endif
+
+static void
+VD_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	Disk *d = (multiImage) ? NULL : disks[0];
+	int i, n = -1;
+	vlog (LOGLEVEL_DEBUG, "lookup: %s", name);
+
+// A miss is answered with inode 0 rather than ENOENT so that the kernel caches the negative entry
+	memset (&e, 0, sizeof (e));
+	e.entry_timeout = entryTimeout;
+	if (parent != FUSE_ROOT_ID)
+	{
+// Besides the root only the images' directories have entries
+		d = (multiImage) ? inodeImage (parent, &n) : NULL;
+		if (n != -1)
+			d = NULL;
+	}
+	else if (multiImage)
+	{
+		for (i = 0; i < diskCount && !e.ino; i++)
+			if (strcmp (disks[i]->name, name) == 0)
+				e.ino = disks[i]->inode;
+	}
+// Looking into an image's directory opens the image and reads its partition table
+	if (d && diskPartitions (d) < 0)
+	{
+		fuse_reply_err (req, EIO);
+		return;
+	}
+	if (d && (n = findPartition (partitionsCurrent (d), name)) >= 0)
+		e.ino = PARTITION_INODE (d, n);
+	else if (parent == FUSE_ROOT_ID && statsEnabled && strcmp (name, STATS_NAME) == 0)
+		e.ino = STATS_INODE;
+	if (e.ino && inodeStat (e.ino, &e.attr) < 0)
+		e.ino = 0;									// a re-read of the partition table took it away
+	if (e.ino)
+		e.attr_timeout = attrTimeout;
+	fuse_reply_entry (req, &e);
+}
+
+static void
+VD_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *i)
+{
+	Disk *d = NULL;
+	vlog (LOGLEVEL_DEBUG, "open: %lu, 0X%08lX ", ino, i->flags);
+	if (ino == STATS_INODE && statsEnabled)
+	{
+// Each open gets its own snapshot, so a reader sees one consistent set of counters
+		size_t len;
+		char *text;
+		if ((i->flags & (O_WRONLY | O_RDWR)) != 0)
+			fuse_reply_err (req, EACCES);
+		else if ((text = statsReport (&len)) == NULL)
+			fuse_reply_err (req, ENOMEM);
+		else
+		{
+			i->direct_io = 1;
+			i->fh = (uint64_t) (uintptr_t) text;
+			fuse_reply_open (req, i);
+		}
+		return;
+	}
+	int writable = ((i->flags & (O_WRONLY | O_RDWR)) != 0);
+	int n = inodePartition (ino, &d, NULL);
+	if (n == -1)
+	{
+		fuse_reply_err (req, ENOENT);
+		return;
+	}
+	if (readonly && writable)
+	{
+		fuse_reply_err (req, EROFS);
+		return;
+	}
+	OpenFile *f = openFileNew (d, n, writable);
+	if (!f)
+	{
+		fuse_reply_err (req, errno);
+		return;
+	}
+
+// Nothing but this mount can change a read-only image, so its pages may outlive the open
+	i->keep_cache = readonly;
+	i->fh = (uint64_t) (uintptr_t) f;
+	fuse_reply_open (req, i);
+}
+
+static void
+VD_read (fuse_req_t req, fuse_ino_t ino, size_t len, off_t offset,
+				 struct fuse_file_info *i)
+{
+	vlog (LOGLEVEL_DEBUG, "read: %lu, offset=%lld, length=%d", ino, offset, len);
+	if (ino == STATS_INODE && statsEnabled)
+	{
+		const char *text = (const char *) (uintptr_t) i->fh;
+		size_t size = strlen (text);
+		if ((uint64_t) offset >= size)
+			fuse_reply_buf (req, NULL, 0);
+		else
+			fuse_reply_buf (req, text + offset, (size - offset < len) ? size - offset : len);
+		return;
+	}
+	uint64_t start = statNow ();
+	OpenFile *f = (OpenFile *) (uintptr_t) i->fh;
+	Disk *d = f->disk;
+	int n = f->n;
+	const Partition *p = openFilePartition (f);
+	if (!p)
+	{
+		statRecord (STAT_READ, start, 0, 1);
+		fuse_reply_err (req, ENOENT);
+		return;
+	}
+	if ((uint64_t) offset >= p->size)
+	{
+		statRecord (STAT_READ, start, 0, 0);
+		fuse_reply_buf (req, NULL, 0);
+		return;
+	}
+	if ((uint64_t) (offset + len) > p->size)
+		len = p->size - offset;
+
+#if FUSE_VERSION >= 29
+	struct fuse_bufvec *bv = NULL;
+	if (!writebackContains (d, offset + p->offset, len))
+		bv = zeroCopyMap (d, offset + p->offset, len);
+	if (bv)
+	{
+		fuse_reply_data (req, bv, FUSE_BUF_SPLICE_MOVE);
+		free (bv);
+		__atomic_fetch_add (&f->reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&f->readBytes, len, __ATOMIC_RELAXED);
+		statRecord (STAT_READ, start, len, 0);
+		traceRecord (VDFUSE_TRACE_READ, n, offset, p->offset + offset, len, start, 0);
+		return;
+	}
+#endif
+
+// Not contiguous in a single file, so copy it into memory the usual way
+	char *out = malloc (len);
+	if (!out)
+	{
+		statRecord (STAT_READ, start, 0, 1);
+		fuse_reply_err (req, ENOMEM);
+		return;
+	}
+	int ret = openFileRead (f, p, offset, out, len);
+	statRecord (STAT_READ, start, RT_SUCCESS (ret) ? len : 0, RT_FAILURE (ret));
+	traceRecord (VDFUSE_TRACE_READ, n, offset, p->offset + offset, len, start, RT_FAILURE (ret));
+	if (RT_SUCCESS (ret))
+		fuse_reply_buf (req, out, len);
+	else
+		fuse_reply_err (req, EIO);
+	free (out);
+}
+
+static void
+VD_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+						struct fuse_file_info *i UNUSED)
+{
+	struct stat st;
+	size_t used = 0;
+	off_t k, first = 3, last;
+	Disk *d = (multiImage) ? NULL : disks[0];
+	int n;
+	vlog (LOGLEVEL_DEBUG, "readdir");
+	if (ino != FUSE_ROOT_ID)
+	{
+		if (!multiImage || (d = inodeImage (ino, &n)) == NULL || n != -1)
+		{
+			fuse_reply_err (req, ENOTDIR);
+			return;
+		}
+		first = 2;
+	}
+	if (d && diskPartitions (d) < 0)
+	{
+		fuse_reply_err (req, EIO);
+		return;
+	}
+	const PartitionTable *t = (d) ? partitionsCurrent (d) : NULL;
+	char *buf = malloc (size);
+	if (!buf)
+	{
+		fuse_reply_err (req, ENOMEM);
+		return;
+	}
+
+// Directory offsets 0 and 1 are "." and "..", then in the root 2 is /.stats.  Offset n + first is
+// PartitionN, or with several images disks[n] in the root.
+	memset (&st, 0, sizeof (st));
+	last = ((t) ? t->last : diskCount - 1) + first;
+	for (k = offset; k <= last; k++)
+	{
+		const char *name;
+		size_t need;
+		if (k < 2)
+		{
+			name = k ? ".." : ".";
+			st.st_ino = k ? FUSE_ROOT_ID : ino;
+			st.st_mode = S_IFDIR;
+		}
+		else if (k < first)
+		{
+			if (!statsEnabled)
+				continue;
+			name = STATS_NAME;
+			st.st_ino = STATS_INODE;
+			st.st_mode = S_IFREG;
+		}
+		else if (!d)
+		{
+			name = disks[k - first]->name;
+			st.st_ino = disks[k - first]->inode;
+			st.st_mode = S_IFDIR;
+		}
+		else
+		{
+			const Partition *p = t->p + k - first;
+			if (p->no == UNALLOCATED)
+				continue;
+			name = p->name;
+			st.st_ino = PARTITION_INODE (d, k - first);
+			st.st_mode = S_IFREG;
+		}
+		need = fuse_add_direntry (req, buf + used, size - used, name, &st, k + 1);
+		if (need > size - used)
+			break;
+		used += need;
+	}
+	fuse_reply_buf (req, buf, used);
+	free (buf);
+}
+
+static void
+VD_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	vlog (LOGLEVEL_DEBUG, "release: %lu", ino);
+	if (ino == STATS_INODE && statsEnabled)
+	{
+		free ((char *) (uintptr_t) fi->fh);
+		fuse_reply_err (req, 0);
+		return;
+	}
+	openFileFree ((OpenFile *) (uintptr_t) fi->fh);
+	fi->fh = 0;
+	fuse_reply_err (req, 0);
+}
+
+static void
+VD_write (fuse_req_t req, fuse_ino_t ino, const char *in, size_t len, off_t offset,
+					struct fuse_file_info *i)
+{
+	vlog (LOGLEVEL_DEBUG, "write: %lu, offset=%lld, length=%d", ino, offset, len);
+	uint64_t start = statNow ();
+	OpenFile *f = (OpenFile *) (uintptr_t) i->fh;
+	int n = f->n;
+	const Partition *p = openFilePartition (f);
+	if (!p)
+	{
+		statRecord (STAT_WRITE, start, 0, 1);
+		fuse_reply_err (req, ENOENT);
+		return;
+	}
+	if ((uint64_t) offset >= p->size)
+	{
+		statRecord (STAT_WRITE, start, 0, 0);
+		fuse_reply_write (req, 0);
+		return;
+	}
+	if ((uint64_t) (offset + len) > p->size)
+		len = p->size - offset;
+
+	int ret = openFileWrite (f, p, offset, in, len);
+	statRecord (STAT_WRITE, start, RT_SUCCESS (ret) ? len : 0, RT_FAILURE (ret));
+	traceRecord (VDFUSE_TRACE_WRITE, n, offset, p->offset + offset, len, start, RT_FAILURE (ret));
+	if (RT_SUCCESS (ret))
+		fuse_reply_write (req, len);
+	else
+		fuse_reply_err (req, EIO);
 }
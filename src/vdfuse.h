@@ -0,0 +1,84 @@
+/* Interface offered by vdfuse mounts to programs reading them			*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef VDFUSE_H
+#define VDFUSE_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Extent query on EntireDisk or a PartitionN file, the equivalent of lseek SEEK_DATA followed by
+// SEEK_HOLE which fuse does not pass on.  Given an offset, returns the first data extent at or
+// after it; dataStart == dataEnd == file size means there is no more data.  Extents are reported
+// at the image's allocation unit, so a data extent may still contain runs of zeros.
+//
+//    struct vdfuse_extent e = { .offset = 0 };
+//    while (ioctl (fd, VDFUSE_IOC_EXTENT, &e) == 0 && e.dataStart < e.dataEnd)
+//    {
+//        copy (fd, e.dataStart, e.dataEnd - e.dataStart);
+//        e.offset = e.dataEnd;
+//    }
+
+struct vdfuse_extent
+{
+	uint64_t offset;							// in: file offset to search from
+	uint64_t dataStart;						// out: start of the next data extent
+	uint64_t dataEnd;							// out: end of that extent
+};
+
+#define VDFUSE_IOC_EXTENT _IOWR ('V', 1, struct vdfuse_extent)
+
+// Re-reads the image's partition table, on EntireDisk or any PartitionN file.  Writes through the
+// mount that reach the table's sectors already cause a re-read once the image's last file is closed;
+// this is for when the table has to be picked up straight away.  Fails with EIO, keeping the
+// current partitions, if the table now on the image is invalid.
+#define VDFUSE_IOC_REREAD _IO ('V', 2)
+
+// Request trace written by "-o trace=FILE": a struct vdfuse_trace_header followed by one struct
+// vdfuse_trace per request, all in host byte order.  Each thread's records are in time order, but
+// the threads' records are interleaved in batches, so sort by time for a global order.  Flush and
+// fsync records have a zero offset and length.  vdreplay plays a trace back.
+
+#define VDFUSE_TRACE_MAGIC "vdftrace"
+#define VDFUSE_TRACE_VERSION 1
+#define VDFUSE_TRACE_READ 0
+#define VDFUSE_TRACE_WRITE 1
+#define VDFUSE_TRACE_FLUSH 2
+#define VDFUSE_TRACE_FSYNC 3
+
+struct vdfuse_trace_header
+{
+	char magic[8];								// VDFUSE_TRACE_MAGIC, not NUL terminated
+	uint32_t version;							// VDFUSE_TRACE_VERSION
+	uint32_t recordSize;					// sizeof (struct vdfuse_trace)
+};
+
+struct vdfuse_trace
+{
+	uint64_t time;								// ns from the start of the trace to the request
+	uint64_t offset;							// in the partition file
+	uint64_t diskOffset;					// the same position on EntireDisk
+	uint32_t length;
+	uint32_t latency;							// ns taken to serve the request, saturating
+	uint16_t partition;						// N of PartitionN, 0 for EntireDisk
+	uint8_t op;										// VDFUSE_TRACE_*
+	uint8_t error;								// non-zero if the request failed
+	uint32_t thread;							// small number identifying the serving thread
+};
+
+#endif
@@ -0,0 +1,418 @@
+/* Direct parsing of VD image file headers and block maps				*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+/* DESCRIPTION
+ * The VirtualBox library hides where the blocks of an image live, so this reads the handful of
+ * header fields vdfuse needs straight from the image file:
+ *  *  VDI: the pre-header and v1.1 header, then the little endian block map
+ *         See http://forums.virtualbox.org/viewtopic.php?t=8046
+ *  *  VHD: the footer and, for dynamic and differencing disks, the dynamic header and big endian BAT
+ *         See the Microsoft "Virtual Hard Disk Image Format Specification"
+ *  *  VMDK: the sparse extent header of a monolithic sparse or streamOptimized image (taken from the
+ *         footer when the header defers to it), then the grain directory and grain tables, which
+ *         are flattened into one block map of grain sector offsets
+ *         See the VMware "Virtual Disk Format 5.0" specification
+ * along with the UUIDs and parent locators that tie a differencing image to its parent.  Probing an
+ * image reads only the headers, leaving the block map alone.
+ *  *  Anything else is treated as a raw image, except a VMDK text descriptor, which is recognised
+ *     but not parsed.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vdimage.h"
+
+#define VDI_SIGNATURE 0xbeda107fU
+#define VDI_TYPE_FIXED 2
+#define VDI_TYPE_DIFF 4
+#define VDI_HEADER_OFFSET 64
+#define VHD_FOOTER_SIZE 512
+#define VHD_DYNHEADER_SIZE 1024
+#define VHD_TYPE_FIXED 2
+#define VHD_TYPE_DYNAMIC 3
+#define VHD_TYPE_DIFF 4
+#define VHD_LOCATORS 8
+#define VHD_LOCATOR_MAX 4096				// longest parent path read from a locator, in bytes
+#define VMDK_GD_AT_END 0xffffffffffffffffULL	// gdOffset of a stream: look in the footer instead
+#define VMDK_FLAG_COMPRESSED (1U << 16)
+#define VMDK_COMPRESS_DEFLATE 1
+#define VMDK_GRAIN_MAX (16 * 1024 * 1024)	// largest grain accepted, in bytes
+#define SECTORSIZE 512
+
+static uint32_t
+le32 (const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+le64 (const unsigned char *p)
+{
+	return le32 (p) | ((uint64_t) le32 (p + 4) << 32);
+}
+
+static uint32_t
+be32 (const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t
+be64 (const unsigned char *p)
+{
+	return ((uint64_t) be32 (p) << 32) | be32 (p + 4);
+}
+
+static int
+readAt (int fd, void *buf, size_t len, uint64_t offset)
+{
+	ssize_t got = pread (fd, buf, len, offset);
+	if (got < 0)
+		return -errno;
+	return (got == (ssize_t) len) ? 0 : -EIO;
+}
+
+static int
+loadBlockMap (VDImage * img, int bigEndian)
+{
+	uint32_t i;
+	int ret;
+
+	img->blockMap = malloc ((size_t) img->nBlocks * sizeof (uint32_t));
+	if (!img->blockMap)
+		return -ENOMEM;
+	ret = readAt (img->fd, img->blockMap, (size_t) img->nBlocks * sizeof (uint32_t), img->mapOffset);
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < img->nBlocks; i++)
+	{
+		const unsigned char *e = (const unsigned char *) (img->blockMap + i);
+		img->blockMap[i] = bigEndian ? be32 (e) : le32 (e);
+	}
+	return 0;
+}
+
+// Decodes UTF-16 into a malloc'ed UTF-8 string with backslashes turned into '/', stopping at a NUL
+static char *
+utf16Path (const unsigned char *p, size_t len, int bigEndian)
+{
+	char *out = malloc (len / 2 * 3 + 1), *o = out;
+	size_t i;
+
+	if (!out)
+		return NULL;
+	for (i = 0; i + 1 < len; i += 2)
+	{
+		uint32_t c = bigEndian ? (p[i] << 8 | p[i + 1]) : (p[i] | p[i + 1] << 8);
+		if (c == 0)
+			break;
+		if (c == '\\')
+			c = '/';
+		if (c >= 0xd800 && c < 0xe000)
+			c = '?';										// a surrogate pair will not name a file we can find
+		if (c < 0x80)
+			*o++ = c;
+		else if (c < 0x800)
+		{
+			*o++ = 0xc0 | c >> 6;
+			*o++ = 0x80 | (c & 0x3f);
+		}
+		else
+		{
+			*o++ = 0xe0 | c >> 12;
+			*o++ = 0x80 | ((c >> 6) & 0x3f);
+			*o++ = 0x80 | (c & 0x3f);
+		}
+	}
+	*o = '\0';
+	return out;
+}
+
+// Takes the parent's path from the relative locator, else the absolute one, else the parent's name
+static void
+parseVHDParent (VDImage * img, const unsigned char *d)
+{
+	static const char *codes[] = { "W2ru", "W2ku" };
+	unsigned char buf[VHD_LOCATOR_MAX];
+	int c, i;
+
+	for (c = 0; c < 2 && !img->parentPath; c++)
+		for (i = 0; i < VHD_LOCATORS && !img->parentPath; i++)
+		{
+			const unsigned char *l = d + 576 + 24 * i;
+			uint32_t len = be32 (l + 8);
+			if (memcmp (l, codes[c], 4) != 0 || len == 0 || len > sizeof (buf)
+					|| readAt (img->fd, buf, len, be64 (l + 16)) < 0)
+				continue;
+			img->parentPath = utf16Path (buf, len, 0);
+		}
+	if (!img->parentPath)
+		img->parentPath = utf16Path (d + 64, 512, 1);
+	if (img->parentPath && !*img->parentPath)
+	{
+		free (img->parentPath);
+		img->parentPath = NULL;
+	}
+}
+
+static int
+parseVDI (VDImage * img, int loadMap)
+{
+	unsigned char h[472];
+	int ret;
+
+	if ((ret = readAt (img->fd, h, sizeof (h), 0)) < 0)
+		return ret;
+	if (le32 (h + VDI_HEADER_OFFSET) != VDI_SIGNATURE || (le32 (h + 68) >> 16) != 1)
+		return -EINVAL;						// only version 1.x headers are understood
+
+	img->kind = VDIMAGE_VDI;
+	img->mapOffset = le32 (h + 340);
+	img->dataOffset = le32 (h + 344);
+	img->size = le64 (h + 368);
+	img->blockSize = le32 (h + 376);
+	img->blockExtra = le32 (h + 380);
+	img->nBlocks = le32 (h + 384);
+	memcpy (img->uuid, h + 392, 16);
+	if (le32 (h + 76) == VDI_TYPE_DIFF)
+		memcpy (img->parentUuid, h + 424, 16);	// uuidLinkage
+	if (img->blockSize == 0 || (uint64_t) img->nBlocks * img->blockSize < img->size)
+		return -EINVAL;
+	return loadMap ? loadBlockMap (img, 0) : 0;
+}
+
+static int
+parseVHD (VDImage * img, const unsigned char *footer, int loadMap)
+{
+	unsigned char d[VHD_DYNHEADER_SIZE];
+	int ret;
+
+	img->size = be64 (footer + 48);
+	memcpy (img->uuid, footer + 68, 16);
+	switch (be32 (footer + 60))
+	{
+		case VHD_TYPE_FIXED:
+			img->kind = VDIMAGE_VHD_FIXED;
+			return 0;
+		case VHD_TYPE_DYNAMIC:
+			img->kind = VDIMAGE_VHD_DYNAMIC;
+			break;
+		case VHD_TYPE_DIFF:
+			img->kind = VDIMAGE_VHD_DIFF;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if ((ret = readAt (img->fd, d, sizeof (d), be64 (footer + 16))) < 0)
+		return ret;
+	if (memcmp (d, "cxsparse", 8) != 0)
+		return -EINVAL;
+	img->mapOffset = be64 (d + 16);
+	img->nBlocks = be32 (d + 28);
+	img->blockSize = be32 (d + 32);
+	img->bitmapSize = ((img->blockSize / SECTORSIZE + 7) / 8 + SECTORSIZE - 1) & ~(SECTORSIZE - 1);
+	if (img->blockSize == 0 || (uint64_t) img->nBlocks * img->blockSize < img->size)
+		return -EINVAL;
+	if (img->kind == VDIMAGE_VHD_DIFF)
+	{
+		memcpy (img->parentUuid, d + 40, 16);
+		parseVHDParent (img, d);
+	}
+	return loadMap ? loadBlockMap (img, 1) : 0;
+}
+
+// Flattens the grain directory and the grain tables it points to into the block map.  A grain table
+// entry of 0 is an unallocated grain; 1 points into the header, so it can only be the zeroed grain
+// entry of newer images.
+static int
+loadGrainTables (VDImage * img, uint32_t gtes)
+{
+	uint32_t nGTs = (img->nBlocks + gtes - 1) / gtes, g, i;
+	unsigned char *gd, *gt;
+	int ret;
+
+	img->blockMap = malloc ((size_t) img->nBlocks * sizeof (uint32_t));
+	gd = malloc ((size_t) nGTs * 4);
+	gt = malloc ((size_t) gtes * 4);
+	if (!img->blockMap || !gd || !gt)
+		ret = -ENOMEM;
+	else
+		ret = readAt (img->fd, gd, (size_t) nGTs * 4, img->mapOffset);
+	for (g = 0; g < nGTs && ret == 0; g++)
+	{
+		uint64_t gtSector = le32 (gd + 4 * g);
+		if (gtSector && (ret = readAt (img->fd, gt, (size_t) gtes * 4, gtSector * SECTORSIZE)) < 0)
+			break;
+		for (i = 0; i < gtes && (uint64_t) g * gtes + i < img->nBlocks; i++)
+		{
+			uint32_t e = gtSector ? le32 (gt + 4 * i) : 0;
+			if (e >= VDIMAGE_BLOCK_ZERO)
+				ret = -EFBIG;
+			img->blockMap[g * gtes + i] = (e == 0) ? VDIMAGE_BLOCK_FREE
+				: (e == 1) ? VDIMAGE_BLOCK_ZERO : e;
+		}
+	}
+	free (gd);
+	free (gt);
+	return ret;
+}
+
+static int
+parseVMDK (VDImage * img, const unsigned char *h, uint64_t fileSize, int loadMap)
+{
+	unsigned char footer[SECTORSIZE];
+	uint64_t capacity, grain, nBlocks;
+	uint32_t gtes;
+	int ret;
+
+// A stream is written front to back, so its header only learns where the grain directory went
+// once everything else is written: the copy in the footer, before the end-of-stream marker, has it
+	if (le64 (h + 56) == VMDK_GD_AT_END)
+	{
+		if (fileSize < 3 * SECTORSIZE)
+			return -EINVAL;
+		if ((ret = readAt (img->fd, footer, sizeof (footer), fileSize - 2 * SECTORSIZE)) < 0)
+			return ret;
+		if (memcmp (footer, "KDMV", 4) != 0 || le64 (footer + 56) == VMDK_GD_AT_END)
+			return -EINVAL;
+		h = footer;
+	}
+	capacity = le64 (h + 12);
+	grain = le64 (h + 20);
+	gtes = le32 (h + 44);
+	if (grain == 0 || grain * SECTORSIZE > VMDK_GRAIN_MAX || gtes == 0 || gtes > 65536)
+		return -EINVAL;
+	if ((nBlocks = (capacity + grain - 1) / grain) > UINT32_MAX)
+		return -EFBIG;
+
+	img->kind = VDIMAGE_VMDK;
+	img->size = capacity * SECTORSIZE;
+	img->blockSize = grain * SECTORSIZE;
+	img->nBlocks = nBlocks;
+	img->mapOffset = le64 (h + 56) * SECTORSIZE;
+	img->compressed = (le32 (h + 8) & VMDK_FLAG_COMPRESSED) != 0;
+	if (img->compressed && (h[77] | h[78] << 8) != VMDK_COMPRESS_DEFLATE)
+		return -ENOTSUP;
+	return loadMap ? loadGrainTables (img, gtes) : 0;
+}
+
+static int
+imageOpen (VDImage * img, const char *filename, int writable, int loadMap)
+{
+	unsigned char head[VHD_FOOTER_SIZE], tail[VHD_FOOTER_SIZE];
+	struct stat st;
+	int ret = 0;
+
+	memset (img, 0, sizeof (VDImage));
+	if ((img->fd = open (filename, writable ? O_RDWR : O_RDONLY)) < 0)
+		return -errno;
+	if (fstat (img->fd, &st) < 0 || (ret = readAt (img->fd, head, sizeof (head), 0)) < 0)
+	{
+		ret = ret ? ret : -errno;
+		vdImageClose (img);
+		return ret;
+	}
+
+	if (memcmp (head, "conectix", 8) == 0)
+		ret = parseVHD (img, head, loadMap);
+	else if (memcmp (head, "<<<", 3) == 0)
+		ret = parseVDI (img, loadMap);
+	else if (memcmp (head, "KDMV", 4) == 0)
+		ret = parseVMDK (img, head, st.st_size, loadMap);
+	else if (memcmp (head, "# Disk Descriptor", 17) == 0)
+		img->kind = VDIMAGE_VMDK;
+	else if (st.st_size >= VHD_FOOTER_SIZE
+					 && readAt (img->fd, tail, sizeof (tail), st.st_size - VHD_FOOTER_SIZE) == 0
+					 && memcmp (tail, "conectix", 8) == 0)
+		ret = parseVHD (img, tail, loadMap);
+	else
+	{
+		img->kind = VDIMAGE_RAW;
+		img->size = st.st_size;
+	}
+
+	if (ret < 0)
+		vdImageClose (img);
+	return ret;
+}
+
+int
+vdImageOpen (VDImage * img, const char *filename, int writable)
+{
+	return imageOpen (img, filename, writable, 1);
+}
+
+// Reads an image's kind, size and identity without its block map.  The file is closed again, but
+// vdImageClose must still be called to free parentPath.
+int
+vdImageProbe (VDImage * img, const char *filename)
+{
+	int ret = imageOpen (img, filename, 0, 0);
+	if (ret == 0)
+	{
+		close (img->fd);
+		img->fd = -1;
+	}
+	return ret;
+}
+
+int
+vdImageHasParent (const VDImage * img)
+{
+	static const unsigned char none[16];
+	return memcmp (img->parentUuid, none, sizeof (none)) != 0;
+}
+
+void
+vdImageClose (VDImage * img)
+{
+	if (img->fd >= 0)
+		close (img->fd);
+	free (img->blockMap);
+	free (img->parentPath);
+	img->fd = -1;
+	img->blockMap = NULL;
+	img->parentPath = NULL;
+}
+
+const char *
+vdImageKindName (VDImageKind kind)
+{
+	switch (kind)
+	{
+		case VDIMAGE_RAW:
+			return "raw";
+		case VDIMAGE_VDI:
+			return "VDI";
+		case VDIMAGE_VHD_FIXED:
+			return "fixed VHD";
+		case VDIMAGE_VHD_DYNAMIC:
+			return "dynamic VHD";
+		case VDIMAGE_VHD_DIFF:
+			return "differencing VHD";
+		case VDIMAGE_VMDK:
+			return "VMDK";
+		default:
+			return "unknown";
+	}
+}
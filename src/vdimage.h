@@ -0,0 +1,65 @@
+/* Direct parsing of VD image file headers and block maps				*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef VDIMAGE_H
+#define VDIMAGE_H
+
+#include <stdint.h>
+
+// Block map entries for blocks that hold no data in this image.  A FREE block is taken from the
+// parent image (or reads as zeros in a base image), a ZERO block reads as zeros whatever the parent
+// holds.  Any other entry locates the block's data in the image file.
+#define VDIMAGE_BLOCK_FREE 0xffffffffU
+#define VDIMAGE_BLOCK_ZERO 0xfffffffeU
+
+typedef enum
+{
+	VDIMAGE_UNKNOWN = 0,
+	VDIMAGE_RAW,
+	VDIMAGE_VDI,
+	VDIMAGE_VHD_FIXED,
+	VDIMAGE_VHD_DYNAMIC,
+	VDIMAGE_VHD_DIFF,
+	VDIMAGE_VMDK
+} VDImageKind;
+
+typedef struct
+{
+	int fd;
+	VDImageKind kind;
+	uint64_t size;								// virtual disk size in bytes
+	uint32_t blockSize;						// allocation unit in bytes, 0 if the image has no block map
+	uint32_t nBlocks;
+	uint32_t *blockMap;						// VDI block index / VHD or VMDK sector offset, or a VDIMAGE_BLOCK_*
+	uint64_t mapOffset;						// file offset of the block map (VDI), BAT (VHD) or grain directory
+	uint64_t dataOffset;					// VDI: file offset of the first block
+	uint32_t blockExtra;					// VDI: bytes of per block metadata preceding each block
+	uint32_t bitmapSize;					// VHD: bytes of sector bitmap preceding each block
+	int compressed;								// VMDK: grains are deflated, each behind a marker (streamOptimized)
+	unsigned char uuid[16];				// VDI: creation UUID, VHD: unique id, zero for other images
+	unsigned char parentUuid[16];	// differencing images: the parent's uuid, otherwise zero
+	char *parentPath;							// differencing VHD: where the parent was, '/' separated, or NULL
+} VDImage;
+
+int vdImageOpen (VDImage * img, const char *filename, int writable);
+int vdImageProbe (VDImage * img, const char *filename);
+int vdImageHasParent (const VDImage * img);
+void vdImageClose (VDImage * img);
+const char *vdImageKindName (VDImageKind kind);
+
+#endif
@@ -0,0 +1,1638 @@
+/* Built-in reader / writer for raw, VDI, VHD and VMDK images			*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+/* DESCRIPTION
+ * An alternative to VBoxDDU selected with ./configure --enable-native-backend.  It sits on top of
+ * the header parsing in vdimage.c and turns every request into pread / pwrite calls on the image
+ * files, using the block maps cached in memory at open time:
+ *  *  raw and fixed VHD images map disk offsets straight onto the file
+ *  *  VDI and dynamic VHD images look each block up in the block map / BAT
+ *  *  a block a differencing image does not hold (VDI free block, VHD block that is not in the
+ *     BAT or sector not set in the block's bitmap) is read from the image below it
+ *  *  sparse VMDK images look each grain up in the grain tables, flattened into a block map.  The
+ *     grains of a streamOptimized image are deflated, see "Compressed grains" below.
+ * Writes go to the topmost image, which cannot be a VMDK.  Blocks it does not hold yet are appended
+ * to it, filled from the images below, and the block map / BAT entry, VDI header and VHD footer are
+ * updated in place.
+ *
+ * The images of a chain can be opened in parallel with vdNativeOpenLayers, as loading one block map
+ * needs nothing from the others; they are stacked in order once all are open.
+ *
+ * Reads only take the disk lock shared, so any number of threads can read at once; writes take it
+ * exclusively since they may move the end of the file and change the block maps.
+ *
+ * A request is first turned into a batch of file segments, one per block it touches (merged where
+ * blocks sit next to each other in the file), which are then read or written together: through
+ * io_uring where the kernel has it, else by a pool of threads, see "Batched file I/O" below.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#include "config.h"
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#include "vdimage.h"
+#include "vdnative.h"
+
+#define NATIVE_LAYERS_MAX 128
+#define NATIVE_OPEN_THREADS 8				// layers of a chain opened at once
+#define SECTORSIZE 512
+#define VHD_FOOTER_SIZE 512
+#define VDI_ALLOCATED_OFFSET 388		// header field counting allocated blocks
+#define GRAIN_MARKER 12							// VMDK: lba and compressed size before each grain
+#define GRAIN_CACHE_MB 64						// decompressed grains kept per disk
+#define GRAIN_BUCKETS 4096
+#define GRAIN_THREADS_MAX 16				// threads inflating grains ahead of sequential reads
+#define GRAIN_AHEAD 2								// grains inflated ahead per thread
+#define GRAIN_SEQUENTIAL 4					// a grain this close after the last one read is sequential
+#define IO_BATCH_INLINE 32					// segments a batch holds before it allocates
+#define IO_RING_ENTRIES 64					// submission queue size of each thread's io_uring
+#define IO_POOL_THREADS 8						// threads doing the segments of batches without io_uring
+#define DIRECT_ALIGN 4096						// O_DIRECT alignment, unless 512 is found to do
+#define DIRECT_BUFFER_SIZE (1024 * 1024)	// bytes of each pooled bounce buffer
+#define DIRECT_BUFFERS_MAX 64
+
+typedef struct
+{
+	VDImage img;
+	int writable;
+	uint32_t nextBlock;						// VDI: index given to the next block allocated
+	uint64_t fileEnd;							// VHD: file offset of the footer, where new blocks go
+	unsigned char footer[VHD_FOOTER_SIZE];	// VHD: footer, moved to the end after each allocation
+	uint8_t **bitmaps;						// VHD differencing: sector bitmap per block, loaded on first use
+	pthread_mutex_t bitmapLock;
+	uint32_t lastGrain;						// VMDK compressed: the grain read last
+	int directFd;									// the image opened O_DIRECT for data, or -1
+	uint32_t directAlign;					// offset, length and memory alignment directFd needs
+} NativeLayer;
+
+typedef enum
+{
+	GRAIN_FILLING,
+	GRAIN_READY,
+	GRAIN_FAILED
+} GrainState;
+
+typedef struct Grain
+{
+	int layer;
+	uint32_t blk;
+	GrainState state;
+	int refs;											// readers copying out, plus one while queued or inflating
+	char *data;										// blockSize bytes
+	struct Grain *hashNext;
+	struct Grain *lruPrev, *lruNext;	// most recently used first
+	struct Grain *queueNext;
+} Grain;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t filled;				// a grain left GRAIN_FILLING
+	pthread_cond_t work;					// a grain was queued, or stopping was set
+	Grain *buckets[GRAIN_BUCKETS];
+	Grain *lruHead, *lruTail;
+	Grain *queueHead, *queueTail;	// grains waiting for an inflating thread
+	uint64_t bytes;
+	pthread_t threads[GRAIN_THREADS_MAX];
+	int nThreads;									// started by process pid
+	pid_t pid;
+	int stopping;
+} GrainCache;
+
+struct VDNative
+{
+	NativeLayer *layers[NATIVE_LAYERS_MAX];
+	int nLayers;
+	pthread_rwlock_t lock;				// shared for reads, exclusive for writes
+	GrainCache grains;
+	VDNativeIO io;								// how batches are done, never VDNATIVE_IO_AUTO once set
+	int direct;										// open images with O_DIRECT
+};
+
+typedef struct
+{
+	NativeLayer *nl;
+	int write;
+	char *buf;
+	size_t len;
+	uint64_t offset;
+	int ret;
+} IoSegment;
+
+typedef struct IoBatch
+{
+	IoSegment *seg;
+	int n, cap;
+	IoSegment inlineSeg[IO_BATCH_INLINE];
+	int next, remaining;					// pool: next segment to take, segments not done yet
+	struct IoBatch *queueNext;
+} IoBatch;
+
+static void
+put32le (unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void
+put32be (unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Reads past the end of the file return zeros, which is what a short raw image means
+static int
+preadFull (int fd, void *buf, size_t len, uint64_t offset)
+{
+	char *p = buf;
+	while (len > 0)
+	{
+		ssize_t got = pread (fd, p, len, offset);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+			return -errno;
+		if (got == 0)
+		{
+			memset (p, 0, len);
+			break;
+		}
+		p += got;
+		offset += got;
+		len -= got;
+	}
+	return 0;
+}
+
+static int
+pwriteFull (int fd, const void *buf, size_t len, uint64_t offset)
+{
+	const char *p = buf;
+	while (len > 0)
+	{
+		ssize_t put = pwrite (fd, p, len, offset);
+		if (put < 0 && errno == EINTR)
+			continue;
+		if (put <= 0)
+			return put < 0 ? -errno : -EIO;
+		p += put;
+		offset += put;
+		len -= put;
+	}
+	return 0;
+}
+
+// O_DIRECT.  With vdNativeSetDirect each image is opened a second time with O_DIRECT, and that
+// descriptor is used for block data so that it is not cached by the host as well as by whatever
+// sits on top of vdfuse.  Headers, block maps, bitmaps and new blocks still go through the first,
+// buffered descriptor, as they are small or written once.  The kernel writes back and drops
+// cached pages before any O_DIRECT access to them, so the two descriptors stay coherent.
+//
+// O_DIRECT needs the file offset, length and memory all aligned to directAlign: 512 bytes where a
+// 512 byte read works at open, else DIRECT_ALIGN.  Aligned requests go to the file as they are.
+// Others bounce through page aligned buffers of DIRECT_BUFFER_SIZE taken from a pool shared by all
+// disks, allocated as needed up to DIRECT_BUFFERS_MAX and then reused, so no request allocates
+// memory.  A bounced write reads the partial pages at its edges before writing whole pages back,
+// and falls back to the buffered descriptor where that would extend the file.
+
+static pthread_mutex_t bufferLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bufferFree = PTHREAD_COND_INITIALIZER;
+static void *buffers[DIRECT_BUFFERS_MAX];	// free ones
+static int nFreeBuffers = 0, nBuffers = 0;
+
+// Returns a bounce buffer, waiting for one while all are in use, or NULL if none can be had
+static void *
+bufferGet (void)
+{
+	void *p = NULL;
+
+	pthread_mutex_lock (&bufferLock);
+	while (nFreeBuffers == 0)
+	{
+		if (nBuffers < DIRECT_BUFFERS_MAX && posix_memalign (&p, DIRECT_ALIGN, DIRECT_BUFFER_SIZE) == 0)
+		{
+			nBuffers++;
+			break;
+		}
+		if (nBuffers == 0)
+			break;
+		pthread_cond_wait (&bufferFree, &bufferLock);
+	}
+	if (!p && nFreeBuffers > 0)
+		p = buffers[--nFreeBuffers];
+	pthread_mutex_unlock (&bufferLock);
+	return p;
+}
+
+static void
+bufferPut (void *p)
+{
+	pthread_mutex_lock (&bufferLock);
+	buffers[nFreeBuffers++] = p;
+	pthread_cond_signal (&bufferFree);
+	pthread_mutex_unlock (&bufferLock);
+}
+
+static inline int
+directAligned (const NativeLayer * nl, const void *buf, size_t len, uint64_t offset)
+{
+	return ((offset | len | (uintptr_t) buf) & (nl->directAlign - 1)) == 0;
+}
+
+// An O_DIRECT read only comes back short at the end of the file, where the rest reads as zeros
+static int
+directRead (NativeLayer * nl, void *buf, size_t len, uint64_t offset)
+{
+	ssize_t got;
+
+	while ((got = pread (nl->directFd, buf, len, offset)) < 0 && errno == EINTR)
+		;
+	if (got < 0)
+		return -errno;
+	memset ((char *) buf + got, 0, len - got);
+	return 0;
+}
+
+// Opens the O_DIRECT descriptor of a layer, if the file system has O_DIRECT
+static void
+directOpen (NativeLayer * nl, const char *filename)
+{
+	void *probe;
+
+	nl->directFd = -1;
+	if ((probe = bufferGet ()) == NULL)
+		return;
+	if ((nl->directFd = open (filename, (nl->writable ? O_RDWR : O_RDONLY) | O_DIRECT)) >= 0)
+	{
+		nl->directAlign = SECTORSIZE;
+		if (pread (nl->directFd, (char *) probe + SECTORSIZE, SECTORSIZE, SECTORSIZE) < 0)
+		{
+			nl->directAlign = DIRECT_ALIGN;
+			if (pread (nl->directFd, probe, DIRECT_ALIGN, 0) < 0)
+			{
+				close (nl->directFd);
+				nl->directFd = -1;
+			}
+		}
+	}
+	bufferPut (probe);
+}
+
+// Reads image data, through the O_DIRECT descriptor where the layer has one
+static int
+layerRead (NativeLayer * nl, char *buf, size_t len, uint64_t offset)
+{
+	uint32_t a = nl->directAlign;
+	char *bounce;
+	int ret = 0;
+
+	if (nl->directFd < 0)
+		return preadFull (nl->img.fd, buf, len, offset);
+	if (directAligned (nl, buf, len, offset))
+		return directRead (nl, buf, len, offset);
+	if ((bounce = bufferGet ()) == NULL)
+		return preadFull (nl->img.fd, buf, len, offset);
+	while (len > 0 && ret == 0)
+	{
+		uint64_t start = offset & ~(uint64_t) (a - 1);
+		uint64_t end = (offset + len + a - 1) & ~(uint64_t) (a - 1);
+		size_t span = (end - start < DIRECT_BUFFER_SIZE) ? end - start : DIRECT_BUFFER_SIZE;
+		size_t n = (start + span - offset < len) ? start + span - offset : len;
+
+		if ((ret = directRead (nl, bounce, span, start)) == 0)
+			memcpy (buf, bounce + (offset - start), n);
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+	bufferPut (bounce);
+	return ret;
+}
+
+// Writes image data, through the O_DIRECT descriptor where the layer has one
+static int
+layerWrite (NativeLayer * nl, const char *buf, size_t len, uint64_t offset)
+{
+	uint32_t a = nl->directAlign;
+	char *bounce;
+	int ret = 0;
+
+	if (nl->directFd < 0)
+		return pwriteFull (nl->img.fd, buf, len, offset);
+	if (directAligned (nl, buf, len, offset))
+		return pwriteFull (nl->directFd, buf, len, offset);
+	if ((bounce = bufferGet ()) == NULL)
+		return pwriteFull (nl->img.fd, buf, len, offset);
+	while (len > 0 && ret == 0)
+	{
+		uint64_t start = offset & ~(uint64_t) (a - 1);
+		uint64_t end = (offset + len + a - 1) & ~(uint64_t) (a - 1);
+		size_t span = (end - start < DIRECT_BUFFER_SIZE) ? end - start : DIRECT_BUFFER_SIZE;
+		size_t n = (start + span - offset < len) ? start + span - offset : len;
+		struct stat st;
+
+		if (offset + n < start + span
+				&& (fstat (nl->directFd, &st) < 0 || (uint64_t) st.st_size < start + span))
+			ret = pwriteFull (nl->img.fd, buf, n, offset);	// whole pages would reach past the end
+		else
+		{
+			if (start < offset)
+				ret = directRead (nl, bounce, a, start);
+			if (ret == 0 && offset + n < start + span && (span > a || start == offset))
+				ret = directRead (nl, bounce + span - a, a, start + span - a);
+			memcpy (bounce + (offset - start), buf, n);
+			if (ret == 0)
+				ret = pwriteFull (nl->directFd, bounce, span, start);
+		}
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+	bufferPut (bounce);
+	return ret;
+}
+
+// Batched file I/O.  A read or write of the disk is collected into an IoBatch of file segments
+// first and done in one go by ioRun, so a request spanning many scattered blocks waits about as
+// long as its slowest segment rather than the sum of them.  A batch of one segment is just done on
+// the spot.
+//  *  io_uring: every thread that runs batches gets its own ring, set up with raw syscalls on its
+//     first batch and torn down when it exits.  All segments of a batch are submitted with one
+//     io_uring_enter, which then waits for them.  A segment the ring leaves short or fails (an old
+//     kernel without IORING_OP_READ, say) is finished with pread / pwrite.
+//  *  threads: the batch is queued for a pool of IO_POOL_THREADS threads, started on first use and
+//     shared by every disk, and the calling thread takes segments from it too.
+//  *  sync: the segments are done one after the other.
+// VDNATIVE_IO_AUTO picks io_uring if the kernel lets the first thread set up a ring, else threads.
+
+static void
+batchInit (IoBatch * b)
+{
+	b->seg = b->inlineSeg;
+	b->n = 0;
+	b->cap = IO_BATCH_INLINE;
+}
+
+static void
+batchFree (IoBatch * b)
+{
+	if (b->seg != b->inlineSeg)
+		free (b->seg);
+}
+
+static int
+segmentRun (IoSegment * s)
+{
+	return s->write ? layerWrite (s->nl, s->buf, s->len, s->offset)
+		: layerRead (s->nl, s->buf, s->len, s->offset);
+}
+
+// Whether the segment can go to the file as it is, rather than bounce through a buffer
+static inline int
+segmentPlain (const IoSegment * s)
+{
+	return s->nl->directFd < 0 || directAligned (s->nl, s->buf, s->len, s->offset);
+}
+
+// Adds a segment, merged into the last one where it carries on from it in the file and in memory.
+// If the batch cannot grow the segment is done at once instead.
+static int
+batchAdd (IoBatch * b, NativeLayer * nl, int write, void *buf, size_t len, uint64_t offset)
+{
+	IoSegment *s = b->n ? b->seg + b->n - 1 : NULL;
+
+	if (s && s->nl == nl && s->write == write && s->offset + s->len == offset
+			&& s->buf + s->len == buf)
+	{
+		s->len += len;
+		return 0;
+	}
+	if (b->n == b->cap)
+	{
+		IoSegment *grown = malloc (2 * b->cap * sizeof (IoSegment));
+		if (!grown)
+		{
+			IoSegment now = { nl, write, buf, len, offset, 0 };
+			return segmentRun (&now);
+		}
+		memcpy (grown, b->seg, b->n * sizeof (IoSegment));
+		batchFree (b);
+		b->seg = grown;
+		b->cap *= 2;
+	}
+	s = b->seg + b->n++;
+	s->nl = nl;
+	s->write = write;
+	s->buf = buf;
+	s->len = len;
+	s->offset = offset;
+	s->ret = 0;
+	return 0;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+typedef struct
+{
+	int fd;
+	void *sq, *cq;
+	size_t sqSize, cqSize;
+	struct io_uring_sqe *sqes;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned entries;
+} IoRing;
+
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static int ringUnavailable = 0;	// io_uring_setup or a ring failed, so no thread sets one up again
+
+static void
+ringFree (void *arg)
+{
+	IoRing *r = arg;
+
+	if (r->sqes)
+		munmap (r->sqes, r->entries * sizeof (struct io_uring_sqe));
+	if (r->cq && r->cq != r->sq)
+		munmap (r->cq, r->cqSize);
+	if (r->sq)
+		munmap (r->sq, r->sqSize);
+	close (r->fd);
+	free (r);
+}
+
+static void
+ringKeyCreate (void)
+{
+	pthread_key_create (&ringKey, ringFree);
+}
+
+static void *
+ringMap (int fd, size_t size, off_t what)
+{
+	void *p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+// Returns the calling thread's ring, setting it up on first use, or NULL without io_uring
+static IoRing *
+ringGet (void)
+{
+	struct io_uring_params p;
+	IoRing *r;
+	int fd;
+
+	pthread_once (&ringOnce, ringKeyCreate);
+	if ((r = pthread_getspecific (ringKey)) != NULL || ringUnavailable)
+		return r;
+	memset (&p, 0, sizeof (p));
+	if ((fd = syscall (__NR_io_uring_setup, IO_RING_ENTRIES, &p)) < 0)
+	{
+		ringUnavailable = 1;
+		return NULL;
+	}
+	if ((r = calloc (1, sizeof (IoRing))) == NULL)
+	{
+		close (fd);
+		return NULL;
+	}
+	r->fd = fd;
+	r->entries = p.sq_entries;
+	r->sqSize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cqSize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sqSize = r->cqSize = (r->sqSize > r->cqSize) ? r->sqSize : r->cqSize;
+	r->sq = ringMap (fd, r->sqSize, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq = r->sq;
+	else
+		r->cq = ringMap (fd, r->cqSize, IORING_OFF_CQ_RING);
+	r->sqes = ringMap (fd, r->entries * sizeof (struct io_uring_sqe), IORING_OFF_SQES);
+	if (!r->sq || !r->cq || !r->sqes)
+	{
+		ringFree (r);
+		ringUnavailable = 1;
+		return NULL;
+	}
+	r->sqHead = (unsigned *) ((char *) r->sq + p.sq_off.head);
+	r->sqTail = (unsigned *) ((char *) r->sq + p.sq_off.tail);
+	r->sqMask = (unsigned *) ((char *) r->sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *) ((char *) r->sq + p.sq_off.array);
+	r->cqHead = (unsigned *) ((char *) r->cq + p.cq_off.head);
+	r->cqTail = (unsigned *) ((char *) r->cq + p.cq_off.tail);
+	r->cqMask = (unsigned *) ((char *) r->cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq + p.cq_off.cqes);
+	pthread_setspecific (ringKey, r);
+	return r;
+}
+
+// Submits up to r->entries segments at once and waits for all of them.  Segments that have to
+// bounce are done while the others are in flight.  If io_uring_enter fails, the segments the
+// kernel has not taken yet are taken back, those it has are still waited for by watching the
+// completion queue, as their buffers go back to the caller, and all of them are done again here.
+// The thread's ring is then closed and -errno returned; the segments are done either way.
+static int
+ringRun (IoRing * r, IoSegment * seg, int n)
+{
+	unsigned tail = *r->sqTail, head;
+	int queued = 0, submitted = 0, done = 0, failed = 0, got, i;
+
+	for (i = 0; i < n; i++)
+	{
+		unsigned idx = tail & *r->sqMask;
+		struct io_uring_sqe *sqe = r->sqes + idx;
+		if (!segmentPlain (seg + i))
+			continue;
+		memset (sqe, 0, sizeof (*sqe));
+		sqe->opcode = seg[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = (seg[i].nl->directFd >= 0) ? seg[i].nl->directFd : seg[i].nl->img.fd;
+		sqe->off = seg[i].offset;
+		sqe->addr = (uintptr_t) seg[i].buf;
+		sqe->len = seg[i].len;
+		sqe->user_data = i;
+		r->sqArray[idx] = idx;
+		seg[i].ret = 1;							// in the ring
+		tail++;
+		queued++;
+	}
+	__atomic_store_n (r->sqTail, tail, __ATOMIC_RELEASE);
+	if (queued > 0 && (got = syscall (__NR_io_uring_enter, r->fd, queued, 0, 0, NULL, 0)) > 0)
+		submitted = got;
+	for (i = 0; i < n; i++)
+		if (!segmentPlain (seg + i))
+			seg[i].ret = segmentRun (seg + i);
+
+	while (done < queued)
+	{
+		if (failed)
+		{
+			struct timespec pause = { 0, 100000 };
+			nanosleep (&pause, NULL);
+		}
+		else if ((got = syscall (__NR_io_uring_enter, r->fd, queued - submitted, 1,
+														 IORING_ENTER_GETEVENTS, NULL, 0)) > 0)
+			submitted += got;
+		else if (got < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+// Without SQPOLL the kernel only takes entries inside io_uring_enter, so the tail can be moved back
+			failed = -errno;
+			head = __atomic_load_n (r->sqHead, __ATOMIC_ACQUIRE);
+			queued -= tail - head;
+			__atomic_store_n (r->sqTail, head, __ATOMIC_RELEASE);
+		}
+		head = *r->cqHead;
+		while (head != __atomic_load_n (r->cqTail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = r->cqes + (head++ & *r->cqMask);
+			IoSegment *s = seg + cqe->user_data;
+			s->ret = (cqe->res < 0) ? cqe->res : 0;
+			if (cqe->res >= 0 && (size_t) cqe->res < s->len)
+			{
+				IoSegment rest = { s->nl, s->write, s->buf + cqe->res, s->len - cqe->res,
+					s->offset + cqe->res, 0
+				};
+				s->ret = segmentRun (&rest);
+			}
+			done++;
+		}
+		__atomic_store_n (r->cqHead, head, __ATOMIC_RELEASE);
+	}
+	for (i = 0; i < n; i++)
+		if (seg[i].ret != 0 && segmentPlain (seg + i))
+			seg[i].ret = segmentRun (seg + i);
+	if (failed)
+	{
+		ringUnavailable = 1;
+		pthread_setspecific (ringKey, NULL);
+		ringFree (r);
+	}
+	return failed;
+}
+#endif
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static IoBatch *poolHead = NULL, *poolTail = NULL;
+static int poolThreads = 0;
+
+// Takes the next segment of the oldest queued batch, with poolLock held
+static IoSegment *
+poolTake (IoBatch ** batch)
+{
+	IoBatch *b = poolHead;
+	IoSegment *s;
+
+	if (!b)
+		return NULL;
+	s = b->seg + b->next++;
+	if (b->next == b->n && (poolHead = b->queueNext) == NULL)
+		poolTail = NULL;
+	*batch = b;
+	return s;
+}
+
+// Does a segment taken from b, and returns with poolLock held
+static void
+poolFinish (IoBatch * b, IoSegment * s)
+{
+	s->ret = segmentRun (s);
+	pthread_mutex_lock (&poolLock);
+	if (--b->remaining == 0)
+		pthread_cond_broadcast (&poolDone);
+}
+
+static void *
+poolThread (void *arg)
+{
+	IoBatch *b;
+	IoSegment *s;
+
+	pthread_mutex_lock (&poolLock);
+	for (;;)
+	{
+		if ((s = poolTake (&b)) == NULL)
+		{
+			pthread_cond_wait (&poolWork, &poolLock);
+			continue;
+		}
+		pthread_mutex_unlock (&poolLock);
+		poolFinish (b, s);
+	}
+	return arg;
+}
+
+static void
+poolRun (IoBatch * b)
+{
+	IoBatch *from;
+	IoSegment *s;
+
+	pthread_mutex_lock (&poolLock);
+	while (poolThreads < IO_POOL_THREADS)
+	{
+		pthread_t t;
+		if (pthread_create (&t, NULL, poolThread, NULL) != 0)
+			break;
+		pthread_detach (t);
+		poolThreads++;
+	}
+	b->next = 0;
+	b->remaining = b->n;
+	b->queueNext = NULL;
+	if (poolTail)
+		poolTail->queueNext = b;
+	else
+		poolHead = b;
+	poolTail = b;
+	pthread_cond_broadcast (&poolWork);
+
+// Lend a hand with this batch rather than wait idle, then wait for the segments others took
+	while (b->next < b->n && (s = poolTake (&from)) != NULL)
+	{
+		pthread_mutex_unlock (&poolLock);
+		poolFinish (from, s);
+	}
+	while (b->remaining > 0)
+		pthread_cond_wait (&poolDone, &poolLock);
+	pthread_mutex_unlock (&poolLock);
+}
+
+// Does every segment of the batch and returns the first error
+static int
+ioRun (VDNative * d, IoBatch * b)
+{
+	int i, n = b->n, ret = 0;
+#ifdef HAVE_LINUX_IO_URING_H
+	IoRing *r = (b->n > 1 && d->io == VDNATIVE_IO_URING) ? ringGet () : NULL;
+#endif
+
+// A bounced write rewrites whole pages, which the segments next to it may share, so those writes
+// are moved to the end and done one by one once the others are done
+	if (d->direct)
+		for (i = n - 1; i >= 0; i--)
+			if (b->seg[i].write && !segmentPlain (b->seg + i))
+			{
+				IoSegment s = b->seg[i];
+				memmove (b->seg + i, b->seg + i + 1, (b->n - i - 1) * sizeof (IoSegment));
+				b->seg[b->n - 1] = s;
+				n--;
+			}
+
+	if (n <= 1 || d->io == VDNATIVE_IO_SYNC)
+		n = 0;
+#ifdef HAVE_LINUX_IO_URING_H
+	else if (r)
+	{
+		int k, entries = r->entries;
+// Once the ring has failed, the segments after the ones it did are left to the loop below
+		for (i = 0; i < n; i += k)
+			if (ringRun (r, b->seg + i, k = (n - i < entries) ? n - i : entries) < 0)
+			{
+				n = i + k;
+				break;
+			}
+	}
+#endif
+	else
+	{
+		int all = b->n;
+		b->n = n;
+		poolRun (b);
+		b->n = all;
+	}
+	for (i = n; i < b->n; i++)
+		b->seg[i].ret = segmentRun (b->seg + i);
+	for (i = 0; i < b->n && ret == 0; i++)
+		ret = b->seg[i].ret;
+	b->n = 0;
+	return ret;
+}
+
+static uint32_t
+get32le (const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+get64le (const unsigned char *p)
+{
+	return get32le (p) | ((uint64_t) get32le (p + 4) << 32);
+}
+
+static inline int
+sectorPresent (const uint8_t * bitmap, uint32_t sector)
+{
+	return (bitmap[sector >> 3] >> (7 - (sector & 7))) & 1;	// VHD bitmaps are MSB first
+}
+
+static uint8_t *
+loadBitmap (NativeLayer * nl, uint64_t blk)
+{
+	uint8_t *bm;
+
+	pthread_mutex_lock (&nl->bitmapLock);
+	if ((bm = nl->bitmaps[blk]) == NULL && (bm = malloc (nl->img.bitmapSize)) != NULL)
+	{
+		if (preadFull (nl->img.fd, bm, nl->img.bitmapSize,
+									 (uint64_t) nl->img.blockMap[blk] * SECTORSIZE) < 0)
+		{
+			free (bm);
+			bm = NULL;
+		}
+		nl->bitmaps[blk] = bm;
+	}
+	pthread_mutex_unlock (&nl->bitmapLock);
+	return bm;
+}
+
+static int readLayer (VDNative * d, int l, uint64_t offset, char *buf, size_t len, IoBatch * b);
+
+// Reads part of an allocated VHD differencing block, sector run by sector run
+static int
+readDiffBlock (VDNative * d, int l, uint64_t blk, uint32_t in, char *buf, size_t len, IoBatch * b)
+{
+	NativeLayer *nl = d->layers[l];
+	uint64_t blockStart = blk * nl->img.blockSize;
+	uint64_t data = (uint64_t) nl->img.blockMap[blk] * SECTORSIZE + nl->img.bitmapSize;
+	uint8_t *bm = loadBitmap (nl, blk);
+	uint32_t pos = in, end = in + len;
+	int ret = 0;
+
+	if (!bm)
+		return -EIO;
+	while (pos < end && ret == 0)
+	{
+		int present = sectorPresent (bm, pos / SECTORSIZE);
+		uint32_t next = (pos / SECTORSIZE + 1) * SECTORSIZE;
+		while (next < end && sectorPresent (bm, next / SECTORSIZE) == present)
+			next += SECTORSIZE;
+		if (next > end)
+			next = end;
+		if (present)
+			ret = batchAdd (b, nl, 0, buf + (pos - in), next - pos, data + pos);
+		else
+			ret = readLayer (d, l - 1, blockStart + pos, buf + (pos - in), next - pos, b);
+		pos = next;
+	}
+	return ret;
+}
+
+// Compressed grains.  Each grain of a streamOptimized VMDK is deflated on its own, so reading any
+// part of one means inflating all of it.  Inflated grains are kept in an LRU of GRAIN_CACHE_MB per
+// disk, found by layer and grain.  A grain being inflated is in the cache already, in GRAIN_FILLING
+// state, and other readers of it wait for it instead of inflating it again.  When a layer is read
+// sequentially the grains after the one read are queued for a pool of threads, one per core up to
+// GRAIN_THREADS_MAX, so a scan is not held to one core's worth of zlib.  The pool is started by
+// the first sequential read and works without the disk lock: compressed layers are never written
+// and only go away in vdNativeClose, once the pool has stopped.
+
+static int
+inflateGrain (NativeLayer * nl, uint32_t blk, char *out)
+{
+	VDImage *img = &nl->img;
+	uint64_t pos = (uint64_t) img->blockMap[blk] * SECTORSIZE;
+	size_t cap = GRAIN_MARKER + compressBound (img->blockSize);
+	size_t head = (cap < 4096) ? cap : 4096;
+	unsigned char *in = malloc (cap);
+	uLongf outLen = img->blockSize;
+	uint32_t size = 0;
+	int ret;
+
+	if (!in)
+		return -ENOMEM;
+// The first read takes the marker and, for most grains, all of the data after it
+	if ((ret = layerRead (nl, (char *) in, head, pos)) == 0)
+	{
+		size = get32le (in + 8);
+		if (get64le (in) != (uint64_t) blk * (img->blockSize / SECTORSIZE) || size > cap - GRAIN_MARKER)
+			ret = -EIO;
+	}
+	if (ret == 0 && GRAIN_MARKER + size > head)
+		ret = layerRead (nl, (char *) in + head, GRAIN_MARKER + size - head, pos + head);
+	if (ret == 0 && uncompress ((Bytef *) out, &outLen, in + GRAIN_MARKER, size) != Z_OK)
+		ret = -EIO;
+	if (ret == 0)
+		memset (out + outLen, 0, img->blockSize - outLen);
+	free (in);
+	return ret;
+}
+
+static inline Grain **
+grainBucket (GrainCache * gc, int layer, uint32_t blk)
+{
+	return &gc->buckets[(blk * 2654435761U + layer) % GRAIN_BUCKETS];
+}
+
+static Grain *
+grainFind (GrainCache * gc, int layer, uint32_t blk)
+{
+	Grain *g;
+
+	for (g = *grainBucket (gc, layer, blk); g; g = g->hashNext)
+		if (g->layer == layer && g->blk == blk)
+			return g;
+	return NULL;
+}
+
+static void
+lruUnlink (GrainCache * gc, Grain * g)
+{
+	if (g->lruPrev)
+		g->lruPrev->lruNext = g->lruNext;
+	else
+		gc->lruHead = g->lruNext;
+	if (g->lruNext)
+		g->lruNext->lruPrev = g->lruPrev;
+	else
+		gc->lruTail = g->lruPrev;
+}
+
+static void
+lruPushFront (GrainCache * gc, Grain * g)
+{
+	g->lruPrev = NULL;
+	g->lruNext = gc->lruHead;
+	if (gc->lruHead)
+		gc->lruHead->lruPrev = g;
+	else
+		gc->lruTail = g;
+	gc->lruHead = g;
+}
+
+static void
+grainFree (GrainCache * gc, Grain * g, uint32_t blockSize)
+{
+	Grain **p = grainBucket (gc, g->layer, g->blk);
+
+	while (*p != g)
+		p = &(*p)->hashNext;
+	*p = g->hashNext;
+	lruUnlink (gc, g);
+	gc->bytes -= blockSize;
+	free (g->data);
+	free (g);
+}
+
+// Drops the least recently used grains nobody holds until size more bytes fit the cache
+static void
+grainEvict (VDNative * d, uint64_t size)
+{
+	GrainCache *gc = &d->grains;
+	Grain *g = gc->lruTail, *prev;
+
+	for (; g && gc->bytes + size > (uint64_t) GRAIN_CACHE_MB * 1024 * 1024; g = prev)
+	{
+		prev = g->lruPrev;
+		if (g->refs == 0)
+			grainFree (gc, g, d->layers[g->layer]->img.blockSize);
+	}
+}
+
+// Adds grain blk of layer l in GRAIN_FILLING state, held once for whoever fills it
+static Grain *
+grainInsert (VDNative * d, int l, uint32_t blk)
+{
+	GrainCache *gc = &d->grains;
+	uint32_t size = d->layers[l]->img.blockSize;
+	Grain **bucket = grainBucket (gc, l, blk);
+	Grain *g;
+
+	grainEvict (d, size);
+	if ((g = calloc (1, sizeof (Grain))) == NULL || (g->data = malloc (size)) == NULL)
+	{
+		free (g);
+		return NULL;
+	}
+	g->layer = l;
+	g->blk = blk;
+	g->state = GRAIN_FILLING;
+	g->refs = 1;
+	g->hashNext = *bucket;
+	*bucket = g;
+	lruPushFront (gc, g);
+	gc->bytes += size;
+	return g;
+}
+
+// Lets go of a grain; one that failed to inflate is dropped so that the next read tries again
+static void
+grainRelease (VDNative * d, Grain * g)
+{
+	if (--g->refs == 0 && g->state == GRAIN_FAILED)
+		grainFree (&d->grains, g, d->layers[g->layer]->img.blockSize);
+}
+
+static void *
+grainThread (void *arg)
+{
+	VDNative *d = arg;
+	GrainCache *gc = &d->grains;
+	Grain *g;
+	int ret;
+
+	pthread_mutex_lock (&gc->lock);
+	while (!gc->stopping)
+	{
+		if ((g = gc->queueHead) == NULL)
+		{
+			pthread_cond_wait (&gc->work, &gc->lock);
+			continue;
+		}
+		if ((gc->queueHead = g->queueNext) == NULL)
+			gc->queueTail = NULL;
+		pthread_mutex_unlock (&gc->lock);
+		ret = inflateGrain (d->layers[g->layer], g->blk, g->data);
+		pthread_mutex_lock (&gc->lock);
+		g->state = (ret < 0) ? GRAIN_FAILED : GRAIN_READY;
+		pthread_cond_broadcast (&gc->filled);
+		grainRelease (d, g);
+	}
+	pthread_mutex_unlock (&gc->lock);
+	return NULL;
+}
+
+// Starts the inflating threads, with gc->lock held.  Not done at open, as vdfuse opens images
+// before fuse daemonises and threads do not survive the fork; those started by the parent are
+// forgotten.
+static void
+grainStart (VDNative * d)
+{
+	GrainCache *gc = &d->grains;
+	long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	int want = (cpus < 1) ? 1 : (cpus > GRAIN_THREADS_MAX) ? GRAIN_THREADS_MAX : cpus;
+
+	gc->pid = getpid ();
+	gc->nThreads = 0;
+	while (gc->nThreads < want
+				 && pthread_create (&gc->threads[gc->nThreads], NULL, grainThread, d) == 0)
+		gc->nThreads++;
+}
+
+// Queues the allocated grains from "from" on that are not cached yet for the inflating threads
+static void
+grainReadAhead (VDNative * d, int l, uint32_t from)
+{
+	GrainCache *gc = &d->grains;
+	VDImage *img = &d->layers[l]->img;
+	uint64_t fit = (uint64_t) GRAIN_CACHE_MB * 1024 * 1024 / 4 / img->blockSize;
+	uint64_t ahead, b;
+	Grain *g;
+
+	if (gc->pid != getpid ())
+		grainStart (d);
+	ahead = (uint64_t) gc->nThreads * GRAIN_AHEAD;
+	if (ahead > fit)
+		ahead = fit;								// leave most of the cache to grains that were read
+	for (b = from; b < from + ahead && b < img->nBlocks; b++)
+	{
+		if (img->blockMap[b] >= VDIMAGE_BLOCK_ZERO || grainFind (gc, l, b))
+			continue;
+		if ((g = grainInsert (d, l, b)) == NULL)
+			break;
+		g->queueNext = NULL;
+		if (gc->queueTail)
+			gc->queueTail->queueNext = g;
+		else
+			gc->queueHead = g;
+		gc->queueTail = g;
+		pthread_cond_signal (&gc->work);
+	}
+}
+
+static void
+grainStop (VDNative * d)
+{
+	GrainCache *gc = &d->grains;
+	int t;
+
+	pthread_mutex_lock (&gc->lock);
+	gc->stopping = 1;
+	pthread_cond_broadcast (&gc->work);
+	pthread_mutex_unlock (&gc->lock);
+	for (t = 0; gc->pid == getpid () && t < gc->nThreads; t++)
+		pthread_join (gc->threads[t], NULL);
+	while (gc->lruHead)
+		grainFree (gc, gc->lruHead, d->layers[gc->lruHead->layer]->img.blockSize);
+	gc->queueHead = gc->queueTail = NULL;
+	gc->nThreads = 0;
+	gc->pid = 0;
+	gc->stopping = 0;
+}
+
+// Copies [in, in + len) of compressed grain blk of image l into buf, inflating it unless cached
+static int
+readGrain (VDNative * d, int l, uint32_t blk, uint32_t in, char *buf, size_t len)
+{
+	GrainCache *gc = &d->grains;
+	NativeLayer *nl = d->layers[l];
+	uint32_t prev = __sync_lock_test_and_set (&nl->lastGrain, blk);
+	int ret = 0, fill = 0;
+	Grain *g;
+
+	pthread_mutex_lock (&gc->lock);
+	if ((g = grainFind (gc, l, blk)) != NULL)
+	{
+		g->refs++;
+		lruUnlink (gc, g);
+		lruPushFront (gc, g);
+	}
+	else
+		fill = ((g = grainInsert (d, l, blk)) != NULL);
+	if (blk - prev - 1 < GRAIN_SEQUENTIAL)
+		grainReadAhead (d, l, blk + 1);
+	while (g && g->state == GRAIN_FILLING && !fill)
+		pthread_cond_wait (&gc->filled, &gc->lock);
+	pthread_mutex_unlock (&gc->lock);
+	if (!g)
+		return -ENOMEM;
+
+	if (fill)
+	{
+		ret = inflateGrain (nl, blk, g->data);
+		pthread_mutex_lock (&gc->lock);
+		g->state = (ret < 0) ? GRAIN_FAILED : GRAIN_READY;
+		pthread_cond_broadcast (&gc->filled);
+		pthread_mutex_unlock (&gc->lock);
+	}
+	if (g->state == GRAIN_READY)
+		memcpy (buf, g->data + in, len);
+	else if (ret == 0)
+		ret = -EIO;
+	pthread_mutex_lock (&gc->lock);
+	grainRelease (d, g);
+	pthread_mutex_unlock (&gc->lock);
+	return ret;
+}
+
+// Adds the reads from image l of the chain to b, falling through to l - 1 for what it does not
+// hold.  Compressed grains are copied out of the grain cache straight away.
+static int
+readLayer (VDNative * d, int l, uint64_t offset, char *buf, size_t len, IoBatch * b)
+{
+	NativeLayer *nl;
+	VDImage *img;
+	int ret = 0;
+
+	if (l < 0)
+	{
+		memset (buf, 0, len);
+		return 0;
+	}
+	nl = d->layers[l];
+	img = &nl->img;
+	if (!img->blockMap)
+		return batchAdd (b, nl, 0, buf, len, offset);
+
+	while (len > 0 && ret == 0)
+	{
+		uint64_t blk = offset / img->blockSize;
+		uint32_t in = offset % img->blockSize;
+		size_t n = (len < img->blockSize - in) ? len : img->blockSize - in;
+		uint32_t e = (blk < img->nBlocks) ? img->blockMap[blk] : VDIMAGE_BLOCK_FREE;
+
+		if (e == VDIMAGE_BLOCK_FREE)
+			ret = readLayer (d, l - 1, offset, buf, n, b);
+		else if (e == VDIMAGE_BLOCK_ZERO)
+			memset (buf, 0, n);
+		else if (img->compressed)
+			ret = readGrain (d, l, blk, in, buf, n);
+		else if (img->kind == VDIMAGE_VDI)
+			ret = batchAdd (b, nl, 0, buf, n, img->dataOffset
+											+ (uint64_t) e * (img->blockSize + img->blockExtra)
+											+ img->blockExtra + in);
+		else if (img->kind == VDIMAGE_VHD_DIFF)
+			ret = readDiffBlock (d, l, blk, in, buf, n, b);
+		else
+			ret = batchAdd (b, nl, 0, buf, n, (uint64_t) e * SECTORSIZE + img->bitmapSize + in);
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+	return ret;
+}
+
+// Reads from image l of the chain and waits for the data
+static int
+readLayerNow (VDNative * d, int l, uint64_t offset, char *buf, size_t len)
+{
+	IoBatch b;
+	int ret;
+
+	batchInit (&b);
+	if ((ret = readLayer (d, l, offset, buf, len, &b)) == 0)
+		ret = ioRun (d, &b);
+	batchFree (&b);
+	return ret;
+}
+
+// Gives block blk of the top image (l) its own storage, initialised from the images below
+static int
+allocateBlock (VDNative * d, int l, uint64_t blk)
+{
+	NativeLayer *nl = d->layers[l];
+	VDImage *img = &nl->img;
+	uint32_t e = img->blockMap[blk];
+	unsigned char entry[4];
+	size_t cb;
+	char *block;
+	int ret;
+
+	if (img->kind == VDIMAGE_VDI)
+	{
+		uint64_t pos = img->dataOffset + (uint64_t) nl->nextBlock * (img->blockSize + img->blockExtra);
+		cb = img->blockExtra + img->blockSize;
+		if ((block = calloc (1, cb)) == NULL)
+			return -ENOMEM;
+		ret = 0;
+		if (e == VDIMAGE_BLOCK_FREE)
+			ret = readLayerNow (d, l - 1, blk * img->blockSize, block + img->blockExtra, img->blockSize);
+		if (ret == 0)
+			ret = pwriteFull (img->fd, block, cb, pos);
+		free (block);
+		if (ret < 0)
+			return ret;
+
+		put32le (entry, nl->nextBlock);
+		if ((ret = pwriteFull (img->fd, entry, 4, img->mapOffset + blk * 4)) < 0)
+			return ret;
+		img->blockMap[blk] = nl->nextBlock++;
+		put32le (entry, nl->nextBlock);
+		return pwriteFull (img->fd, entry, 4, VDI_ALLOCATED_OFFSET);
+	}
+
+// VHD: the block goes where the footer was, preceded by its sector bitmap.  In a dynamic image
+// every sector is marked present and the block starts out zeroed; in a differencing image no
+// sector is present yet so reads keep going to the parent until they are written.
+	cb = img->bitmapSize + img->blockSize;
+	if ((block = calloc (1, cb)) == NULL)
+		return -ENOMEM;
+	if (img->kind == VDIMAGE_VHD_DYNAMIC)
+		memset (block, 0xff, img->bitmapSize);
+	ret = pwriteFull (img->fd, block, cb, nl->fileEnd);
+	if (ret == 0)
+		ret = pwriteFull (img->fd, nl->footer, VHD_FOOTER_SIZE, nl->fileEnd + cb);
+	if (ret == 0 && img->kind == VDIMAGE_VHD_DIFF)
+	{
+		nl->bitmaps[blk] = malloc (img->bitmapSize);
+		if (nl->bitmaps[blk])
+			memcpy (nl->bitmaps[blk], block, img->bitmapSize);
+	}
+	free (block);
+	if (ret < 0)
+		return ret;
+
+	put32be (entry, nl->fileEnd / SECTORSIZE);
+	if ((ret = pwriteFull (img->fd, entry, 4, img->mapOffset + blk * 4)) < 0)
+		return ret;
+	img->blockMap[blk] = nl->fileEnd / SECTORSIZE;
+	nl->fileEnd += cb;
+	return 0;
+}
+
+// Writes into an allocated VHD differencing block.  The write is widened to whole sectors, taking
+// the edges from wherever they are currently read from, then the sectors are marked present.
+static int
+writeDiffBlock (VDNative * d, int l, uint64_t blk, uint32_t in, const char *buf, size_t len)
+{
+	NativeLayer *nl = d->layers[l];
+	VDImage *img = &nl->img;
+	uint64_t bitmapPos = (uint64_t) img->blockMap[blk] * SECTORSIZE;
+	uint32_t first = in / SECTORSIZE, last = (in + len - 1) / SECTORSIZE, s;
+	size_t cb = (last - first + 1) * SECTORSIZE;
+	uint8_t *bm = loadBitmap (nl, blk);
+	char *sectors;
+	IoBatch b;
+	int ret = 0;
+
+	if (!bm || (sectors = malloc (cb)) == NULL)
+		return bm ? -ENOMEM : -EIO;
+	batchInit (&b);
+	if (in % SECTORSIZE)
+		ret = readDiffBlock (d, l, blk, first * SECTORSIZE, sectors, SECTORSIZE, &b);
+	if (ret == 0 && (in + len) % SECTORSIZE)
+		ret = readDiffBlock (d, l, blk, last * SECTORSIZE, sectors + cb - SECTORSIZE, SECTORSIZE, &b);
+	if (ret == 0)
+		ret = ioRun (d, &b);
+	batchFree (&b);
+	memcpy (sectors + in % SECTORSIZE, buf, len);
+	if (ret == 0)
+		ret = layerWrite (nl, sectors, cb, bitmapPos + img->bitmapSize + first * SECTORSIZE);
+	free (sectors);
+	if (ret < 0)
+		return ret;
+
+	pthread_mutex_lock (&nl->bitmapLock);
+	for (s = first; s <= last; s++)
+		bm[s >> 3] |= 0x80 >> (s & 7);
+	pthread_mutex_unlock (&nl->bitmapLock);
+	return pwriteFull (img->fd, bm + first / 8, last / 8 - first / 8 + 1, bitmapPos + first / 8);
+}
+
+// Blocks are allocated as the write gets to them, while their data is batched and written at the
+// end.  Writes to a VHD differencing block are not batched, since its bitmap may only say a sector
+// is present once the sector is written.
+static int
+writeLayer (VDNative * d, int l, uint64_t offset, const char *buf, size_t len)
+{
+	NativeLayer *nl = d->layers[l];
+	VDImage *img = &nl->img;
+	IoBatch b;
+	int ret = 0;
+
+	if (!img->blockMap)
+		return layerWrite (nl, buf, len, offset);
+
+	batchInit (&b);
+	while (len > 0 && ret == 0)
+	{
+		uint64_t blk = offset / img->blockSize;
+		uint32_t in = offset % img->blockSize;
+		size_t n = (len < img->blockSize - in) ? len : img->blockSize - in;
+		uint32_t e;
+
+		if (blk >= img->nBlocks)
+		{
+			ret = -EINVAL;
+			break;
+		}
+		e = img->blockMap[blk];
+		if ((e == VDIMAGE_BLOCK_FREE || e == VDIMAGE_BLOCK_ZERO)
+				&& (ret = allocateBlock (d, l, blk)) < 0)
+			break;
+		e = img->blockMap[blk];
+
+		if (img->kind == VDIMAGE_VDI)
+			ret = batchAdd (&b, nl, 1, (char *) buf, n, img->dataOffset
+											+ (uint64_t) e * (img->blockSize + img->blockExtra)
+											+ img->blockExtra + in);
+		else if (img->kind == VDIMAGE_VHD_DIFF)
+			ret = writeDiffBlock (d, l, blk, in, buf, n);
+		else
+			ret = batchAdd (&b, nl, 1, (char *) buf, n,
+											(uint64_t) e * SECTORSIZE + img->bitmapSize + in);
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+	if (ret == 0)
+		ret = ioRun (d, &b);
+	batchFree (&b);
+	return ret;
+}
+
+int
+vdNativeCreate (VDNative ** disk)
+{
+	VDNative *d = calloc (1, sizeof (VDNative));
+	if (!d)
+		return -ENOMEM;
+	pthread_rwlock_init (&d->lock, NULL);
+	pthread_mutex_init (&d->grains.lock, NULL);
+	pthread_cond_init (&d->grains.filled, NULL);
+	pthread_cond_init (&d->grains.work, NULL);
+	vdNativeSetIO (d, VDNATIVE_IO_AUTO);
+	*disk = d;
+	return 0;
+}
+
+int
+vdNativeSetIO (VDNative * d, VDNativeIO io)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if ((io == VDNATIVE_IO_AUTO || io == VDNATIVE_IO_URING) && ringGet ())
+	{
+		d->io = VDNATIVE_IO_URING;
+		return 0;
+	}
+#endif
+	if (io == VDNATIVE_IO_URING)
+		return -ENOSYS;
+	d->io = (io == VDNATIVE_IO_AUTO) ? VDNATIVE_IO_THREADS : io;
+	return 0;
+}
+
+static void
+layerFree (NativeLayer * nl)
+{
+	uint32_t b;
+
+	if (nl->bitmaps)
+		for (b = 0; b < nl->img.nBlocks; b++)
+			free (nl->bitmaps[b]);
+	free (nl->bitmaps);
+	if (nl->directFd >= 0)
+		close (nl->directFd);
+	vdImageClose (&nl->img);
+	pthread_mutex_destroy (&nl->bitmapLock);
+	free (nl);
+}
+
+// Opens one image of a chain.  This needs nothing from the images below, so layers can be opened
+// in parallel and stacked afterwards.
+static int
+layerOpen (const char *filename, int readonly, int direct, NativeLayer ** layer)
+{
+	NativeLayer *nl;
+	uint32_t i;
+	int ret;
+
+	if ((nl = calloc (1, sizeof (NativeLayer))) == NULL)
+		return -ENOMEM;
+	if ((ret = vdImageOpen (&nl->img, filename, !readonly)) < 0)
+	{
+		free (nl);
+		return ret;
+	}
+// VMDK images are only read, and only single file sparse ones
+	if (nl->img.kind == VDIMAGE_UNKNOWN
+			|| (nl->img.kind == VDIMAGE_VMDK && (!nl->img.blockMap || !readonly)))
+	{
+		ret = (nl->img.kind == VDIMAGE_VMDK && nl->img.blockMap) ? -EROFS : -ENOTSUP;
+		vdImageClose (&nl->img);
+		free (nl);
+		return ret;
+	}
+	nl->writable = !readonly;
+	pthread_mutex_init (&nl->bitmapLock, NULL);
+
+	if (nl->img.kind == VDIMAGE_VDI)
+	{
+		for (i = 0; i < nl->img.nBlocks; i++)
+			if (nl->img.blockMap[i] < VDIMAGE_BLOCK_ZERO && nl->img.blockMap[i] >= nl->nextBlock)
+				nl->nextBlock = nl->img.blockMap[i] + 1;
+	}
+	else if (nl->img.blockMap)
+	{
+		struct stat st;
+		if (fstat (nl->img.fd, &st) < 0
+				|| (ret = preadFull (nl->img.fd, nl->footer, VHD_FOOTER_SIZE,
+														 st.st_size - VHD_FOOTER_SIZE)) < 0
+				|| (nl->bitmaps = calloc (nl->img.nBlocks, sizeof (uint8_t *))) == NULL)
+		{
+			ret = ret ? ret : -errno;
+			vdImageClose (&nl->img);
+			free (nl);
+			return ret ? ret : -ENOMEM;
+		}
+		nl->fileEnd = st.st_size - VHD_FOOTER_SIZE;
+	}
+	nl->directFd = -1;
+	if (direct)
+		directOpen (nl, filename);
+	*layer = nl;
+	return 0;
+}
+
+// Puts nl on top of the chain, or frees it if it cannot go there
+static int
+layerPush (VDNative * d, NativeLayer * nl)
+{
+// Only a VDI or differencing VHD image can sit on top of another one
+	if (d->nLayers == NATIVE_LAYERS_MAX
+			|| (d->nLayers == 0 && nl->img.kind == VDIMAGE_VHD_DIFF)
+			|| (d->nLayers > 0 && nl->img.kind != VDIMAGE_VDI && nl->img.kind != VDIMAGE_VHD_DIFF))
+	{
+		layerFree (nl);
+		return (d->nLayers == NATIVE_LAYERS_MAX) ? -EMLINK : -ENOTSUP;
+	}
+	pthread_rwlock_wrlock (&d->lock);
+	d->layers[d->nLayers++] = nl;
+	pthread_rwlock_unlock (&d->lock);
+	return 0;
+}
+
+int
+vdNativeOpen (VDNative * d, const char *filename, int readonly)
+{
+	NativeLayer *nl;
+	int ret;
+
+	if ((ret = layerOpen (filename, readonly, d->direct, &nl)) < 0)
+		return ret;
+	return layerPush (d, nl);
+}
+
+typedef struct
+{
+	const char *const *filenames;
+	int n;
+	int readonly;
+	int direct;
+	int next;											// index of the next layer to open
+	NativeLayer **layers;
+	int *ret;
+	uint64_t *openNs;
+} LayerOpening;
+
+static void *
+layerOpenThread (void *arg)
+{
+	LayerOpening *o = arg;
+	struct timespec t0, t1;
+	int l;
+
+	while ((l = __sync_fetch_and_add (&o->next, 1)) < o->n)
+	{
+		clock_gettime (CLOCK_MONOTONIC, &t0);
+		o->ret[l] = layerOpen (o->filenames[l], o->readonly, o->direct, &o->layers[l]);
+		clock_gettime (CLOCK_MONOTONIC, &t1);
+		if (o->openNs)
+			o->openNs[l] = (uint64_t) (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec;
+	}
+	return NULL;
+}
+
+int
+vdNativeOpenLayers (VDNative * d, const char *const *filenames, int n, int readonly, uint64_t * openNs)
+{
+	LayerOpening o = { filenames, n, readonly, d->direct, 0, NULL, NULL, openNs };
+	pthread_t threads[NATIVE_OPEN_THREADS];
+	int nThreads = 0, l, ret = 0;
+
+	o.layers = calloc (n, sizeof (NativeLayer *));
+	o.ret = calloc (n, sizeof (int));
+	if (!o.layers || !o.ret)
+		ret = -ENOMEM;
+	for (; ret == 0 && nThreads < n && nThreads < NATIVE_OPEN_THREADS; nThreads++)
+		if (pthread_create (&threads[nThreads], NULL, layerOpenThread, &o) != 0)
+			break;
+	if (ret == 0 && nThreads == 0)
+		layerOpenThread (&o);				// no threads to be had, open them one by one
+	for (l = 0; l < nThreads; l++)
+		pthread_join (threads[l], NULL);
+
+	for (l = 0; l < n && o.layers; l++)
+	{
+		if (ret == 0 && o.ret[l] < 0)
+			ret = o.ret[l];
+		if (ret == 0)
+			ret = layerPush (d, o.layers[l]);
+		else if (o.layers[l])
+			layerFree (o.layers[l]);
+	}
+	free (o.layers);
+	free (o.ret);
+	return ret;
+}
+
+int
+vdNativeRead (VDNative * d, uint64_t offset, void *buf, size_t len)
+{
+	int ret;
+
+	if (d->nLayers == 0 || offset + len > vdNativeSize (d))
+		return -EINVAL;
+	pthread_rwlock_rdlock (&d->lock);
+	ret = readLayerNow (d, d->nLayers - 1, offset, buf, len);
+	pthread_rwlock_unlock (&d->lock);
+	return ret;
+}
+
+int
+vdNativeWrite (VDNative * d, uint64_t offset, const void *buf, size_t len)
+{
+	int ret;
+
+	if (d->nLayers == 0 || offset + len > vdNativeSize (d))
+		return -EINVAL;
+	if (!d->layers[d->nLayers - 1]->writable)
+		return -EROFS;
+	pthread_rwlock_wrlock (&d->lock);
+	ret = writeLayer (d, d->nLayers - 1, offset, buf, len);
+	pthread_rwlock_unlock (&d->lock);
+	return ret;
+}
+
+int
+vdNativeFlush (VDNative * d)
+{
+	int l, ret = 0;
+
+	pthread_rwlock_rdlock (&d->lock);
+	for (l = 0; l < d->nLayers; l++)
+		if (d->layers[l]->writable && fdatasync (d->layers[l]->img.fd) < 0)
+			ret = -errno;
+	pthread_rwlock_unlock (&d->lock);
+	return ret;
+}
+
+int
+vdNativeSetDirect (VDNative * d, int direct)
+{
+	d->direct = direct;
+	return 0;
+}
+
+int
+vdNativeDirectLayers (VDNative * d)
+{
+	int l, n = 0;
+
+	for (l = 0; l < d->nLayers; l++)
+		n += (d->layers[l]->directFd >= 0);
+	return n;
+}
+
+const char *
+vdNativeIOName (VDNative * d)
+{
+	static const char *names[] = { "auto", "io_uring", "threads", "sync" };
+	return names[d->io];
+}
+
+uint64_t
+vdNativeSize (VDNative * d)
+{
+	return d->nLayers ? d->layers[0]->img.size : 0;
+}
+
+void
+vdNativeClose (VDNative * d)
+{
+	int l;
+
+	grainStop (d);
+	pthread_rwlock_wrlock (&d->lock);
+	for (l = 0; l < d->nLayers; l++)
+		layerFree (d->layers[l]);
+	d->nLayers = 0;
+	pthread_rwlock_unlock (&d->lock);
+}
@@ -0,0 +1,61 @@
+/* Built-in reader / writer for raw, VDI, VHD and VMDK images			*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef VDNATIVE_H
+#define VDNATIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Mirrors the subset of the VD API vdfuse uses.  Images are stacked with vdNativeOpen in the same
+// order as VDOpen, base image first, and all functions return 0 or a negative errno.  Unlike a
+// VBOXHDD container a VDNative disk may be used from several threads at once.
+
+typedef struct VDNative VDNative;
+
+// How the file reads and writes making up a request are done: all submitted at once to io_uring,
+// spread over a thread pool, or one after the other.  AUTO, the default, is io_uring if the kernel
+// has it and the thread pool otherwise.
+typedef enum
+{
+	VDNATIVE_IO_AUTO = 0,
+	VDNATIVE_IO_URING,
+	VDNATIVE_IO_THREADS,
+	VDNATIVE_IO_SYNC
+} VDNativeIO;
+
+int vdNativeCreate (VDNative ** disk);
+// Returns -ENOSYS for VDNATIVE_IO_URING without io_uring
+int vdNativeSetIO (VDNative * disk, VDNativeIO io);
+const char *vdNativeIOName (VDNative * disk);
+// Images opened after this read and write their data with O_DIRECT, where their file system
+// allows it, bypassing the host page cache.  vdNativeDirectLayers counts the images that do.
+int vdNativeSetDirect (VDNative * disk, int direct);
+int vdNativeDirectLayers (VDNative * disk);
+int vdNativeOpen (VDNative * disk, const char *filename, int readonly);
+// Opens n images at once and stacks them in order, as n calls of vdNativeOpen would.  If openNs
+// is not NULL it receives the time each image took to open.
+int vdNativeOpenLayers (VDNative * disk, const char *const *filenames, int n, int readonly,
+												uint64_t * openNs);
+int vdNativeRead (VDNative * disk, uint64_t offset, void *buf, size_t len);
+int vdNativeWrite (VDNative * disk, uint64_t offset, const void *buf, size_t len);
+int vdNativeFlush (VDNative * disk);
+uint64_t vdNativeSize (VDNative * disk);
+void vdNativeClose (VDNative * disk);
+
+#endif
@@ -0,0 +1,463 @@
+/* Replays request traces captured by vdfuse -o trace=FILE				*
+ *  																	*
+ *  Copyright 2009-2011, 2013 by it's authors.  						*
+ *  Some rights reserved. See COPYING, AUTHORS.							*
+ *																		*
+ * This program is free software: you can redistribute it and/or modify *
+ * it under the terms of the GNU General Public License as published by *
+ * the Free Software Foundation, either version 2 of the License, or    *
+ * (at your option) any later version.                                  *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+/* DESCRIPTION
+ * Issues the requests of a trace again, either through a vdfuse mount (-m) to measure the whole
+ * stack with different cache, read-ahead or thread settings, or straight against the image files
+ * with the built-in backend (-i) to measure the image layer alone.  Requests run on as many threads
+ * as served them originally, each thread replaying the requests of one traced thread in order, so
+ * the original concurrency is kept.  By default every request waits for its original start time;
+ * -x speeds that up and -a drops it to replay as fast as possible.
+ *
+ * Writes are skipped unless -w is given, since replaying them overwrites the disk with a pattern.
+ * Through a mount a flush is replayed by closing a duplicate descriptor, which is what makes the
+ * kernel send one.
+ *
+ * The report gives the throughput and latency percentiles per operation, next to the latencies
+ * recorded in the trace.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vdfuse.h"
+#include "vdnative.h"
+
+#define REPLAY_THREADS_MAX 64
+#define REPLAY_OPS (VDFUSE_TRACE_FSYNC + 1)
+#define DIFFERENCING_MAX 100
+
+typedef struct
+{
+	uint64_t *ns;
+	size_t count;
+	size_t capacity;
+	uint64_t bytes;
+} Latencies;
+
+typedef struct
+{
+	size_t *index;								// this thread's records, in time order
+	size_t count;
+	size_t capacity;
+	int *fd;											// per partition, opened on first use
+	Latencies lat[REPLAY_OPS];
+	uint64_t errors;
+	uint64_t skipped;
+} Replayer;
+
+static const char *opNames[REPLAY_OPS] = { "read", "write", "flush", "fsync" };
+
+static struct vdfuse_trace *records;
+static size_t nRecords;
+static const char *mountpoint = NULL;
+static VDNative *disk = NULL;
+static int writes = 0;
+static int asFastAsPossible = 0;
+static double speed = 1;
+static uint64_t startTime;
+static int maxPartition = 0;
+static uint32_t maxLength = 0;
+
+static void
+die (const char *format, const char *arg)
+{
+	fprintf (stderr, "vdreplay: ");
+	fprintf (stderr, format, arg);
+	fprintf (stderr, "\n");
+	exit (1);
+}
+
+static uint64_t
+now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compareTime (const void *a, const void *b)
+{
+	uint64_t x = ((const struct vdfuse_trace *) a)->time, y = ((const struct vdfuse_trace *) b)->time;
+	return (x > y) - (x < y);
+}
+
+static int
+compareNs (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static int
+compareId (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+addLatency (Latencies * l, uint64_t ns, uint64_t bytes)
+{
+	if (l->count == l->capacity)
+	{
+		size_t capacity = l->capacity ? l->capacity * 2 : 1024;
+		uint64_t *grown = realloc (l->ns, capacity * sizeof (uint64_t));
+		if (!grown)
+			die ("%s", "out of memory");
+		l->ns = grown;
+		l->capacity = capacity;
+	}
+	l->ns[l->count++] = ns;
+	l->bytes += bytes;
+}
+
+static void
+loadTrace (const char *name)
+{
+	struct vdfuse_trace_header h;
+	FILE *f = fopen (name, "r");
+	size_t capacity = 0;
+
+	if (!f)
+		die ("cannot open %s", name);
+	if (fread (&h, sizeof (h), 1, f) != 1 || memcmp (h.magic, VDFUSE_TRACE_MAGIC, sizeof (h.magic)) != 0)
+		die ("%s is not a vdfuse trace", name);
+	if (h.version != VDFUSE_TRACE_VERSION || h.recordSize != sizeof (struct vdfuse_trace))
+		die ("%s was written by an incompatible vdfuse", name);
+	for (;;)
+	{
+		if (nRecords == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 65536;
+			if ((records = realloc (records, capacity * sizeof (struct vdfuse_trace))) == NULL)
+				die ("%s", "out of memory");
+		}
+		if (fread (records + nRecords, sizeof (struct vdfuse_trace), 1, f) != 1)
+			break;
+		if (records[nRecords].op < REPLAY_OPS)
+			nRecords++;
+	}
+	fclose (f);
+	qsort (records, nRecords, sizeof (struct vdfuse_trace), compareTime);
+}
+
+static int
+partitionFile (Replayer * r, int partition)
+{
+	char path[PATH_MAX];
+
+	if (r->fd[partition] >= 0)
+		return r->fd[partition];
+	if (partition == 0)
+		snprintf (path, sizeof (path), "%s/EntireDisk", mountpoint);
+	else
+		snprintf (path, sizeof (path), "%s/Partition%d", mountpoint, partition);
+	r->fd[partition] = open (path, writes ? O_RDWR : O_RDONLY);
+	return r->fd[partition];
+}
+
+// Issues one request and returns whether it succeeded
+static int
+issue (Replayer * r, const struct vdfuse_trace *t, char *buf)
+{
+	int fd;
+
+	if (disk)
+	{
+		switch (t->op)
+		{
+			case VDFUSE_TRACE_READ:
+				return vdNativeRead (disk, t->diskOffset, buf, t->length) == 0;
+			case VDFUSE_TRACE_WRITE:
+				return vdNativeWrite (disk, t->diskOffset, buf, t->length) == 0;
+			default:
+				return vdNativeFlush (disk) == 0;
+		}
+	}
+	if ((fd = partitionFile (r, t->partition)) < 0)
+		return 0;
+	switch (t->op)
+	{
+		case VDFUSE_TRACE_READ:
+			return pread (fd, buf, t->length, t->offset) == (ssize_t) t->length;
+		case VDFUSE_TRACE_WRITE:
+			return pwrite (fd, buf, t->length, t->offset) == (ssize_t) t->length;
+		case VDFUSE_TRACE_FLUSH:
+			return close (dup (fd)) == 0;
+		default:
+			return fsync (fd) == 0;
+	}
+}
+
+static void *
+replay (void *arg)
+{
+	Replayer *r = arg;
+	char *buf;
+	size_t i;
+
+	if (posix_memalign ((void **) &buf, 4096, maxLength ? maxLength : 1) != 0)
+		die ("%s", "out of memory");
+	memset (buf, 0x5a, maxLength);
+	for (i = 0; i < r->count; i++)
+	{
+		const struct vdfuse_trace *t = records + r->index[i];
+		uint64_t start;
+
+		if (t->op == VDFUSE_TRACE_WRITE && !writes)
+		{
+			r->skipped++;
+			continue;
+		}
+		if (!asFastAsPossible)
+		{
+			uint64_t due = startTime + (uint64_t) (t->time / speed);
+			struct timespec ts = { due / 1000000000, due % 1000000000 };
+			while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+		}
+		start = now ();
+		if (!issue (r, t, buf))
+			r->errors++;
+		addLatency (&r->lat[t->op], now () - start, t->length);
+	}
+	free (buf);
+	return NULL;
+}
+
+static double
+percentile (const Latencies * l, double p)
+{
+	size_t i = (size_t) (p * l->count);
+	if (l->count == 0)
+		return 0;
+	return l->ns[i < l->count ? i : l->count - 1] / 1000.0;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [-a | -x speed] [-t threads] [-w] [-j] -m mountpoint trace\n"
+					 "       %s [-a | -x speed] [-t threads] [-w] [-j] -i image [-s differencing-image] trace\n"
+					 "\t-m\treplay through a vdfuse mount\n"
+					 "\t-i\treplay against the image with the built-in backend, -s adds differencing images\n"
+					 "\t-a\tas fast as possible instead of at the original times\n"
+					 "\t-x\tspeed up the original timing by this factor\n"
+					 "\t-t\tnumber of threads (default: as many as were traced, up to %d)\n"
+					 "\t-w\talso replay writes, which overwrite the disk with a pattern\n"
+					 "\t-j\treport as JSON\n", name, name, REPLAY_THREADS_MAX);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *image[DIFFERENCING_MAX + 1];
+	int nImages = 0, threads = 0, json = 0, c, i, op;
+	Replayer *replayers;
+	pthread_t *tids;
+	Latencies traced[REPLAY_OPS], replayed[REPLAY_OPS];
+	uint64_t errors = 0, skipped = 0, elapsed, tracedSpan;
+	uint32_t *ids;
+	size_t k, nIds = 0;
+
+	while ((c = getopt (argc, argv, "ax:t:wjm:i:s:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'a':
+				asFastAsPossible = 1;
+				break;
+			case 'x':
+				if ((speed = atof (optarg)) <= 0)
+					die ("%s", "-x takes a positive speed up factor");
+				break;
+			case 't':
+				if ((threads = atoi (optarg)) < 1 || threads > REPLAY_THREADS_MAX)
+					die ("%s", "-t takes a number of threads");
+				break;
+			case 'w':
+				writes = 1;
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'm':
+				mountpoint = optarg;
+				break;
+			case 'i':
+				if (nImages > 0)
+					die ("%s", "give differencing images with -s");
+				image[nImages++] = optarg;
+				break;
+			case 's':
+				if (nImages == 0 || nImages > DIFFERENCING_MAX)
+					die ("%s", "-s needs a base image given with -i first");
+				image[nImages++] = optarg;
+				break;
+			default:
+				usage (argv[0]);
+		}
+	}
+	if (argc - optind != 1 || (mountpoint == NULL) == (nImages == 0))
+		usage (argv[0]);
+	loadTrace (argv[optind]);
+	if (nRecords == 0)
+		die ("%s holds no requests", argv[optind]);
+
+	if (nImages)
+	{
+		if (vdNativeCreate (&disk) < 0)
+			die ("%s", "out of memory");
+		for (i = 0; i < nImages; i++)
+			if (vdNativeOpen (disk, image[i], !writes) < 0)
+				die ("cannot open image %s", image[i]);
+	}
+
+// Each traced thread is replayed by one replay thread, so list the distinct thread numbers
+	memset (traced, 0, sizeof (traced));
+	if ((ids = malloc (nRecords * sizeof (uint32_t))) == NULL)
+		die ("%s", "out of memory");
+	for (k = 0; k < nRecords; k++)
+	{
+		if (records[k].partition > maxPartition)
+			maxPartition = records[k].partition;
+		if (records[k].length > maxLength)
+			maxLength = records[k].length;
+		ids[k] = records[k].thread;
+		addLatency (&traced[records[k].op], records[k].latency, records[k].length);
+	}
+	qsort (ids, nRecords, sizeof (uint32_t), compareId);
+	for (k = 0; k < nRecords; k++)
+		if (nIds == 0 || ids[k] != ids[nIds - 1])
+			ids[nIds++] = ids[k];
+	if (threads == 0)
+		threads = (nIds < REPLAY_THREADS_MAX) ? nIds : REPLAY_THREADS_MAX;
+
+	replayers = calloc (threads, sizeof (Replayer));
+	tids = calloc (threads, sizeof (pthread_t));
+	if (!replayers || !tids)
+		die ("%s", "out of memory");
+	for (i = 0; i < threads; i++)
+	{
+		if ((replayers[i].fd = malloc ((maxPartition + 1) * sizeof (int))) == NULL)
+			die ("%s", "out of memory");
+		for (c = 0; c <= maxPartition; c++)
+			replayers[i].fd[c] = -1;
+	}
+	for (k = 0; k < nRecords; k++)
+	{
+		uint32_t *id = bsearch (&records[k].thread, ids, nIds, sizeof (uint32_t), compareId);
+		Replayer *r = replayers + (id - ids) % threads;
+		if (r->count == r->capacity)
+		{
+			r->capacity = r->capacity ? r->capacity * 2 : 1024;
+			if ((r->index = realloc (r->index, r->capacity * sizeof (size_t))) == NULL)
+				die ("%s", "out of memory");
+		}
+		r->index[r->count++] = k;
+	}
+
+// Shift the trace so its first request is due straight away
+	tracedSpan = records[nRecords - 1].time - records[0].time;
+	for (k = nRecords; k-- > 0;)
+		records[k].time -= records[0].time;
+	startTime = now ();
+	for (i = 0; i < threads; i++)
+		if (pthread_create (tids + i, NULL, replay, replayers + i) != 0)
+			die ("%s", "cannot start the replay threads");
+	for (i = 0; i < threads; i++)
+		pthread_join (tids[i], NULL);
+	elapsed = now () - startTime;
+
+	memset (replayed, 0, sizeof (replayed));
+	for (i = 0; i < threads; i++)
+	{
+		Replayer *r = replayers + i;
+		for (op = 0; op < REPLAY_OPS; op++)
+			for (k = 0; k < r->lat[op].count; k++)
+				addLatency (&replayed[op], r->lat[op].ns[k], 0);
+		for (op = 0; op < REPLAY_OPS; op++)
+			replayed[op].bytes += r->lat[op].bytes;
+		errors += r->errors;
+		skipped += r->skipped;
+		for (c = 0; c <= maxPartition; c++)
+			if (r->fd[c] >= 0)
+				close (r->fd[c]);
+	}
+	if (disk)
+		vdNativeClose (disk);
+	for (op = 0; op < REPLAY_OPS; op++)
+	{
+		qsort (traced[op].ns, traced[op].count, sizeof (uint64_t), compareNs);
+		qsort (replayed[op].ns, replayed[op].count, sizeof (uint64_t), compareNs);
+	}
+
+	if (json)
+	{
+		printf ("{\"mode\": \"%s\", \"timing\": \"%s\", \"speed\": %g, \"threads\": %d, "
+						"\"requests\": %zu, \"seconds\": %.3f, \"traced_seconds\": %.3f, "
+						"\"errors\": %llu, \"skipped_writes\": %llu, \"ops\": {",
+						disk ? "image" : "mount", asFastAsPossible ? "fast" : "original", speed, threads,
+						nRecords, elapsed / 1e9, tracedSpan / 1e9, (unsigned long long) errors,
+						(unsigned long long) skipped);
+		for (op = 0; op < REPLAY_OPS; op++)
+		{
+			Latencies *l = replayed + op, *t = traced + op;
+			printf ("%s\"%s\": {\"count\": %zu, \"bytes\": %llu, \"mib_per_s\": %.2f, \"iops\": %.1f, "
+							"\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, "
+							"\"max\": %.1f}, \"traced_latency_us\": {\"p50\": %.1f, \"p90\": %.1f, "
+							"\"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f}}", op ? ", " : "", opNames[op],
+							l->count, (unsigned long long) l->bytes, l->bytes / (1024.0 * 1024) / (elapsed / 1e9),
+							l->count / (elapsed / 1e9), percentile (l, 0.5), percentile (l, 0.9),
+							percentile (l, 0.99), percentile (l, 0.999), percentile (l, 1),
+							percentile (t, 0.5), percentile (t, 0.9), percentile (t, 0.99),
+							percentile (t, 0.999), percentile (t, 1));
+		}
+		printf ("}}\n");
+		return errors ? 2 : 0;
+	}
+
+	printf ("replayed %zu requests on %d threads in %.3f s (traced over %.3f s), "
+					"%llu errors, %llu writes skipped\n\n", nRecords - skipped, threads, elapsed / 1e9,
+					tracedSpan / 1e9, (unsigned long long) errors, (unsigned long long) skipped);
+	printf ("%-6s %9s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "MiB/s",
+					"IOPS", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "traced p50", "traced p99");
+	for (op = 0; op < REPLAY_OPS; op++)
+	{
+		Latencies *l = replayed + op, *t = traced + op;
+		if (l->count == 0)
+			continue;
+		printf ("%-6s %9zu %10.2f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+						opNames[op], l->count, l->bytes / (1024.0 * 1024) / (elapsed / 1e9),
+						l->count / (elapsed / 1e9), percentile (l, 0.5), percentile (l, 0.9),
+						percentile (l, 0.99), percentile (l, 0.999), percentile (l, 1),
+						percentile (t, 0.5), percentile (t, 0.99));
+	}
+	return errors ? 2 : 0;
+}